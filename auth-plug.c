@@ -94,6 +94,7 @@ struct backend_p {
 	f_getuser *getuser;
 	f_superuser *superuser;
 	f_aclcheck *aclcheck;
+	f_reload *reload;		/* Optional: reload the back-end's data */
 };
 
 int pbkdf2_check(char *password, char *hash);
@@ -139,9 +140,10 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 	ud->auth_cacheseconds = 0;
 	ud->acl_cachejitter = 0;
 	ud->auth_cachejitter = 0;
-	ud->aclcache = NULL;
-	ud->authcache = NULL;
+	cache_init(&ud->aclcache);
+	cache_init(&ud->authcache);
 	ud->clients = NULL;
+	pthread_rwlock_init(&ud->clients_lock, NULL);
 
 	/*
 	 * Shove all options Mosquitto gives the plugin into a hash,
@@ -170,9 +172,9 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			ud->auth_cachejitter = atol(o->value);
 		if (!strcmp(o->key, "log_quiet")) {
 			if(!strcmp(o->value, "false") || !strcmp(o->value, "0")){
-				log_quiet = 0;
+				log_set_quiet(0);
 			}else if(!strcmp(o->value, "true") || !strcmp(o->value, "1")){
-				log_quiet = 1;
+				log_set_quiet(1);
 			}else{
 				_log(LOG_NOTICE, "Error: Invalid log_quiet value (%s).", o->value);
 			}
@@ -183,6 +185,18 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 #endif
 	}
 
+	/*
+	 * Options are read-only from here on, so back-ends and their
+	 * threads can look them up without locking.
+	 */
+
+	p_freeze();
+
+	if ((p = p_stab("check_deadline_ms")) != NULL) {
+		backend_deadline_init(atol(p));
+		_log(LOG_NOTICE, "Each check has %ld ms across all back-ends", backend_deadline_ms());
+	}
+
 	/*
 	 * Set up back-ends, and tell them to initialize themselves.
 	 */
@@ -296,6 +310,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			(*bep)->getuser =  be_cdb_getuser;
 			(*bep)->superuser =  be_cdb_superuser;
 			(*bep)->aclcheck =  be_cdb_aclcheck;
+			(*bep)->reload =  be_cdb_reload;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -315,6 +330,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			(*bep)->getuser =  be_sqlite_getuser;
 			(*bep)->superuser =  be_sqlite_superuser;
 			(*bep)->aclcheck =  be_sqlite_aclcheck;
+			(*bep)->reload =  be_sqlite_reload;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -453,23 +469,11 @@ int mosquitto_auth_plugin_cleanup(void *userdata, struct mosquitto_auth_opt *aut
 		free(ud->superusers);
 	if (ud->anonusername)
 		free(ud->anonusername);
-	if (ud->aclcache != NULL) {
-		struct cacheentry *a, *tmp;
-
-		HASH_ITER(hh, ud->aclcache, a, tmp) {
-			HASH_DEL(ud->aclcache, a);
-			free(a);
-		}
-	}
+	cache_free(&ud->aclcache);
+	cache_free(&ud->authcache);
 
-	if (ud->authcache != NULL) {
-		struct cacheentry *a, *tmp;
-
-		HASH_ITER(hh, ud->authcache, a, tmp) {
-			HASH_DEL(ud->authcache, a);
-			free(a);
-		}
-	}
+	client_free(ud);
+	pthread_rwlock_destroy(&ud->clients_lock);
 
 	if (ud->be_list) {
 		struct backend_p **bep;
@@ -489,6 +493,21 @@ int mosquitto_auth_plugin_cleanup(void *userdata, struct mosquitto_auth_opt *aut
 
 int mosquitto_auth_security_init(void *userdata, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
 {
+	struct userdata *ud = (struct userdata *)userdata;
+	struct backend_p **bep;
+
+	/*
+	 * On SIGHUP, back-ends which serve local files re-read them. They
+	 * do so in the background and keep answering from the old data
+	 * until the new one is ready.
+	 */
+
+	if (reload) {
+		for (bep = ud->be_list; bep && *bep; bep++) {
+			if ((*bep)->reload)
+				(*bep)->reload((*bep)->conf);
+		}
+	}
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -507,7 +526,7 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 	struct userdata *ud = (struct userdata *)userdata;
 	struct backend_p **bep;
 	char *phash = NULL, *backend_name = NULL;
-	int match, authenticated = FALSE, nord, granted, rc, has_error = FALSE;
+	int match, authenticated = FALSE, nord, nbackends, granted, rc, has_error = FALSE;
 
 	if (!username || !*username || !password || !*password)
 		return MOSQ_DENY_AUTH;
@@ -515,20 +534,7 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 	_log(LOG_DEBUG, "mosquitto_auth_unpwd_check(%s)", (username) ? username : "<nil>");
 
 #if MOSQ_AUTH_PLUGIN_VERSION >=3
-	struct cliententry *e;
-	HASH_FIND(hh, ud->clients, &client, sizeof(void *), e);
-	if (e) {
-		free(e->username);
-		free(e->clientid);
-		e->username = strdup(username);
-		e->clientid = strdup("client id not available");
-	} else {
-		e = (struct cliententry *)malloc(sizeof(struct cliententry));
-		e->key = (void *)client;
-		e->username = strdup(username);
-		e->clientid = strdup("client id not available");
-		HASH_ADD(hh, ud->clients, key, sizeof(void *), e);
-	}
+	client_put(client, username, "client id not available", userdata);
 #endif
 
 	granted = auth_cache_q(username, password, userdata);
@@ -538,9 +544,20 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 		return granted;
 	}
 
+	backend_ttl_reset();
+	backend_deadline_start();
+	for (nbackends = 0, bep = ud->be_list; bep && *bep; bep++)
+		nbackends++;
 	for (nord = 0, bep = ud->be_list; bep && *bep; bep++, nord++) {
 		struct backend_p *b = *bep;
 
+		if (backend_deadline_expired()) {
+			_log(LOG_NOTICE, "getuser(%s) out of time before %s", username, b->name);
+			has_error = TRUE;
+			break;
+		}
+		backend_deadline_slice(nbackends - nord);
+
 		_log(LOG_DEBUG, "** checking backend %s", b->name);
 
 		/*
@@ -597,39 +614,13 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 	return granted;
 }
 
-#if MOSQ_AUTH_PLUGIN_VERSION >= 3
-int mosquitto_auth_acl_check(void *userdata, int access, const struct mosquitto *client, const struct mosquitto_acl_msg *msg)
-#else
-int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *username, const char *topic, int access)
-#endif
+static int acl_check(void *userdata, const char *clientid, const char *username, const char *topic, int access)
 {
 	struct userdata *ud = (struct userdata *)userdata;
 	struct backend_p **bep;
 	char *backend_name = NULL;
 	int match = 0, authorized = FALSE, has_error = FALSE;
-	int granted = MOSQ_DENY_ACL;
-#if MOSQ_AUTH_PLUGIN_VERSION >= 3
-	struct cliententry *e;
-	const char *clientid = NULL;
-	const char *username = NULL;
-	const char *topic = msg->topic;
-	HASH_FIND(hh, ud->clients, &client, sizeof(void *), e);
-	if (e) {
-		clientid = e->clientid;
-		username = e->username;
-	} else {
-		bool client_cert = (mosquitto_client_certificate(client) != NULL);
-
-		if (client_cert == true) {
-			clientid = mosquitto_client_id(client);
-			username = mosquitto_client_username(client);
-		}
-
-		if (client_cert == false || clientid == NULL || username == NULL) {
-			return MOSQ_ERR_PLUGIN_DEFER;
-		}
-	}
-#endif
+	int granted = MOSQ_DENY_ACL, calls_left;
 
 	if (!username || !*username) { 	// anonymous users
 		username = ud->anonusername;
@@ -666,6 +657,7 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 		return (granted);
 	}
 
+	backend_ttl_reset();
 	if (!username || !*username || !topic || !*topic) {
 		granted =  MOSQ_DENY_ACL;
 		goto outout;
@@ -683,9 +675,21 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 		}
 	}
 
-	for (bep = ud->be_list; bep && *bep; bep++) {
+	/*
+	 * Each back-end may be asked twice, as to superuser and then
+	 * for the ACL, and each call gets its share of the deadline.
+	 */
+
+	backend_deadline_start();
+	for (calls_left = 0, bep = ud->be_list; bep && *bep; bep++)
+		calls_left += 2;
+
+	for (bep = ud->be_list; bep && *bep; bep++, calls_left--) {
 		struct backend_p *b = *bep;
 
+		if (backend_deadline_expired())
+			goto late;
+		backend_deadline_slice(calls_left);
 		match = b->superuser(b->conf, username);
 		if (match == BACKEND_ALLOW) {
 			_log(LOG_DEBUG, "aclcheck(%s, %s, %d) SUPERUSER=Y by %s",
@@ -708,9 +712,12 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	 * Check authorization in the back-end used to authenticate the user.
 	 */
 
-	for (bep = ud->be_list; bep && *bep; bep++) {
+	for (bep = ud->be_list; bep && *bep; bep++, calls_left--) {
 		struct backend_p *b = *bep;
 
+		if (backend_deadline_expired())
+			goto late;
+		backend_deadline_slice(calls_left);
 		match = b->aclcheck((*bep)->conf, clientid, username, topic, access);
 		if (match == BACKEND_ALLOW) {
 			backend_name = b->name;
@@ -733,6 +740,12 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 		username, topic, access, authorized, (backend_name) ? backend_name : "none");
 
 	granted = (authorized) ?  MOSQ_ERR_SUCCESS : MOSQ_DENY_ACL;
+	goto outout;
+
+   late:
+	_log(LOG_NOTICE, "aclcheck(%s, %s, %d) out of time", username, topic, access);
+	has_error = TRUE;
+	granted = MOSQ_DENY_ACL;
 
    outout:	/* goto fail goto fail */
 
@@ -747,6 +760,39 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 
 }
 
+#if MOSQ_AUTH_PLUGIN_VERSION >= 3
+int mosquitto_auth_acl_check(void *userdata, int access, const struct mosquitto *client, const struct mosquitto_acl_msg *msg)
+{
+	char *clientid = NULL, *username = NULL;
+	int granted;
+
+	/*
+	 * Work on copies of the names: the entry may be replaced by a
+	 * concurrent login while the back-ends are queried.
+	 */
+
+	if (!client_get(client, &username, &clientid, userdata)) {
+		bool client_cert = (mosquitto_client_certificate(client) != NULL);
+
+		if (client_cert == false || mosquitto_client_id(client) == NULL || mosquitto_client_username(client) == NULL) {
+			return MOSQ_ERR_PLUGIN_DEFER;
+		}
+		return acl_check(userdata, mosquitto_client_id(client), mosquitto_client_username(client), msg->topic, access);
+	}
+
+	granted = acl_check(userdata, clientid, username, msg->topic, access);
+	free(clientid);
+	free(username);
+
+	return (granted);
+}
+#else
+int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *username, const char *topic, int access)
+{
+	return acl_check(userdata, clientid, username, topic, access);
+}
+#endif
+
 
 #if MOSQ_AUTH_PLUGIN_VERSION >= 3
 int mosquitto_auth_psk_key_get(void *userdata, const struct mosquitto *client, const char *hint, const char *identity, char *key, int max_key_len)
@@ -766,6 +812,7 @@ int mosquitto_auth_psk_key_get(void *userdata, const char *hint, const char *ide
 	username = (char *)identity;
 
 	rc = BACKEND_DENY;
+	backend_deadline_start();
 	for (bep = ud->be_list; bep && *bep; bep++) {
 		struct backend_p *b = *bep;
 		if (!strcmp(database, b->name)) {
@@ -31,7 +31,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <mosquitto.h>
 #include "backends.h"
+#include "json.h"
+#include "log.h"
 
 /*
  * Search through `in' for tokens %c (clientid) and %u (username); build a
@@ -81,3 +87,170 @@ void t_expand(const char *clientid, const char *username, const char *in, char *
 
 	*res = work;
 }
+
+/* The time `ms' milliseconds from now, for pthread_cond_timedwait() */
+void deadline_after(long ms, struct timespec *ts)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec + ms / 1000;
+	ts->tv_nsec = tv.tv_usec * 1000L + (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static __thread long ttl_hint = -1;
+
+void backend_ttl(long seconds)
+{
+	if (seconds < 0)
+		seconds = 0;
+	if (ttl_hint < 0 || seconds < ttl_hint)
+		ttl_hint = seconds;
+}
+
+void backend_ttl_reset(void)
+{
+	ttl_hint = -1;
+}
+
+/* The hint given since the last reset, or -1 */
+long backend_ttl_get(void)
+{
+	return (ttl_hint);
+}
+
+static long deadline_ms = 0;		/* check_deadline_ms, 0 if none */
+static __thread long long check_deadline;	/* When the check is out of time */
+static __thread long long slice_deadline;	/* When the back-end asked is */
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/* Called once, before any check */
+void backend_deadline_init(long ms)
+{
+	deadline_ms = (ms > 0) ? ms : 0;
+}
+
+long backend_deadline_ms(void)
+{
+	return (deadline_ms);
+}
+
+void backend_deadline_start(void)
+{
+	check_deadline = slice_deadline = now_ms() + deadline_ms;
+}
+
+/*
+ * Give the back-end about to be asked an equal share of what is left,
+ * with `calls_left' calls, its own included, still to be made. A
+ * back-end which answers early leaves the rest to those after it.
+ */
+
+void backend_deadline_slice(int calls_left)
+{
+	long long now = now_ms();
+
+	if (calls_left < 1)
+		calls_left = 1;
+	slice_deadline = (check_deadline > now) ? now + (check_deadline - now) / calls_left : now;
+}
+
+int backend_deadline_expired(void)
+{
+	return (deadline_ms > 0 && check_deadline > 0 && now_ms() >= check_deadline);
+}
+
+/*
+ * How long the back-end being asked may wait on its next call: `ms', its
+ * own limit or 0 for none, cut to what is left of its share. Returns 0
+ * for no limit, and -1 once its share is spent. Without
+ * check_deadline_ms, or on a thread of the plugin's own, that is `ms'.
+ */
+
+long backend_timeout(long ms)
+{
+	long long left;
+
+	if (deadline_ms == 0 || slice_deadline == 0)
+		return (ms);
+	if ((left = slice_deadline - now_ms()) <= 0)
+		return (-1);
+	return ((ms > 0 && ms < left) ? ms : (long)left);
+}
+
+/* The access mask of a rule: a number, a word, or all if not given */
+int backend_rule_mask(struct json *access)
+{
+	if (access == NULL)
+		return (BACKEND_ACL_ALL);
+	if (access->type == JSON_NUMBER)
+		return ((int)access->number);
+	if (access->type == JSON_STRING) {
+		/* Mosquitto 1.5 and later check a SUBSCRIBE on its own */
+		if (strcmp(access->string, "read") == 0)
+			return (1 | 4);
+		if (strcmp(access->string, "write") == 0)
+			return (2);
+		if (strcmp(access->string, "readwrite") == 0)
+			return (BACKEND_ACL_ALL);
+		if (strcmp(access->string, "subscribe") == 0)
+			return (4);
+	}
+	return (0);
+}
+
+/*
+ * The `len' bytes at `v' are a rule as text. Sets *mask, to all access
+ * if the rule has none, and returns where its pattern starts. A long run
+ * of digits stops growing the mask rather than overflow it.
+ */
+const char *backend_rule_parse(const char *v, size_t len, int *mask)
+{
+	const char *p;
+	int m = 0;
+
+	for (p = v; p < v + len && *p >= '0' && *p <= '9'; p++) {
+		if (m <= (INT_MAX - 9) / 10)
+			m = m * 10 + (*p - '0');
+	}
+	if (p > v && p < v + len && *p == ' ') {
+		*mask = m;
+		return (p + 1);
+	}
+	*mask = BACKEND_ACL_ALL;
+	return (v);
+}
+
+int backend_rules_aclcheck(const char *name, struct backend_rule *rules, int nrules, const char *clientid, const char *username, const char *topic, int acc)
+{
+	int n, match = BACKEND_DEFER;
+	char *expanded;
+	bool bf;
+
+	for (n = 0; n < nrules && match == BACKEND_DEFER; n++) {
+		if ((rules[n].mask & acc) != acc)
+			continue;
+		t_expand(clientid, username, rules[n].pattern, &expanded);
+		if (expanded && *expanded) {
+			bf = false;
+			mosquitto_topic_matches_sub(expanded, topic, &bf);
+			_log(LOG_DEBUG, "  %s: topic_matches(%s, %s) == %d",
+			     name, expanded, topic, bf);
+			if (bf)
+				match = BACKEND_ALLOW;
+		}
+		free(expanded);
+	}
+	return (match);
+}
@@ -49,11 +49,73 @@
 #ifndef __BACKENDS_H
 # define __BACKENDS_H
 
+#include <stddef.h>
+
 typedef void (f_kill)(void *conf);
 typedef int (f_getuser)(void *conf, const char *username, const char *password, char **phash, const char *clientid);
 typedef int (f_superuser)(void *conf, const char *username);
 typedef int (f_aclcheck)(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+typedef void (f_reload)(void *conf);
 
 void t_expand(const char *clientid, const char *username, const char *in, char **res);
 
+/* The time `ms' milliseconds from now, for pthread_cond_timedwait() */
+struct timespec;
+void deadline_after(long ms, struct timespec *ts);
+
+/*
+ * A back-end which knows how long its answer holds says so with
+ * backend_ttl() while answering; the plugin's cache then keeps the
+ * answer that long, instead of for acl_cacheseconds/auth_cacheseconds,
+ * and 0 keeps it from being cached. The hint belongs to the calling
+ * thread, and if several back-ends give one for a check, the shortest
+ * wins.
+ */
+
+void backend_ttl(long seconds);
+void backend_ttl_reset(void);
+long backend_ttl_get(void);
+
+/*
+ * With check_deadline_ms, an auth or ACL check has that long in all,
+ * across the back-ends it asks and their retries. The plugin starts the
+ * check's clock with backend_deadline_start(), and before asking each
+ * back-end gives it its share of the time left with
+ * backend_deadline_slice(). A back-end asks backend_timeout() how long
+ * it may wait on its next call and passes that on to its client
+ * library; backend_deadline_ms() is the whole budget, for limits which
+ * are set when connecting.
+ */
+
+void backend_deadline_init(long ms);
+long backend_deadline_ms(void);
+void backend_deadline_start(void);
+void backend_deadline_slice(int calls_left);
+int backend_deadline_expired(void);
+long backend_timeout(long ms);
+
+/*
+ * Topic rules which come with an answer or a token: a pattern, in which
+ * %c and %u are substituted, and the access it grants as a mask of 1
+ * (read), 2 (write) and 4 (subscribe). backend_rule_mask() reads the
+ * access of a JSON rule, a number or a word, where "read" includes
+ * subscribing; backend_rule_parse() reads a rule stored as text, a
+ * pattern optionally preceded by a decimal mask and a blank
+ * ("3 sensors/%u/#"). backend_rules_aclcheck() grants `acc' if a rule
+ * matches `topic' with all of the requested bits.
+ */
+
+#define BACKEND_ACL_ALL	(7)	/* Read, write and subscribe */
+
+struct backend_rule {
+	int mask;
+	char *pattern;
+};
+
+struct json;
+
+int backend_rule_mask(struct json *access);
+const char *backend_rule_parse(const char *v, size_t len, int *mask);
+int backend_rules_aclcheck(const char *name, struct backend_rule *rules, int nrules, const char *clientid, const char *username, const char *topic, int acc);
+
 #endif
@@ -40,36 +40,192 @@
 #include "be-cdb.h"
 #include "log.h"
 #include "hash.h"
+#include "watch.h"
+#include "cdb-shard.h"
 
-void *be_cdb_init()
+/*
+ * Lookups work on a private copy of the struct cdb, because cdb_find()
+ * records its result in it; the mapped file itself is only ever read,
+ * so any number of lookups can share it without a lock. A lookup holds
+ * a reference on the map, so that a replaced file stays mapped until
+ * the last lookup using it is done.
+ *
+ * With cdb_shards, the records are spread over several files by the
+ * username they belong to (see cdb-shard.h), and a lookup only maps the
+ * one file which can hold its key.
+ */
+
+struct cdb_map {
+	struct cdb cdb;
+	int refs;			/* Protected by the back-end's lock */
+	int has_acl;			/* The file holds acl: records */
+};
+
+/* Does the file hold any acl: records? If not, every topic is allowed. */
+static int cdb_has_acl(struct cdb *db)
 {
-	struct cdb_backend *conf;
-	char *cdbname;
-	int fd;
+	struct cdb c = *db;
+	unsigned pos;
 
-	if ((cdbname = p_stab("cdbname")) == NULL)
-		_fatal("Mandatory parameter `cdbname' missing");
+	cdb_seqinit(&pos, &c);
+	while (cdb_seqnext(&pos, &c) > 0) {
+		if (cdb_keylen(&c) >= 4 && memcmp(cdb_getkey(&c), "acl:", 4) == 0)
+			return (TRUE);
+	}
+	return (FALSE);
+}
+
+static struct cdb_map *map_open(const char *cdbname)
+{
+	struct cdb_map *map;
+	int fd;
 
 	if ((fd = open(cdbname, O_RDONLY)) == -1) {
 		perror(cdbname);
 		return (NULL);
 	}
+	if ((map = calloc(1, sizeof(struct cdb_map))) == NULL) {
+		close(fd);
+		return (NULL);
+	}
+	if (cdb_init(&map->cdb, fd) != 0) {
+		_log(LOG_NOTICE, "cdb: cannot map %s", cdbname);
+		close(fd);
+		free(map);
+		return (NULL);
+	}
+	map->refs = 1;
+	map->has_acl = cdb_has_acl(&map->cdb);
+	return (map);
+}
+
+static void map_close(struct cdb_map *map)
+{
+	close(cdb_fileno(&map->cdb));
+	cdb_free(&map->cdb);
+	free(map);
+}
+
+/* Take a reference on the current map of the shard holding `key' */
+static struct cdb_map *map_get(struct cdb_backend *conf, const char *key)
+{
+	struct cdb_shard *shard = &conf->shards[0];
+	struct cdb_map *map;
+	int n;
+
+	if (conf->nshards > 1 && (n = cdb_shard_of(key, strlen(key), conf->nshards)) != CDB_SHARD_ALL)
+		shard = &conf->shards[n];
+
+	pthread_mutex_lock(&conf->lock);
+	if ((map = shard->map) != NULL)
+		map->refs++;
+	pthread_mutex_unlock(&conf->lock);
+	return (map);
+}
+
+static void map_put(struct cdb_backend *conf, struct cdb_map *map)
+{
+	int refs;
+
+	pthread_mutex_lock(&conf->lock);
+	refs = --map->refs;
+	pthread_mutex_unlock(&conf->lock);
+	if (refs == 0)
+		map_close(map);
+}
 
-	conf = malloc(sizeof(struct cdb_backend));
+/* Called with the lock held */
+static void update_has_acl(struct cdb_backend *conf)
+{
+	int n;
+
+	conf->has_acl = FALSE;
+	for (n = 0; n < conf->nshards; n++) {
+		if (conf->shards[n].map && conf->shards[n].map->has_acl)
+			conf->has_acl = TRUE;
+	}
+}
+
+/*
+ * Called on the watch thread when a file has been replaced, typically
+ * by `cdb -c' or cdb-shard renaming a temporary file over it.
+ */
+
+static int be_cdb_changed(void *arg)
+{
+	struct cdb_shard *shard = (struct cdb_shard *)arg;
+	struct cdb_backend *conf = shard->conf;
+	struct cdb_map *map, *old;
+
+	if ((map = map_open(shard->cdbname)) == NULL) {
+		_log(LOG_NOTICE, "cdb: keeping the previous %s", shard->cdbname);
+		return (0);
+	}
+
+	pthread_mutex_lock(&conf->lock);
+	old = shard->map;
+	shard->map = map;
+	update_has_acl(conf);
+	pthread_mutex_unlock(&conf->lock);
+
+	if (old)
+		map_put(conf, old);
+	return (1);
+}
+
+void *be_cdb_init()
+{
+	struct cdb_backend *conf;
+	struct cdb_shard *shard;
+	char *cdbname, *list, *s, *tok, *sp;
+	int n;
+
+	if ((list = p_stab("cdb_shards")) == NULL && (cdbname = p_stab("cdbname")) == NULL)
+		_fatal("Mandatory parameter `cdbname' missing");
+
+	conf = calloc(1, sizeof(struct cdb_backend));
 	if (conf == NULL) {
 		return (NULL);
 	}
+	pthread_mutex_init(&conf->lock, NULL);
 
-	conf->cdbname	= strdup(cdbname);
-	conf->cdb	= (struct cdb *)malloc(sizeof(struct cdb));
+	/*
+	 * cdb_shards is a list of files separated by blanks or commas;
+	 * cdbname is a single file, whatever characters its path has.
+	 */
+	if (list == NULL) {
+		shard = conf->shards = calloc(1, sizeof(struct cdb_shard));
+		shard->cdbname = strdup(cdbname);
+		shard->conf = conf;
+		conf->nshards = 1;
+	} else {
+		s = strdup(list);
+		for (tok = strtok_r(s, " ,", &sp); tok; tok = strtok_r(NULL, " ,", &sp)) {
+			conf->shards = realloc(conf->shards, sizeof(struct cdb_shard) * (conf->nshards + 1));
+			shard = &conf->shards[conf->nshards++];
+			memset(shard, 0, sizeof(struct cdb_shard));
+			shard->cdbname = strdup(tok);
+			shard->conf = conf;
+		}
+		free(s);
+	}
 
-	if (conf->cdb == NULL) {
-		free(conf->cdbname);
-		free(conf);
+	if (conf->nshards == 0) {
+		_log(LOG_NOTICE, "cdb: no files in cdb_shards");
+		be_cdb_destroy(conf);
 		return (NULL);
 	}
+	for (n = 0; n < conf->nshards; n++) {
+		if ((conf->shards[n].map = map_open(conf->shards[n].cdbname)) == NULL) {
+			be_cdb_destroy(conf);
+			return (NULL);
+		}
+	}
+	update_has_acl(conf);
 
-	cdb_init(conf->cdb, fd);
+	/* The watches start last: they swap the maps in from now on */
+	for (n = 0; n < conf->nshards; n++)
+		conf->shards[n].watch = watch_new("cdb", conf->shards[n].cdbname, be_cdb_changed, &conf->shards[n]);
 
 	return (conf);
 }
@@ -77,91 +233,225 @@ void *be_cdb_init()
 void be_cdb_destroy(void *handle)
 {
 	struct cdb_backend *conf = (struct cdb_backend *)handle;
+	int n;
 
 	if (conf) {
-		cdb_free(conf->cdb);
-		free(conf->cdbname);
+		for (n = 0; n < conf->nshards; n++) {
+			watch_destroy(conf->shards[n].watch);
+			if (conf->shards[n].map)
+				map_put(conf, conf->shards[n].map);
+			free(conf->shards[n].cdbname);
+		}
+		pthread_mutex_destroy(&conf->lock);
+		free(conf->shards);
 		free(conf);
 	}
 }
 
+/* Remap the files on the watch thread, e.g. when mosquitto is sent a SIGHUP */
+void be_cdb_reload(void *handle)
+{
+	struct cdb_backend *conf = (struct cdb_backend *)handle;
+	int n;
+
+	if (conf) {
+		for (n = 0; n < conf->nshards; n++)
+			watch_poke(conf->shards[n].watch);
+	}
+}
+
 int be_cdb_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct cdb_backend *conf = (struct cdb_backend *)handle;
-	char *k, *v = NULL;
-	unsigned klen;
+	struct cdb_map *map;
+	struct cdb c;
+	char *v = NULL;
+	unsigned vlen;
 
 	if (!conf || !username || !*username)
 		return (FALSE);
 
-	k = (char *)username;
-	klen = strlen(k);
-
-	if (cdb_find(conf->cdb, k, klen) > 0) {
-		int vpos = cdb_datapos(conf->cdb);
-		int vlen = cdb_datalen(conf->cdb);
-
+	if ((map = map_get(conf, username)) == NULL)
+		return (BACKEND_DEFER);
+	c = map->cdb;
+	if (cdb_find(&c, username, strlen(username)) > 0) {
+		vlen = cdb_datalen(&c);
 		if ((v = malloc(vlen + 1)) != NULL) {
-			cdb_read(conf->cdb, v, vlen, vpos);
+			memcpy(v, cdb_getdata(&c), vlen);
 			v[vlen] = 0;
 		}
 	}
+	map_put(conf, map);
 
 	*phash = v;
 	return BACKEND_DEFER;
 }
 
 /*
- * Check access to topic for username. Look values for a key "acl:username"
- * and use mosquitto_topic_matches_sub() to validate the topic.
+ * Compare one topic level against one pattern level, in which %u and %c
+ * stand for the username and the clientid.
  */
 
-int be_cdb_access(void *handle, const char *username, char *topic)
+static int level_eq(const char *p, const char *pe, const char *t, const char *te, const char *clientid, const char *username)
 {
-	struct cdb_backend *conf = (struct cdb_backend *)handle;
-	char *k;
-	unsigned klen;
-	int found = 0;
-	struct cdb_find cdbf;
-	bool bf;
+	const char *s;
+	size_t n;
 
-	if (!conf || !username || !topic)
-		return (0);
+	while (p < pe) {
+		if (*p == '%' && p + 1 < pe && (p[1] == 'u' || p[1] == 'c')) {
+			s = (p[1] == 'u') ? username : clientid;
+			n = (s) ? strlen(s) : 0;
+			if ((size_t)(te - t) < n || memcmp(t, s, n) != 0)
+				return (FALSE);
+			t += n;
+			p += 2;
+		} else {
+			if (t == te || *t != *p)
+				return (FALSE);
+			t++;
+			p++;
+		}
+	}
+	return (t == te);
+}
 
-	if ((k = malloc(strlen(username) + strlen("acl:") + 2)) == NULL)
-		return (0);
-	sprintf(k, "acl:%s", username);
-	klen = strlen(k);
+/*
+ * Match `topic' against the `plen' bytes of a subscription pattern in
+ * the mapped file, which is not NUL-terminated and so is not handed to
+ * mosquitto_topic_matches_sub(). %u and %c are substituted within a
+ * level; a name containing `/', `+' or `#' only ever matches literally.
+ */
 
-	cdb_findinit(&cdbf, conf->cdb, k, klen);
-	while ((cdb_findnext(&cdbf) > 0) && (!found)) {
-		unsigned vpos = cdb_datapos(conf->cdb);
-		unsigned vlen = cdb_datalen(conf->cdb);
-		char *val;
+static int topic_matches(const char *p, unsigned plen, const char *topic, const char *clientid, const char *username)
+{
+	const char *pe = p + plen, *ple, *t = topic, *tle;
+	int tmore = TRUE;
 
-		val = malloc(vlen);
-		cdb_read(conf->cdb, val, vlen, vpos);
+	/* Wildcards at the first level don't match $SYS and friends */
+	if (*topic == '$' && plen > 0 && (*p == '+' || *p == '#'))
+		return (FALSE);
 
-		mosquitto_topic_matches_sub(val, topic, &bf);
-		found |= bf;
+	for (;;) {
+		if ((ple = memchr(p, '/', pe - p)) == NULL)
+			ple = pe;
+		if (ple - p == 1 && *p == '#')
+			return (ple == pe);	/* Also matches the parent level */
+		if (!tmore)
+			return (FALSE);
+		if ((tle = strchr(t, '/')) == NULL)
+			tle = t + strlen(t);
+		if (!(ple - p == 1 && *p == '+') && !level_eq(p, ple, t, tle, clientid, username))
+			return (FALSE);
 
-		free(val);
+		if (*tle == 0)
+			tmore = FALSE;
+		else
+			t = tle + 1;
+		if (ple == pe)
+			return (!tmore);
+		p = ple + 1;
 	}
+}
 
-	free(k);
+/*
+ * Walk the values of `key', each a topic pattern optionally preceded by
+ * an access mask and a blank ("3 sensors/%u/#"). A pattern without a
+ * mask grants every kind of access.
+ */
+
+static int acl_scan(struct cdb *db, const char *key, const char *clientid, const char *username, const char *topic, int acc)
+{
+	struct cdb c = *db;
+	struct cdb_find cdbf;
+	const char *v, *p;
+	unsigned vlen, plen;
+	int mask;
+
+	cdb_findinit(&cdbf, &c, key, strlen(key));
+	while (cdb_findnext(&cdbf) > 0) {
+		v = cdb_getdata(&c);
+		vlen = cdb_datalen(&c);
 
-	return (found > 0);
+		p = backend_rule_parse(v, vlen, &mask);
+		plen = vlen - (p - v);
+
+		if ((mask & acc) == acc && topic_matches(p, plen, topic, clientid, username)) {
+			_log(LOG_DEBUG, "  cdb: %s grants %d on %s", key, acc, topic);
+			return (TRUE);
+		}
+	}
+	return (FALSE);
 }
 
+/*
+ * A user is a superuser if it has a "super:username" record whose value
+ * isn't "0".
+ */
+
 int be_cdb_superuser(void *handle, const char *username)
 {
-	return BACKEND_DEFER;
+	struct cdb_backend *conf = (struct cdb_backend *)handle;
+	struct cdb_map *map;
+	struct cdb c;
+	char *k;
+	int issuper = BACKEND_DEFER;
+
+	if (!conf || !username)
+		return (BACKEND_DEFER);
+
+	if ((k = malloc(strlen(username) + strlen("super:") + 1)) == NULL)
+		return (BACKEND_ERROR);
+	sprintf(k, "super:%s", username);
+
+	if ((map = map_get(conf, k)) != NULL) {
+		c = map->cdb;
+		if (cdb_find(&c, k, strlen(k)) > 0) {
+			if (cdb_datalen(&c) > 0 && !(cdb_datalen(&c) == 1 && *(const char *)cdb_getdata(&c) == '0'))
+				issuper = BACKEND_ALLOW;
+		}
+		map_put(conf, map);
+	}
+	free(k);
+	return (issuper);
 }
 
+/*
+ * Check access to topic for username against the patterns in the
+ * "acl:username" records, then in the "acl:*" records which apply to
+ * every user.
+ */
+
 int be_cdb_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
-	/* FIXME: implement. Currently TRUE */
+	struct cdb_backend *conf = (struct cdb_backend *)handle;
+	struct cdb_map *map;
+	char *k;
+	int match;
+
+	if (!conf || !username || !topic)
+		return (BACKEND_DEFER);
 
-	return BACKEND_ALLOW;
+	pthread_mutex_lock(&conf->lock);
+	match = conf->has_acl;
+	pthread_mutex_unlock(&conf->lock);
+	if (!match)
+		return (BACKEND_ALLOW);
+
+	if ((k = malloc(strlen(username) + strlen("acl:") + 1)) == NULL)
+		return (BACKEND_ERROR);
+	sprintf(k, "acl:%s", username);
+
+	/* The shard holding acl:username also has a copy of acl:* */
+	if ((map = map_get(conf, k)) == NULL) {
+		free(k);
+		return (BACKEND_DEFER);
+	}
+
+	match = acl_scan(&map->cdb, k, clientid, username, topic, acc) ||
+		acl_scan(&map->cdb, "acl:*", clientid, username, topic, acc);
+
+	map_put(conf, map);
+	free(k);
+	return (match) ? BACKEND_ALLOW : BACKEND_DEFER;
 }
 #endif /* BE_CDB */
@@ -29,15 +29,30 @@
 
 #ifdef BE_CDB
 
-struct cdb_backend {
+#include <pthread.h>
+
+struct cdb_map;
+struct cdb_backend;
+struct watch;
+
+struct cdb_shard {
 	char *cdbname;
-	struct cdb *cdb;
+	struct cdb_map *map;		/* The file currently in use */
+	struct watch *watch;		/* Remaps cdbname when it is replaced */
+	struct cdb_backend *conf;
+};
+
+struct cdb_backend {
+	pthread_mutex_t lock;		/* Protects the maps and has_acl */
+	int nshards;
+	struct cdb_shard *shards;	/* One, or those listed in cdb_shards */
+	int has_acl;			/* Any of them holds acl: records */
 };
 
 void *be_cdb_init();
 void be_cdb_destroy(void *handle);
+void be_cdb_reload(void *handle);
 int be_cdb_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid);
-int be_cdb_access(void *handle, const char *username, char *topic);
 int be_cdb_superuser(void *handle, const char *username);
 int be_cdb_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc);
 #endif /* BE_CDB */
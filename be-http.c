@@ -36,11 +36,26 @@
 #include "hash.h"
 #include "log.h"
 #include "envs.h"
+#include "json.h"
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/time.h>
 #include <curl/curl.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <mosquitto.h>
+#include "uthash.h"
 
-static int get_string_envs(CURL *curl, const char *required_env, char *querystring)
+/*
+ * Build the query string for the `key=ENV_NAME,...' parameters in
+ * `required_env', each value taken from the environment and escaped,
+ * and each pair followed by '&'. Returns NULL if out of memory.
+ */
+
+static char *get_string_envs(CURL *curl, const char *required_env)
 {
-	char *data = NULL;
+	char *querystring;
 	char *escaped_key = NULL;
 	char *escaped_val = NULL;
 	char *env_string = NULL;
@@ -49,60 +64,1074 @@ static int get_string_envs(CURL *curl, const char *required_env, char *querystri
 	char *env_names[MAXPARAMSNUM];
 	char *env_value[MAXPARAMSNUM];
 	int i, num = 0;
+	size_t len;
 
-	//_log(LOG_DEBUG, "sys_envs=%s", sys_envs);
+	if ((querystring = calloc(1, MAXPARAMSLEN)) == NULL)
+		return (NULL);
+	if (required_env == NULL)
+		return (querystring);
 
-	env_string = (char *)malloc( strlen(required_env) + 20);
-	if (env_string == NULL) {
-		_fatal("ENOMEM");
-		return (-1);
+	if ((env_string = strdup(required_env)) == NULL) {
+		free(querystring);
+		return (NULL);
 	}
-	sprintf(env_string, "%s", required_env);
-
-	//_log(LOG_DEBUG, "env_string=%s", env_string);
 
 	num = get_sys_envs(env_string, ",", "=", params_key, env_names, env_value);
-	//sprintf(querystring, "");
 	for( i = 0; i < num; i++ ){
 		escaped_key = curl_easy_escape(curl, params_key[i], 0);
 		escaped_val = curl_easy_escape(curl, env_value[i], 0);
 
-		//_log(LOG_DEBUG, "key=%s", params_key[i]);
-		//_log(LOG_DEBUG, "escaped_key=%s", escaped_key);
-		//_log(LOG_DEBUG, "escaped_val=%s", escaped_envvalue);
+		len = strlen(querystring);
+		if (escaped_key && escaped_val)
+			snprintf(querystring + len, MAXPARAMSLEN - len, "%s=%s&", escaped_key, escaped_val);
+		curl_free(escaped_key);
+		curl_free(escaped_val);
+	}
 
-		data = (char *)malloc(strlen(escaped_key) + strlen(escaped_val) + 4);
-		if ( data == NULL ) {
-			_fatal("ENOMEM");
-			return (-1);
+	free(env_string);
+	return (querystring);
+}
+
+static void http_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	struct http_backend *conf = (struct http_backend *)userptr;
+
+	pthread_mutex_lock(&conf->share_locks[data]);
+}
+
+static void http_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+	struct http_backend *conf = (struct http_backend *)userptr;
+
+	pthread_mutex_unlock(&conf->share_locks[data]);
+}
+
+/*
+ * Requests are performed by an event thread which owns a curl_multi
+ * handle: a caller queues its request, wakes the thread and waits for
+ * the result until its deadline. The thread adds queued requests to the
+ * multi handle while fewer than http_max_inflight are in flight, and
+ * libcurl runs them concurrently, multiplexed over one connection when
+ * the service speaks HTTP/2 and over kept-alive connections otherwise.
+ *
+ * A request whose caller gave up is left to the thread to finish, and
+ * is recycled then; its easy handle, with the options which never
+ * change already set, is kept for the next request.
+ *
+ * With http_aclcheck_batch_uri, ACL checks are not queued as requests
+ * but as checks: the thread sends those which arrived within
+ * http_batch_window_ms of the first, up to http_batch_max of them, as a
+ * JSON array in one request, and hands each its verdict from the array
+ * which comes back. With the default window of 0 a check is sent as
+ * soon as the thread sees it, together with those which arrived while
+ * it was busy.
+ *
+ * The service may say how long an answer holds with Cache-Control:
+ * max-age is handed to the plugin's cache as the answer's TTL, and
+ * no-cache or no-store keep it from being cached at all. Answers which
+ * come with max-age or an ETag are also remembered here, keyed by a
+ * digest of the request (which carries the password), so that a fresh
+ * one is answered without asking, and a stale one is revalidated with
+ * If-None-Match; a 304 then extends it and the service needn't decide
+ * again.
+ *
+ * The service may run on several http_endpoints. The thread picks one
+ * for each request as it sends it, by the fewest requests outstanding,
+ * weighted by an average of its recent latencies unless http_balance
+ * is least_outstanding. An endpoint which fails http_eject_failures
+ * times in a row, with a transport error or a 5xx, is left out for
+ * http_eject_ms, and tried again after that; if all are out, the one
+ * back soonest is used. With http_hedge, a request which takes longer
+ * than 95% of recent ones is also sent to another endpoint, and the
+ * first good answer is taken.
+ */
+
+#define BALANCE_EWMA		0
+#define BALANCE_LEAST		1
+
+#define LATENCIES	(128)	/* Kept for the hedging delay */
+#define HEDGE_SAMPLES	(20)	/* Needed before hedging */
+
+struct http_endpoint {
+	char *name;			/* host:port, for the log */
+	char *url[METHODS];
+	int outstanding;
+	double ewma_ms;
+	int failures;			/* In a row */
+	long long ejected_until;
+};
+
+#define REQ_IDLE	0
+#define REQ_QUEUED	1
+#define REQ_INFLIGHT	2
+#define REQ_DONE	3
+#define REQ_ABANDONED	4
+
+#define BODY_MAX	(1024 * 1024)
+
+/* What the response headers say about caching */
+struct http_hints {
+	long max_age;			/* -1 if not given */
+	int no_store;
+	int no_cache;
+	char *etag;
+};
+
+struct http_cached {
+	char key[SHA256_DIGEST_LENGTH * 2 + 1];
+	int verdict;
+	time_t expires;			/* Fresh until, stale after */
+	long ttl;			/* As the headers gave it */
+	char *etag;			/* For revalidating, or NULL */
+	UT_hash_handle hh;
+};
+
+/*
+ * A getuser answer may carry the user's rules, as a JSON object like
+ * {"superuser": false, "acl": [{"pattern": "a/%u/#", "access": 3}]}.
+ * They are kept for the answer's max-age, or http_rules_cacheseconds,
+ * and while they are, that user's superuser and ACL checks are answered
+ * from them; either part may be left out to have its checks asked for
+ * as usual. A set is immutable; lookups hold a reference while they
+ * read it.
+ */
+
+#define RULES_MAX	(10000)
+
+struct http_rules {
+	char *username;
+	time_t expires;
+	int refs;			/* Protected by rules_lock */
+	int superuser;			/* -1 if not given */
+	int nacl;			/* -1 if not given */
+	struct backend_rule *acl;
+	UT_hash_handle hh;
+};
+
+struct http_request {
+	CURL *curl;
+	char *data;
+	int method;			/* METHOD_*, for the URL */
+	int state;			/* Protected by conf->lock */
+	CURLcode result;
+	long code;
+	pthread_cond_t cond;
+	char *body;			/* Response, for batches */
+	size_t bodylen;
+	int keep_body;			/* For batches and getuser */
+	struct http_hints hints;	/* Set by the thread, from the headers */
+	struct curl_slist *headers;	/* This request's, if not conf->headers */
+	struct http_check *checks;	/* The batch this request carries */
+	struct http_endpoint *ep;	/* The thread's, from here */
+	int in_multi;
+	long long started;
+	int hedged;
+	struct http_request *twin;	/* Its hedge, while in flight */
+	struct http_request *primary;	/* For a hedge, what it hedges */
+	struct http_request *next;	/* In queue or idle */
+	struct http_request *all;
+};
+
+struct http_check {
+	char *clientid;
+	char *username;
+	char *topic;
+	int acc;
+	int state;			/* REQ_*, protected by conf->lock */
+	int verdict;
+	long ttl;			/* As for backend_ttl(), or -1 */
+	pthread_cond_t cond;
+	struct http_check *next;	/* Pending, or in a batch */
+};
+
+/* Keep the response to a batch or a getuser; others are of no interest */
+static size_t http_body(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct http_request *req = (struct http_request *)userdata;
+	size_t len = size * nmemb;
+	char *body;
+
+	if (!req->keep_body)
+		return (len);
+	if (req->bodylen + len > BODY_MAX || (body = realloc(req->body, req->bodylen + len + 1)) == NULL)
+		return (0);
+	memcpy(body + req->bodylen, ptr, len);
+	req->body = body;
+	req->bodylen += len;
+	req->body[req->bodylen] = 0;
+	return (len);
+}
+
+static void hints_clear(struct http_hints *h)
+{
+	free(h->etag);
+	h->etag = NULL;
+	h->max_age = -1;
+	h->no_store = 0;
+	h->no_cache = 0;
+}
+
+/*
+ * The value of the response header line `ptr' if it is the header
+ * `name' (which ends in a colon), trimmed; NULL otherwise.
+ */
+
+static char *header_value(const char *ptr, size_t len, const char *name)
+{
+	size_t nlen = strlen(name);
+	char *value;
+
+	if (len <= nlen || strncasecmp(ptr, name, nlen) != 0)
+		return (NULL);
+	for (ptr += nlen, len -= nlen; len && isspace((unsigned char)*ptr); ptr++, len--)
+		;
+	while (len && isspace((unsigned char)ptr[len - 1]))
+		len--;
+	if ((value = malloc(len + 1)) == NULL)
+		return (NULL);
+	memcpy(value, ptr, len);
+	value[len] = 0;
+	return (value);
+}
+
+/* Note Cache-Control and ETag; the status line starts a new response */
+static size_t http_header(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct http_request *req = (struct http_request *)userdata;
+	size_t len = size * nmemb;
+	char *value, *tok, *save;
+
+	if (len >= 5 && strncmp(ptr, "HTTP/", 5) == 0) {
+		hints_clear(&req->hints);
+	} else if ((value = header_value(ptr, len, "ETag:")) != NULL) {
+		free(req->hints.etag);
+		req->hints.etag = *value ? value : NULL;
+		if (!*value)
+			free(value);
+	} else if ((value = header_value(ptr, len, "Cache-Control:")) != NULL) {
+		for (tok = strtok_r(value, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			while (isspace((unsigned char)*tok))
+				tok++;
+			if (strncasecmp(tok, "max-age=", 8) == 0)
+				req->hints.max_age = atol(tok[8] == '"' ? tok + 9 : tok + 8);
+			else if (strncasecmp(tok, "no-store", 8) == 0)
+				req->hints.no_store = 1;
+			else if (strncasecmp(tok, "no-cache", 8) == 0)
+				req->hints.no_cache = 1;
+		}
+		free(value);
+	}
+	return (len);
+}
+
+/* The TTL which `h' gives an answer, as for backend_ttl(), or -1 */
+static long hints_ttl(struct http_hints *h)
+{
+	if (h->no_store || h->no_cache)
+		return (0);
+	return (h->max_age >= 0 ? h->max_age : -1);
+}
+
+/* Take an idle request, or create one. Called with conf->lock held. */
+static struct http_request *req_get(struct http_backend *conf)
+{
+	struct http_request *req;
+	CURL *curl;
+
+	if ((req = conf->idle) != NULL) {
+		conf->idle = req->next;
+		return (req);
+	}
+
+	if ((curl = curl_easy_init()) == NULL) {
+		_log(LOG_NOTICE, "create curl_easy_handle fails");
+		return (NULL);
+	}
+	if ((req = calloc(1, sizeof(struct http_request))) == NULL) {
+		curl_easy_cleanup(curl);
+		return (NULL);
+	}
+	req->curl = curl;
+	req->hints.max_age = -1;
+	pthread_cond_init(&req->cond, NULL);
+	req->all = conf->all;
+	conf->all = req;
+
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, req);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_body);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, http_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, req);
+	curl_easy_setopt(curl, CURLOPT_SHARE, conf->share);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, conf->h2_prior_knowledge ?
+		CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, conf->timeout_ms);
+	if (conf->unix_socket != NULL)
+		curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, conf->unix_socket);
+	// curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+
+	return (req);
+}
+
+/* Make `req' idle again. Called with conf->lock held. */
+static void req_put(struct http_backend *conf, struct http_request *req)
+{
+	/* Don't leave the handle pointing at freed memory */
+	curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, NULL);
+	curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, NULL);
+	free(req->data);
+	req->data = NULL;
+	curl_slist_free_all(req->headers);
+	req->headers = NULL;
+	hints_clear(&req->hints);
+	free(req->body);
+	req->body = NULL;
+	req->bodylen = 0;
+	req->keep_body = 0;
+	req->hedged = 0;
+	req->checks = NULL;
+	req->state = REQ_IDLE;
+	req->next = conf->idle;
+	conf->idle = req;
+}
+
+static void check_free(struct http_check *chk)
+{
+	pthread_cond_destroy(&chk->cond);
+	free(chk->clientid);
+	free(chk->username);
+	free(chk->topic);
+	free(chk);
+}
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/*
+ * The endpoint for the next request, other than `not': the one which is
+ * in and scores lowest, starting from the next one in turn so that ties
+ * are spread. Without one in, the one back soonest, unless `not' is
+ * given; then NULL. Called on the thread with conf->lock held.
+ */
+
+static struct http_endpoint *endpoint_pick(struct http_backend *conf, struct http_endpoint *not)
+{
+	struct http_endpoint *ep, *best = NULL, *soonest = NULL;
+	long long now = now_ms();
+	double score, best_score = 0;
+	int n;
+
+	for (n = 0; n < conf->nendpoints; n++) {
+		ep = &conf->endpoints[(conf->next_endpoint + n) % conf->nendpoints];
+		if (ep == not)
+			continue;
+		if (ep->ejected_until > now) {
+			if (soonest == NULL || ep->ejected_until < soonest->ejected_until)
+				soonest = ep;
+			continue;
+		}
+		score = ep->outstanding + 1;
+		if (conf->balance == BALANCE_EWMA)
+			score *= ep->ewma_ms + 1;
+		if (best == NULL || score < best_score) {
+			best = ep;
+			best_score = score;
 		}
-		sprintf(data, "%s=%s&", escaped_key, escaped_val);
-		if ( i == 0 ) {
-			sprintf(querystring, "%s", data);
+	}
+	conf->next_endpoint = (conf->next_endpoint + 1) % conf->nendpoints;
+	return (best ? best : (not ? NULL : soonest));
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Note how a request to `ep' went: a failure counts towards its
+ * ejection, a success resets that and feeds its latency to the average
+ * and to the hedging delay. Called on the thread with conf->lock held.
+ */
+
+static void endpoint_record(struct http_backend *conf, struct http_endpoint *ep, int failed, long ms)
+{
+	long sorted[LATENCIES];
+	int n;
+
+	if (failed) {
+		if (++ep->failures >= conf->eject_failures) {
+			if (ep->ejected_until <= now_ms())
+				_log(LOG_NOTICE, "http endpoint %s fails %d times, left out for %ldms",
+					ep->name, ep->failures, conf->eject_ms);
+			ep->ejected_until = now_ms() + conf->eject_ms;
+		}
+		return;
+	}
+	ep->failures = 0;
+	ep->ejected_until = 0;
+	ep->ewma_ms = (ep->ewma_ms == 0) ? ms : ep->ewma_ms * 0.8 + ms * 0.2;
+
+	if (!conf->hedge)
+		return;
+	conf->latencies[conf->nlatencies++ % LATENCIES] = ms;
+	if (conf->nlatencies >= HEDGE_SAMPLES && conf->nlatencies % 16 == 0) {
+		n = conf->nlatencies < LATENCIES ? conf->nlatencies : LATENCIES;
+		memcpy(sorted, conf->latencies, n * sizeof(long));
+		qsort(sorted, n, sizeof(long), cmp_long);
+		conf->hedge_ms = sorted[n * 95 / 100] + 1;
+	}
+	if (conf->nlatencies >= 2 * LATENCIES)
+		conf->nlatencies -= LATENCIES;
+}
+
+/* Send `req' to `ep'. Called on the thread with conf->lock held. */
+static void req_start(struct http_backend *conf, struct http_request *req, struct http_endpoint *ep)
+{
+	req->ep = ep;
+	curl_easy_setopt(req->curl, CURLOPT_URL, ep->url[req->method]);
+	curl_multi_add_handle(conf->multi, req->curl);
+	req->in_multi = 1;
+	req->started = now_ms();
+	ep->outstanding++;
+	conf->inflight++;
+}
+
+/* Take `req' out of the multi handle, before it is done if need be */
+static void req_stop(struct http_backend *conf, struct http_request *req)
+{
+	if (req->in_multi) {
+		curl_multi_remove_handle(conf->multi, req->curl);
+		req->in_multi = 0;
+		req->ep->outstanding--;
+		conf->inflight--;
+	}
+}
+
+static void twin_free(struct http_request *twin)
+{
+	curl_easy_cleanup(twin->curl);
+	hints_clear(&twin->hints);
+	free(twin->body);
+	free(twin);
+}
+
+/*
+ * Send a copy of `req' to `ep'. The copy uses the body and headers of
+ * `req', which outlive it: `req' is finished after its twin is freed.
+ * Called on the thread with conf->lock held.
+ */
+
+static void req_hedge(struct http_backend *conf, struct http_request *req, struct http_endpoint *ep)
+{
+	struct http_request *twin;
+
+	if ((twin = calloc(1, sizeof(struct http_request))) == NULL)
+		return;
+	if ((twin->curl = curl_easy_duphandle(req->curl)) == NULL) {
+		free(twin);
+		return;
+	}
+	twin->method = req->method;
+	twin->keep_body = req->keep_body;
+	twin->hints.max_age = -1;
+	twin->primary = req;
+	curl_easy_setopt(twin->curl, CURLOPT_PRIVATE, twin);
+	curl_easy_setopt(twin->curl, CURLOPT_WRITEDATA, twin);
+	curl_easy_setopt(twin->curl, CURLOPT_HEADERDATA, twin);
+	req->twin = twin;
+	_log(LOG_DEBUG, "http: hedging with %s after %lldms", ep->name, now_ms() - req->started);
+	req_start(conf, twin, ep);
+}
+
+/*
+ * Hand `chk', which is in a batch or was about to be, its verdict.
+ * Called on the thread with conf->lock held.
+ */
+
+static void check_finish(struct http_check *chk, int verdict, long ttl)
+{
+	chk->verdict = verdict;
+	chk->ttl = ttl;
+	if (chk->state == REQ_ABANDONED) {
+		check_free(chk);
+	} else {
+		chk->state = REQ_DONE;
+		pthread_cond_signal(&chk->cond);
+	}
+}
+
+/*
+ * Start a request for the first http_batch_max pending checks. Returns
+ * 0 if it can't, for now. Called on the thread with conf->lock held.
+ */
+
+static int batch_send(struct http_backend *conf)
+{
+	struct http_request *req;
+	struct http_check *chk, *checks = NULL, **tail = &checks;
+	char *data, *c, *u, *t;
+	size_t len = 3;
+	int n;
+
+	if ((req = req_get(conf)) == NULL)
+		return (0);
+
+	for (n = 0, chk = conf->pending; chk && n < conf->batch_max; n++, chk = chk->next)
+		len += strlen(chk->clientid) * 6 + strlen(chk->username) * 6 + strlen(chk->topic) * 6 + 80;
+	if ((data = malloc(len)) == NULL) {
+		req_put(conf, req);
+		return (0);
+	}
+
+	/*
+	 * Take them off the pending list. One which can't be quoted is left
+	 * out of the batch and fails at once, so that the verdicts, which
+	 * are matched to the checks by position, stay in step.
+	 */
+	strcpy(data, "[");
+	for (; n > 0; n--) {
+		chk = conf->pending;
+		if ((conf->pending = chk->next) == NULL)
+			conf->pending_tail = NULL;
+		conf->npending--;
+		chk->next = NULL;
+
+		c = json_quote(chk->clientid);
+		u = json_quote(chk->username);
+		t = json_quote(chk->topic);
+		if (c && u && t) {
+			sprintf(data + strlen(data), "%s{\"clientid\":%s,\"username\":%s,\"topic\":%s,\"acc\":%d}",
+				checks ? "," : "", c, u, t, chk->acc);
+			chk->state = REQ_INFLIGHT;
+			*tail = chk;
+			tail = &chk->next;
 		} else {
-			strcat(querystring, data);
+			check_finish(chk, BACKEND_ERROR, -1);
 		}
+		free(c);
+		free(u);
+		free(t);
+	}
+	strcat(data, "]");
+	gettimeofday(&conf->pending_since, NULL);
+
+	if (checks == NULL) {
 		free(data);
-		curl_free(escaped_key);
-		curl_free(escaped_val);
+		req_put(conf, req);
+		return (1);
 	}
+	req->checks = checks;
+	req->keep_body = 1;
 
-	if (escaped_key) free(escaped_key);
-	if (escaped_val) free(escaped_val);
-	free(env_string);
-	return (num);
+	_log(LOG_DEBUG, "uri=%s", conf->aclcheck_batch_uri);
+	_log(LOG_DEBUG, "data=%s", data);
+
+	req->data = data;
+	req->method = METHOD_BATCH;
+	curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, data);
+	curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, conf->json_headers);
+	curl_easy_setopt(req->curl, CURLOPT_USERNAME, NULL);
+	curl_easy_setopt(req->curl, CURLOPT_PASSWORD, NULL);
+
+	req->state = REQ_INFLIGHT;
+	req_start(conf, req, endpoint_pick(conf, NULL));
+	return (1);
+}
+
+/*
+ * Hand every check of the finished batch `req' its verdict: true or a
+ * 2xx code allows, false or a 4xx code doesn't, anything else is an
+ * error, as is a response which isn't an array with one verdict per
+ * check. Called on the thread with conf->lock held.
+ */
+
+static void batch_done(struct http_backend *conf, struct http_request *req)
+{
+	struct http_check *chk, *next;
+	struct json *verdicts = NULL, *v;
+	int n, count, verdict;
+
+	for (count = 0, chk = req->checks; chk; chk = chk->next)
+		count++;
+
+	if (req->result != CURLE_OK || req->code < 200 || req->code >= 300) {
+		_log(LOG_NOTICE, "http batch of %d fails: %s, code %ld", count,
+			curl_easy_strerror(req->result), req->code);
+	} else if (req->body == NULL || (verdicts = json_parse(req->body, req->bodylen)) == NULL ||
+	    verdicts->type != JSON_ARRAY || verdicts->count != count) {
+		_log(LOG_NOTICE, "http batch of %d: unexpected response", count);
+		json_free(verdicts);
+		verdicts = NULL;
+	}
+
+	for (n = 0, chk = req->checks; chk; n++, chk = next) {
+		next = chk->next;
+		verdict = BACKEND_ERROR;
+		if (verdicts) {
+			v = verdicts->items[n];
+			if (v->type == JSON_TRUE || (v->type == JSON_NUMBER && v->number >= 200 && v->number < 300))
+				verdict = BACKEND_ALLOW;
+			else if (v->type == JSON_FALSE || (v->type == JSON_NUMBER && v->number >= 400 && v->number < 500))
+				verdict = BACKEND_DEFER;
+		}
+		check_finish(chk, verdict, hints_ttl(&req->hints));
+	}
+	json_free(verdicts);
+	req->checks = NULL;
+}
+
+/* Milliseconds until the pending checks are due, 0 if they are */
+static long batch_due(struct http_backend *conf)
+{
+	struct timeval now;
+	long ms;
+
+	if (conf->npending >= conf->batch_max)
+		return (0);
+	gettimeofday(&now, NULL);
+	ms = conf->batch_window_ms - ((now.tv_sec - conf->pending_since.tv_sec) * 1000 +
+		(now.tv_usec - conf->pending_since.tv_usec) / 1000);
+	return (ms > 0 ? ms : 0);
+}
+
+/*
+ * The transfer of `x', a request or its twin, is done. The first good
+ * answer is the request's, and what is still in flight is cancelled; a
+ * failure waits for the other, if there is one. Called on the thread
+ * with conf->lock held.
+ */
+
+static void req_finish(struct http_backend *conf, struct http_request *x, CURLcode result)
+{
+	struct http_request *req = x->primary ? x->primary : x;
+	struct http_request *other = (x == req) ? req->twin : req;
+	int failed;
+
+	req_stop(conf, x);
+	x->result = result;
+	x->code = 0;
+	if (result == CURLE_OK)
+		curl_easy_getinfo(x->curl, CURLINFO_RESPONSE_CODE, &x->code);
+	failed = (result != CURLE_OK || x->code >= 500);
+	endpoint_record(conf, x->ep, failed, (long)(now_ms() - x->started));
+
+	if (failed && other && other->in_multi) {
+		if (x != req) {
+			twin_free(x);
+			req->twin = NULL;
+		}
+		return;
+	}
+	if (x != req) {
+		req->result = x->result;
+		req->code = x->code;
+		hints_clear(&req->hints);
+		req->hints = x->hints;
+		x->hints.etag = NULL;
+		free(req->body);
+		req->body = x->body;
+		req->bodylen = x->bodylen;
+		x->body = NULL;
+	}
+	req_stop(conf, req);
+	if (req->twin) {
+		req_stop(conf, req->twin);
+		twin_free(req->twin);
+		req->twin = NULL;
+	}
+
+	if (req->checks) {
+		batch_done(conf, req);
+		req_put(conf, req);
+	} else if (req->state == REQ_ABANDONED) {
+		req_put(conf, req);
+	} else {
+		req->state = REQ_DONE;
+		pthread_cond_signal(&req->cond);
+	}
 }
 
-static int http_post(void *handle, char *uri, const char *clientid, const char *username, const char *password, const char *topic, int acc, int method)
+/*
+ * Hedge the requests which have been in flight longer than the hedging
+ * delay, and return the milliseconds until the next one will have been,
+ * at most `wait_ms'. Called on the thread with conf->lock held.
+ */
+
+static int hedge_due(struct http_backend *conf, int wait_ms)
+{
+	struct http_request *req;
+	struct http_endpoint *ep;
+	long long now = now_ms(), age;
+
+	if (!conf->hedge || conf->hedge_ms == 0 || conf->nendpoints < 2)
+		return (wait_ms);
+	for (req = conf->all; req; req = req->all) {
+		if (!req->in_multi || req->hedged)
+			continue;
+		if ((age = now - req->started) < conf->hedge_ms) {
+			if (conf->hedge_ms - age < wait_ms)
+				wait_ms = conf->hedge_ms - age;
+			continue;
+		}
+		if (conf->inflight >= conf->max_inflight)
+			break;
+		req->hedged = 1;
+		if ((ep = endpoint_pick(conf, req->ep)) != NULL)
+			req_hedge(conf, req, ep);
+	}
+	return (wait_ms);
+}
+
+static void *http_thread(void *arg)
+{
+	struct http_backend *conf = (struct http_backend *)arg;
+	struct http_request *req;
+	CURLMsg *msg;
+	CURLcode result;
+	int still, left, wait_ms;
+
+	pthread_mutex_lock(&conf->lock);
+	while (conf->running) {
+		while (conf->queue && conf->inflight < conf->max_inflight) {
+			req = conf->queue;
+			if ((conf->queue = req->next) == NULL)
+				conf->queue_tail = NULL;
+			req->state = REQ_INFLIGHT;
+			req_start(conf, req, endpoint_pick(conf, NULL));
+		}
+		while (conf->npending && batch_due(conf) == 0 && conf->inflight < conf->max_inflight) {
+			if (!batch_send(conf))
+				break;
+		}
+		wait_ms = hedge_due(conf, conf->npending ? batch_due(conf) : 1000);
+		pthread_mutex_unlock(&conf->lock);
+
+		curl_multi_perform(conf->multi, &still);
+		while ((msg = curl_multi_info_read(conf->multi, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+			result = msg->data.result;
+
+			pthread_mutex_lock(&conf->lock);
+			req_finish(conf, req, result);
+			pthread_mutex_unlock(&conf->lock);
+		}
+
+		/* Returns early when a transfer needs attention or on curl_multi_wakeup() */
+		curl_multi_poll(conf->multi, NULL, 0, wait_ms, NULL);
+		pthread_mutex_lock(&conf->lock);
+	}
+	pthread_mutex_unlock(&conf->lock);
+	return (NULL);
+}
+
+/*
+ * Have the event thread perform `req', and wait for it for at most
+ * `timeout_ms'. Returns the CURLcode of the transfer, with the
+ * response code in `*code', what its headers say about caching in
+ * `*hints', which the caller clears, and the body, if kept, in `*body',
+ * which the caller frees. Called with conf->lock held.
+ */
+
+static CURLcode req_perform(struct http_backend *conf, struct http_request *req, long timeout_ms, long *code, struct http_hints *hints, char **body)
+{
+	struct http_request **rp;
+	struct timespec deadline;
+	CURLcode result;
+
+	deadline_after(timeout_ms, &deadline);
+
+	req->state = REQ_QUEUED;
+	req->next = NULL;
+	if (conf->queue_tail)
+		conf->queue_tail->next = req;
+	else
+		conf->queue = req;
+	conf->queue_tail = req;
+	curl_multi_wakeup(conf->multi);
+
+	while (req->state != REQ_DONE) {
+		if (pthread_cond_timedwait(&req->cond, &conf->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	*code = req->code;
+	if (req->state == REQ_DONE) {
+		result = req->result;
+		*hints = req->hints;
+		req->hints.etag = NULL;
+		*body = req->body;
+		req->body = NULL;
+		req_put(conf, req);
+	} else if (req->state == REQ_QUEUED) {
+		/* Never started: take it out of the queue */
+		for (rp = &conf->queue; *rp != req; rp = &(*rp)->next)
+			;
+		*rp = req->next;
+		for (conf->queue_tail = conf->queue; conf->queue_tail && conf->queue_tail->next; )
+			conf->queue_tail = conf->queue_tail->next;
+		req_put(conf, req);
+		result = CURLE_OPERATION_TIMEDOUT;
+	} else {
+		/* The thread recycles it when the transfer ends */
+		req->state = REQ_ABANDONED;
+		result = CURLE_OPERATION_TIMEDOUT;
+	}
+	return (result);
+}
+
+/*
+ * The key under which the answer to `data' posted to `uri' is kept: a
+ * digest, so that no password is. Returns 0 if there is none.
+ */
+
+static int cached_key(const char *uri, const char *data, char *key)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	unsigned int mdlen = 0, i;
+	char *buf;
+	int ok;
+
+	if ((buf = malloc(strlen(uri) + strlen(data) + 2)) == NULL)
+		return (0);
+	sprintf(buf, "%s\n%s", uri, data);
+	ok = EVP_Digest(buf, strlen(buf), md, &mdlen, EVP_sha256(), NULL) && mdlen == sizeof(md);
+	free(buf);
+	if (!ok)
+		return (0);
+	for (i = 0; i < mdlen; i++)
+		sprintf(key + i * 2, "%02x", md[i]);
+	return (1);
+}
+
+/*
+ * Keep `verdict' for `key' as the headers `h' say; an answer which is
+ * fresh for a while, or which has an ETag, is kept, the oldest making
+ * room when there are http_cache_max of them. For a 304, `stale' is
+ * the entry revalidated, whose ETag and TTL hold unless the 304 says
+ * otherwise. Returns the TTL for the plugin's cache, or -1.
+ */
+
+static long cached_put(struct http_backend *conf, const char *key, int verdict, struct http_hints *h, struct http_cached *stale)
+{
+	struct http_cached *hc;
+	long ttl = hints_ttl(h);
+	const char *tag = h->etag;
+
+	if (stale) {
+		if (ttl < 0 && !h->no_store)
+			ttl = stale->ttl;
+		if (tag == NULL)
+			tag = stale->etag;
+	}
+
+	pthread_mutex_lock(&conf->lock);
+	HASH_FIND_STR(conf->cached, key, hc);
+	if (hc) {
+		HASH_DEL(conf->cached, hc);
+		free(hc->etag);
+		free(hc);
+	}
+	if (!h->no_store && (ttl > 0 || tag)) {
+		if (HASH_COUNT(conf->cached) >= conf->cache_max) {
+			hc = conf->cached;
+			HASH_DEL(conf->cached, hc);
+			free(hc->etag);
+			free(hc);
+		}
+		if ((hc = calloc(1, sizeof(struct http_cached))) != NULL) {
+			strcpy(hc->key, key);
+			hc->verdict = verdict;
+			hc->expires = time(NULL) + (ttl > 0 ? ttl : 0);
+			hc->ttl = ttl;
+			hc->etag = tag ? strdup(tag) : NULL;
+			HASH_ADD_STR(conf->cached, key, hc);
+		}
+	}
+	pthread_mutex_unlock(&conf->lock);
+	return (ttl);
+}
+
+static void rules_free(struct http_rules *r)
+{
+	int n;
+
+	for (n = 0; n < r->nacl; n++)
+		free(r->acl[n].pattern);
+	free(r->acl);
+	free(r->username);
+	free(r);
+}
+
+static void rules_put(struct http_backend *conf, struct http_rules *r)
+{
+	int refs;
+
+	pthread_mutex_lock(&conf->rules_lock);
+	refs = --r->refs;
+	pthread_mutex_unlock(&conf->rules_lock);
+	if (refs == 0)
+		rules_free(r);
+}
+
+/* The rules of `username' while they hold, or NULL */
+static struct http_rules *rules_get(struct http_backend *conf, const char *username)
+{
+	struct http_rules *r;
+
+	pthread_mutex_lock(&conf->rules_lock);
+	HASH_FIND_STR(conf->rules, username, r);
+	if (r && r->expires > time(NULL))
+		r->refs++;
+	else
+		r = NULL;
+	pthread_mutex_unlock(&conf->rules_lock);
+	return (r);
+}
+
+/* Drop the rules of `username'. Called with rules_lock held. */
+static void rules_drop(struct http_backend *conf, const char *username)
+{
+	struct http_rules *r;
+
+	HASH_FIND_STR(conf->rules, username, r);
+	if (r) {
+		HASH_DEL(conf->rules, r);
+		conf->rules_count--;
+		if (--r->refs == 0)
+			rules_free(r);
+	}
+}
+
+/* The rules in the getuser answer `body', or NULL if it has none */
+static struct http_rules *rules_parse(const char *username, const char *body, size_t len)
+{
+	struct http_rules *r;
+	struct json *j, *su, *acl, *item, *pattern;
+	int n, mask;
+
+	if ((j = json_parse(body, len)) == NULL || j->type != JSON_OBJECT) {
+		json_free(j);
+		return (NULL);
+	}
+	su = json_get(j, "superuser");
+	if ((acl = json_get(j, "acl")) != NULL && acl->type != JSON_ARRAY)
+		acl = NULL;
+	if ((su == NULL && acl == NULL) || (r = calloc(1, sizeof(struct http_rules))) == NULL) {
+		json_free(j);
+		return (NULL);
+	}
+
+	r->superuser = su ? (su->type == JSON_TRUE) : -1;
+	r->nacl = -1;
+	if ((r->username = strdup(username)) == NULL)
+		goto fail;
+	if (acl) {
+		if ((r->acl = calloc(acl->count + 1, sizeof(struct backend_rule))) == NULL)
+			goto fail;
+		r->nacl = 0;
+		for (n = 0; n < acl->count; n++) {
+			item = acl->items[n];
+			if (item->type != JSON_OBJECT ||
+			    (pattern = json_get(item, "pattern")) == NULL || pattern->type != JSON_STRING ||
+			    strlen(pattern->string) != pattern->length ||
+			    (mask = backend_rule_mask(json_get(item, "access"))) <= 0) {
+				_log(LOG_NOTICE, "http: ignoring rule %d of %s", n, username);
+				continue;
+			}
+			if ((r->acl[r->nacl].pattern = strdup(pattern->string)) == NULL)
+				goto fail;
+			r->acl[r->nacl++].mask = mask;
+		}
+	}
+	json_free(j);
+	return (r);
+
+  fail:
+	json_free(j);
+	rules_free(r);
+	return (NULL);
+}
+
+/*
+ * Keep the rules in the getuser answer `body' for `ttl' seconds, or for
+ * http_rules_cacheseconds if it is -1; any rules of `username' which
+ * the answer doesn't repeat are dropped. A 304 has no body, and keeps
+ * the rules of the answer it stands for, for `ttl'.
+ */
+
+static void rules_learn(struct http_backend *conf, const char *username, const char *body, size_t len, int revalidated, long ttl)
+{
+	struct http_rules *r = NULL, *old, *tmp;
+	time_t now = time(NULL);
+
+	if (ttl < 0)
+		ttl = conf->rules_cacheseconds;
+	if (revalidated) {
+		pthread_mutex_lock(&conf->rules_lock);
+		HASH_FIND_STR(conf->rules, username, old);
+		if (old && ttl > 0)
+			old->expires = now + ttl;
+		else if (old)
+			rules_drop(conf, username);
+		pthread_mutex_unlock(&conf->rules_lock);
+		return;
+	}
+	if (ttl > 0 && body && (r = rules_parse(username, body, len)) != NULL) {
+		r->refs = 1;
+		r->expires = now + ttl;
+		_log(LOG_DEBUG, "http: rules of %s: superuser=%d, %d ACLs, for %lds",
+			username, r->superuser, r->nacl, ttl);
+	}
+
+	pthread_mutex_lock(&conf->rules_lock);
+	rules_drop(conf, username);
+	if (r && conf->rules_count >= RULES_MAX) {
+		HASH_ITER(hh, conf->rules, old, tmp) {
+			if (old->expires <= now)
+				rules_drop(conf, old->username);
+		}
+	}
+	if (r && conf->rules_count < RULES_MAX) {
+		HASH_ADD_KEYPTR(hh, conf->rules, r->username, strlen(r->username), r);
+		conf->rules_count++;
+		r = NULL;
+	}
+	pthread_mutex_unlock(&conf->rules_lock);
+	if (r)
+		rules_free(r);
+}
+
+static int http_post(void *handle, char *uri, const char *clientid, const char *username, const char *password, const char *topic, int acc, int method, long timeout_ms)
 {
 	struct http_backend *conf = (struct http_backend *)handle;
+	struct http_request *req;
+	struct http_hints hints = { -1, 0, 0, NULL };
+	struct http_cached *hc;
+	struct curl_slist *sl;
 	CURL *curl;
-	struct curl_slist *headerlist=NULL;
-	int re, urllen = 0;
-	int respCode = 0;
+	int re;
+	long respCode = 0, ttl = -1;
 	int ok = BACKEND_DEFER;
-	char *url;
 	char *data;
+	char *string_envs;
+	char key[SHA256_DIGEST_LENGTH * 2 + 1];
+	struct http_cached stale = { .etag = NULL };
+	char *inm, *body = NULL;
 
 	if (username == NULL) {
 		return BACKEND_DEFER;
@@ -112,34 +1141,16 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	password = (password && *password) ? password : "";
 	topic    = (topic && *topic) ? topic : "";
 
-	if ((curl = curl_easy_init()) == NULL) {
-		_fatal("create curl_easy_handle fails");
+	pthread_mutex_lock(&conf->lock);
+	req = req_get(conf);
+	pthread_mutex_unlock(&conf->lock);
+	if (req == NULL) {
 		return BACKEND_ERROR;
 	}
-	if (conf->hostheader != NULL)
-		headerlist = curl_slist_append(headerlist, conf->hostheader);
-	headerlist = curl_slist_append(headerlist, "Expect:");
-
-	if(conf->basic_auth !=NULL){
-		headerlist = curl_slist_append(headerlist, conf->basic_auth);
-	}
+	curl = req->curl;
 
 	//_log(LOG_NOTICE, "u=%s p=%s t=%s acc=%d", username, password, topic, acc);
 
-	urllen = strlen(conf->hostname) + strlen(uri) + 20;
-	url = (char *)malloc(urllen);
-	if (url == NULL) {
-		_fatal("ENOMEM");
-		return BACKEND_ERROR;
-	}
-
-	// uri begins with a slash
-	snprintf(url, urllen, "%s://%s:%d%s",
-		strcmp(conf->with_tls, "true") == 0 ? "https" : "http",
-		conf->hostname ? conf->hostname : "127.0.0.1",
-		conf->port,
-		uri);
-
 	char* escaped_username = curl_easy_escape(curl, username, 0);
 	char* escaped_password = curl_easy_escape(curl, password, 0);
 	char* escaped_topic = curl_easy_escape(curl, topic, 0);
@@ -148,30 +1159,27 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	char string_acc[20];
 	snprintf(string_acc, 20, "%d", acc);
 
-	char *string_envs = (char *)malloc(MAXPARAMSLEN);
-	if (string_envs == NULL) {
-		_fatal("ENOMEM");
-		return BACKEND_ERROR;
+	if (method == METHOD_GETUSER) {
+		string_envs = conf->getuser_params;
+	} else if (method == METHOD_SUPERUSER) {
+		string_envs = conf->superuser_params;
+	} else {
+		string_envs = conf->aclcheck_params;
 	}
 
-	memset(string_envs, 0, MAXPARAMSLEN);
-
-	//get the sys_env from here
-	int env_num = 0;
-	if ( method == METHOD_GETUSER && conf->getuser_envs != NULL ){
-		env_num = get_string_envs(curl, conf->getuser_envs, string_envs);
-	}else if ( method == METHOD_SUPERUSER && conf->superuser_envs != NULL ){
-		env_num = get_string_envs(curl, conf->superuser_envs, string_envs);
-	} else if ( method == METHOD_ACLCHECK && conf->aclcheck_envs != NULL ){
-		env_num = get_string_envs(curl, conf->aclcheck_envs, string_envs);
-	}
-	if( env_num == -1 ){
-		return BACKEND_ERROR;
+	if (!escaped_username || !escaped_password || !escaped_topic || !escaped_clientid) {
+		data = NULL;
+	} else {
+		data = (char *)malloc(strlen(string_envs) + strlen(escaped_username) + strlen(escaped_password) + strlen(escaped_topic) + strlen(string_acc) + strlen(escaped_clientid) + 50);
 	}
-	//---- over ----
-
-	data = (char *)malloc(strlen(string_envs) + strlen(escaped_username) + strlen(escaped_password) + strlen(escaped_topic) + strlen(string_acc) + strlen(escaped_clientid) + 50);
 	if (data == NULL) {
+		pthread_mutex_lock(&conf->lock);
+		req_put(conf, req);
+		pthread_mutex_unlock(&conf->lock);
+		curl_free(escaped_username);
+		curl_free(escaped_password);
+		curl_free(escaped_topic);
+		curl_free(escaped_clientid);
 		_fatal("ENOMEM");
 		return BACKEND_ERROR;
 	}
@@ -181,45 +1189,222 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 		escaped_password,
 		escaped_topic,
 		string_acc,
-		clientid);
+		escaped_clientid);
+
+	req->data = data;
 
-	_log(LOG_DEBUG, "url=%s", url);
+	/* A fresh answer is given as is, a stale one is revalidated */
+	*key = 0;
+	if (conf->cache_max > 0 && cached_key(uri, data, key)) {
+		pthread_mutex_lock(&conf->lock);
+		HASH_FIND_STR(conf->cached, key, hc);
+		if (hc && hc->expires > time(NULL)) {
+			ok = hc->verdict;
+			ttl = hc->expires - time(NULL);
+			req_put(conf, req);
+			pthread_mutex_unlock(&conf->lock);
+			_log(LOG_DEBUG, "http %s: fresh for %lds", uri, ttl);
+			backend_ttl(ttl);
+			goto out;
+		}
+		if (hc && hc->etag) {
+			stale.verdict = hc->verdict;
+			stale.ttl = hc->ttl;
+			stale.etag = strdup(hc->etag);
+		}
+		pthread_mutex_unlock(&conf->lock);
+	}
+	if (stale.etag && (inm = malloc(strlen(stale.etag) + 16)) != NULL) {
+		for (sl = conf->headers; sl; sl = sl->next)
+			req->headers = curl_slist_append(req->headers, sl->data);
+		sprintf(inm, "If-None-Match: %s", stale.etag);
+		req->headers = curl_slist_append(req->headers, inm);
+		free(inm);
+	}
+
+	_log(LOG_DEBUG, "uri=%s", uri);
 	_log(LOG_DEBUG, "data=%s", data);
-	// curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	/* Everything else was set when the handle was created, or is when it is sent */
+	req->method = method;
+	req->keep_body = (method == METHOD_GETUSER);
 	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
-	curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers ? req->headers : conf->headers);
 	curl_easy_setopt(curl, CURLOPT_USERNAME, username);
 	curl_easy_setopt(curl, CURLOPT_PASSWORD, password);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+
+	pthread_mutex_lock(&conf->lock);
+	re = req_perform(conf, req, timeout_ms, &respCode, &hints, &body);
+	pthread_mutex_unlock(&conf->lock);
 
-	re = curl_easy_perform(curl);
 	if (re == CURLE_OK) {
-		re = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &respCode);
-		if (re == CURLE_OK && respCode >= 200 && respCode < 300) {
+		if (respCode == 304 && stale.etag) {
+			_log(LOG_DEBUG, "http %s: not modified", uri);
+			ok = stale.verdict;
+		} else if (respCode >= 200 && respCode < 300) {
 			ok = BACKEND_ALLOW;
-		} else if (re == CURLE_OK && respCode >= 500) {
+		} else if (respCode >= 500) {
 			ok = BACKEND_ERROR;
 		} else {
 			//_log(LOG_NOTICE, "http auth fail re=%d respCode=%d", re, respCode);
 		}
+		if (ok != BACKEND_ERROR) {
+			ttl = *key ? cached_put(conf, key, ok, &hints,
+				(respCode == 304 && stale.etag) ? &stale : NULL) : hints_ttl(&hints);
+			if (ttl >= 0)
+				backend_ttl(ttl);
+		}
+		if (method == METHOD_GETUSER && ok == BACKEND_ALLOW)
+			rules_learn(conf, username, body, body ? strlen(body) : 0, respCode == 304, ttl);
 	} else {
-		_log(LOG_DEBUG, "http req fail url=%s re=%s", url, curl_easy_strerror(re));
+		_log(LOG_DEBUG, "http req fail uri=%s re=%s", uri, curl_easy_strerror(re));
 		ok = BACKEND_ERROR;
 	}
+	hints_clear(&hints);
+	free(stale.etag);
+	free(body);
 
-	curl_easy_cleanup(curl);
-	curl_slist_free_all (headerlist);
-	free(url);
-	free(data);
-	free(string_envs);
-	free(escaped_username);
-	free(escaped_password);
-	free(escaped_topic);
-	free(escaped_clientid);
+out:
+	curl_free(escaped_username);
+	curl_free(escaped_password);
+	curl_free(escaped_topic);
+	curl_free(escaped_clientid);
+	return (ok);
+}
+
+/*
+ * Have the ACL check go out with the next batch, and wait for its
+ * verdict for at most `timeout_ms'.
+ */
+
+static int http_check(struct http_backend *conf, const char *clientid, const char *username, const char *topic, int acc, long timeout_ms)
+{
+	struct http_check *chk, **cp;
+	struct timespec deadline;
+	int verdict = BACKEND_ERROR;
+
+	if (username == NULL)
+		return BACKEND_DEFER;
+	if ((chk = calloc(1, sizeof(struct http_check))) == NULL)
+		return BACKEND_ERROR;
+	chk->clientid = strdup(clientid ? clientid : "");
+	chk->username = strdup(username);
+	chk->topic = strdup(topic ? topic : "");
+	chk->acc = acc;
+	pthread_cond_init(&chk->cond, NULL);
+	if (!chk->clientid || !chk->username || !chk->topic) {
+		check_free(chk);
+		return BACKEND_ERROR;
+	}
+
+	deadline_after(timeout_ms, &deadline);
+
+	pthread_mutex_lock(&conf->lock);
+	chk->state = REQ_QUEUED;
+	if (conf->pending_tail)
+		conf->pending_tail->next = chk;
+	else
+		conf->pending = chk;
+	conf->pending_tail = chk;
+
+	/* The thread sets its timer on the first check, and sends a full batch at once */
+	if (conf->npending++ == 0)
+		gettimeofday(&conf->pending_since, NULL);
+	if (conf->npending == 1 || conf->npending >= conf->batch_max)
+		curl_multi_wakeup(conf->multi);
+
+	while (chk->state != REQ_DONE) {
+		if (pthread_cond_timedwait(&chk->cond, &conf->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	if (chk->state == REQ_DONE) {
+		verdict = chk->verdict;
+		if (verdict != BACKEND_ERROR && chk->ttl >= 0)
+			backend_ttl(chk->ttl);
+		check_free(chk);
+	} else if (chk->state == REQ_QUEUED) {
+		for (cp = &conf->pending; *cp != chk; cp = &(*cp)->next)
+			;
+		*cp = chk->next;
+		for (conf->pending_tail = conf->pending; conf->pending_tail && conf->pending_tail->next; )
+			conf->pending_tail = conf->pending_tail->next;
+		conf->npending--;
+		check_free(chk);
+	} else {
+		/* The thread frees it when the batch ends */
+		chk->state = REQ_ABANDONED;
+	}
+	pthread_mutex_unlock(&conf->lock);
+
+	if (verdict == BACKEND_ERROR)
+		_log(LOG_DEBUG, "http batched check of %s fails", topic ? topic : "");
+	return (verdict);
+}
+
+/* The full URL of `uri', which begins with a slash, on `host' */
+static char *http_url(struct http_backend *conf, const char *host, int port, const char *uri)
+{
+	char *url;
+	int urllen;
+
+	urllen = strlen(host) + strlen(uri) + 20;
+	if ((url = (char *)malloc(urllen)) == NULL) {
+		_fatal("ENOMEM");
+		return (NULL);
+	}
+	snprintf(url, urllen, "%s://%s:%d%s",
+		strcmp(conf->with_tls, "true") == 0 ? "https" : "http",
+		host,
+		port,
+		uri);
+	return (url);
+}
+
+static int endpoint_add(struct http_backend *conf, const char *host, int port)
+{
+	struct http_endpoint *ep;
+	int urllen = strlen(host) + 20;
+
+	ep = &conf->endpoints[conf->nendpoints];
+	memset(ep, 0, sizeof(struct http_endpoint));
+	if ((ep->name = malloc(urllen)) == NULL)
+		return (0);
+	snprintf(ep->name, urllen, "%s:%d", host, port);
+	ep->url[METHOD_GETUSER] = http_url(conf, host, port, conf->getuser_uri);
+	ep->url[METHOD_SUPERUSER] = http_url(conf, host, port, conf->superuser_uri);
+	ep->url[METHOD_ACLCHECK] = http_url(conf, host, port, conf->aclcheck_uri);
+	if (conf->aclcheck_batch_uri)
+		ep->url[METHOD_BATCH] = http_url(conf, host, port, conf->aclcheck_batch_uri);
+	conf->nendpoints++;
+	return (ep->url[METHOD_GETUSER] && ep->url[METHOD_SUPERUSER] && ep->url[METHOD_ACLCHECK] &&
+		(ep->url[METHOD_BATCH] || !conf->aclcheck_batch_uri));
+}
+
+/*
+ * Add the endpoints of the comma-separated `list', each a host, an IPv4
+ * address or a bracketed IPv6 address, with an optional port which is
+ * http_port by default.
+ */
+
+static int endpoints_add(struct http_backend *conf, const char *list)
+{
+	char *copy, *tok, *save, *colon, *end;
+	int port, ok = 1;
+
+	if ((copy = strdup(list)) == NULL)
+		return (0);
+	for (tok = strtok_r(copy, ", \t", &save); tok && ok; tok = strtok_r(NULL, ", \t", &save)) {
+		port = conf->port;
+		end = (*tok == '[') ? strchr(tok, ']') : tok;
+		if (end && (colon = strrchr(end, ':')) != NULL && (*tok == '[' || strchr(tok, ':') == colon)) {
+			*colon = 0;
+			port = atoi(colon + 1);
+		}
+		ok = endpoint_add(conf, tok, port);
+	}
+	free(copy);
 	return (ok);
 }
 
@@ -230,14 +1415,17 @@ void *be_http_init()
 	char *getuser_uri;
 	char *superuser_uri;
 	char *aclcheck_uri;
+	CURL *curl;
+	int n;
 
 	if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
 		_fatal("init curl fail");
 		return (NULL);
 	}
 
-	if ((hostname = p_stab("http_ip")) == NULL && (hostname = p_stab("http_hostname")) == NULL) {
-		_fatal("Mandatory parameter: one of either `http_ip' or `http_hostname' required");
+	if ((hostname = p_stab("http_ip")) == NULL && (hostname = p_stab("http_hostname")) == NULL &&
+	    p_stab("http_endpoints") == NULL) {
+		_fatal("Mandatory parameter: one of `http_ip', `http_hostname' or `http_endpoints' required");
 		return (NULL);
 	}
 	if ((getuser_uri = p_stab("http_getuser_uri")) == NULL) {
@@ -258,7 +1446,7 @@ void *be_http_init()
 	conf->port = p_stab("http_port") == NULL ? 80 : atoi(p_stab("http_port"));
 	if (p_stab("http_hostname") != NULL) {
 		conf->hostheader = (char *)malloc(128);
-		sprintf(conf->hostheader, "Host: %s", p_stab("http_hostname"));
+		snprintf(conf->hostheader, 128, "Host: %s", p_stab("http_hostname"));
 	} else {
 		conf->hostheader = NULL;
 	}
@@ -283,6 +1471,140 @@ void *be_http_init()
 	}
 
 	conf->retry_count = p_stab("http_retry_count") == NULL ? 3 : atoi(p_stab("http_retry_count"));
+	conf->unix_socket = p_stab("http_unix_socket");
+
+	/*
+	 * What doesn't change between requests is built once: the URLs of
+	 * each endpoint, the headers, and the parameters taken from the
+	 * environment.
+	 */
+
+	if ((curl = curl_easy_init()) == NULL) {
+		_fatal("create curl_easy_handle fails");
+		return (NULL);
+	}
+	conf->getuser_params = get_string_envs(curl, conf->getuser_envs);
+	conf->superuser_params = get_string_envs(curl, conf->superuser_envs);
+	conf->aclcheck_params = get_string_envs(curl, conf->aclcheck_envs);
+	curl_easy_cleanup(curl);
+	if (!conf->getuser_params || !conf->superuser_params || !conf->aclcheck_params) {
+		_fatal("ENOMEM");
+		return (NULL);
+	}
+
+	conf->headers = NULL;
+	if (conf->hostheader != NULL)
+		conf->headers = curl_slist_append(conf->headers, conf->hostheader);
+	conf->headers = curl_slist_append(conf->headers, "Expect:");
+	if(conf->basic_auth !=NULL){
+		conf->headers = curl_slist_append(conf->headers, conf->basic_auth);
+	}
+
+	/*
+	 * A batch carries JSON, with the parameters from the environment in
+	 * the query string instead of the body.
+	 */
+
+	conf->aclcheck_batch_uri = NULL;
+	conf->json_headers = NULL;
+	if (p_stab("http_aclcheck_batch_uri") != NULL) {
+		char *uri = p_stab("http_aclcheck_batch_uri");
+		size_t plen = strlen(conf->aclcheck_params);
+
+		if ((conf->aclcheck_batch_uri = malloc(strlen(uri) + plen + 2)) == NULL) {
+			_fatal("ENOMEM");
+			return (NULL);
+		}
+		strcpy(conf->aclcheck_batch_uri, uri);
+		if (plen > 0) {
+			strcat(conf->aclcheck_batch_uri, strchr(uri, '?') ? "&" : "?");
+			strncat(conf->aclcheck_batch_uri, conf->aclcheck_params, plen - 1);
+		}
+
+		if (conf->hostheader != NULL)
+			conf->json_headers = curl_slist_append(conf->json_headers, conf->hostheader);
+		conf->json_headers = curl_slist_append(conf->json_headers, "Expect:");
+		conf->json_headers = curl_slist_append(conf->json_headers, "Content-Type: application/json");
+		if (conf->basic_auth != NULL)
+			conf->json_headers = curl_slist_append(conf->json_headers, conf->basic_auth);
+	}
+	conf->batch_window_ms = p_stab("http_batch_window_ms") == NULL ? 0 : atol(p_stab("http_batch_window_ms"));
+	conf->batch_max = p_stab("http_batch_max") == NULL ? 50 : atoi(p_stab("http_batch_max"));
+	if (conf->batch_max < 1)
+		conf->batch_max = 1;
+	conf->pending = conf->pending_tail = NULL;
+	conf->npending = 0;
+	conf->cached = NULL;
+	n = p_stab("http_cache_max") == NULL ? 10000 : atoi(p_stab("http_cache_max"));
+	conf->cache_max = (n > 0) ? n : 0;
+	conf->endpoints = calloc(p_stab("http_endpoints") ? strlen(p_stab("http_endpoints")) / 2 + 1 : 1,
+		sizeof(struct http_endpoint));
+	conf->nendpoints = 0;
+	conf->next_endpoint = 0;
+	if (conf->endpoints == NULL ||
+	    !(p_stab("http_endpoints") ? endpoints_add(conf, p_stab("http_endpoints")) :
+		endpoint_add(conf, hostname, conf->port))) {
+		_fatal("ENOMEM");
+		return (NULL);
+	}
+	if (conf->nendpoints == 0) {
+		_fatal("No endpoints in `http_endpoints'");
+		return (NULL);
+	}
+	conf->balance = (p_stab("http_balance") && strcmp(p_stab("http_balance"), "least_outstanding") == 0) ?
+		BALANCE_LEAST : BALANCE_EWMA;
+	conf->eject_failures = p_stab("http_eject_failures") == NULL ? 3 : atoi(p_stab("http_eject_failures"));
+	if (conf->eject_failures < 1)
+		conf->eject_failures = 1;
+	conf->eject_ms = p_stab("http_eject_ms") == NULL ? 10000 : atol(p_stab("http_eject_ms"));
+	conf->hedge = p_stab("http_hedge") != NULL && strcmp(p_stab("http_hedge"), "true") == 0;
+	conf->hedge_ms = 0;
+	conf->nlatencies = 0;
+	if ((conf->latencies = calloc(LATENCIES, sizeof(long))) == NULL) {
+		_fatal("ENOMEM");
+		return (NULL);
+	}
+
+	conf->rules = NULL;
+	conf->rules_count = 0;
+	conf->rules_cacheseconds = p_stab("http_rules_cacheseconds") == NULL ? 300 : atol(p_stab("http_rules_cacheseconds"));
+	pthread_mutex_init(&conf->rules_lock, NULL);
+
+	if ((conf->share = curl_share_init()) == NULL) {
+		_fatal("init curl share fail");
+		return (NULL);
+	}
+	for (n = 0; n < CURL_LOCK_DATA_LAST; n++)
+		pthread_mutex_init(&conf->share_locks[n], NULL);
+	curl_share_setopt(conf->share, CURLSHOPT_LOCKFUNC, http_lock);
+	curl_share_setopt(conf->share, CURLSHOPT_UNLOCKFUNC, http_unlock);
+	curl_share_setopt(conf->share, CURLSHOPT_USERDATA, conf);
+	curl_share_setopt(conf->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(conf->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	/* Connections are shared by the multi handle */
+	if ((conf->multi = curl_multi_init()) == NULL) {
+		_fatal("init curl multi fail");
+		return (NULL);
+	}
+	curl_multi_setopt(conf->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	conf->timeout_ms = p_stab("http_timeout_ms") == NULL ? 10000 : atol(p_stab("http_timeout_ms"));
+	conf->max_inflight = p_stab("http_max_inflight") == NULL ? 64 : atoi(p_stab("http_max_inflight"));
+	if (conf->max_inflight < 1)
+		conf->max_inflight = 1;
+	conf->h2_prior_knowledge = p_stab("http_h2_prior_knowledge") != NULL &&
+		strcmp(p_stab("http_h2_prior_knowledge"), "true") == 0;
+
+	conf->running = 1;
+	conf->inflight = 0;
+	conf->queue = conf->queue_tail = NULL;
+	conf->idle = NULL;
+	conf->all = NULL;
+	pthread_mutex_init(&conf->lock, NULL);
+	if (pthread_create(&conf->thread, NULL, http_thread, conf) != 0) {
+		_fatal("Cannot start the HTTP thread");
+		return (NULL);
+	}
 
 	_log(LOG_DEBUG, "with_tls=%s", conf->with_tls);
 	_log(LOG_DEBUG, "getuser_uri=%s", getuser_uri);
@@ -293,21 +1615,114 @@ void *be_http_init()
 	_log(LOG_DEBUG, "superuser_params=%s", conf->superuser_envs);
 	_log(LOG_DEBUG, "aclcheck_params=%s", conf->aclcheck_envs);
 	_log(LOG_DEBUG, "retry_count=%d", conf->retry_count);
+	_log(LOG_DEBUG, "unix_socket=%s", conf->unix_socket ? conf->unix_socket : "");
+	_log(LOG_DEBUG, "timeout_ms=%ld", conf->timeout_ms);
+	_log(LOG_DEBUG, "max_inflight=%d", conf->max_inflight);
+	_log(LOG_DEBUG, "cache_max=%u", conf->cache_max);
+	for (n = 0; n < conf->nendpoints; n++)
+		_log(LOG_DEBUG, "endpoint=%s", conf->endpoints[n].name);
+	_log(LOG_DEBUG, "hedge=%d", conf->hedge);
+	_log(LOG_DEBUG, "rules_cacheseconds=%ld", conf->rules_cacheseconds);
 
 	return (conf);
 };
 void be_http_destroy(void *handle)
 {
 	struct http_backend *conf = (struct http_backend *)handle;
+	struct http_request *req;
+	struct http_check *chk;
+	struct http_cached *hc, *tmp;
+	struct http_rules *r, *rtmp;
+	int n, m;
 
 	if (conf) {
+		pthread_mutex_lock(&conf->lock);
+		conf->running = 0;
+		pthread_mutex_unlock(&conf->lock);
+		curl_multi_wakeup(conf->multi);
+		pthread_join(conf->thread, NULL);
+
+		/* The handles go first, they use the multi handle and the share */
+		while ((req = conf->all) != NULL) {
+			conf->all = req->all;
+			if (req->twin) {
+				req_stop(conf, req->twin);
+				twin_free(req->twin);
+			}
+			req_stop(conf, req);
+			curl_easy_cleanup(req->curl);
+			while ((chk = req->checks) != NULL) {
+				req->checks = chk->next;
+				check_free(chk);
+			}
+			pthread_cond_destroy(&req->cond);
+			free(req->data);
+			curl_slist_free_all(req->headers);
+			hints_clear(&req->hints);
+			free(req);
+		}
+		while ((chk = conf->pending) != NULL) {
+			conf->pending = chk->next;
+			check_free(chk);
+		}
+		HASH_ITER(hh, conf->cached, hc, tmp) {
+			HASH_DEL(conf->cached, hc);
+			free(hc->etag);
+			free(hc);
+		}
+		HASH_ITER(hh, conf->rules, r, rtmp) {
+			HASH_DEL(conf->rules, r);
+			rules_free(r);
+		}
+		pthread_mutex_destroy(&conf->rules_lock);
+		curl_multi_cleanup(conf->multi);
+		pthread_mutex_destroy(&conf->lock);
+		curl_share_cleanup(conf->share);
+		for (n = 0; n < CURL_LOCK_DATA_LAST; n++)
+			pthread_mutex_destroy(&conf->share_locks[n]);
+		curl_slist_free_all(conf->headers);
+		curl_slist_free_all(conf->json_headers);
+		free(conf->aclcheck_batch_uri);
+		for (n = 0; n < conf->nendpoints; n++) {
+			for (m = 0; m < METHODS; m++)
+				free(conf->endpoints[n].url[m]);
+			free(conf->endpoints[n].name);
+		}
+		free(conf->endpoints);
+		free(conf->latencies);
+		free(conf->getuser_params);
+		free(conf->superuser_params);
+		free(conf->aclcheck_params);
+		free(conf->hostheader);
+		free(conf->basic_auth);
 		curl_global_cleanup();
 		free(conf);
 	}
 };
 
+/*
+ * How long the next of `tries' tries may take: http_timeout_ms, or less
+ * with check_deadline_ms, which the tries left share equally. Returns -1
+ * once there is no time left.
+ */
+
+static long try_timeout(struct http_backend *conf, int tries)
+{
+	long left = backend_timeout(0);
+
+	if (left == 0)
+		return (conf->timeout_ms);
+	if (left < 0)
+		return (-1);
+	left = (tries > 1) ? left / tries : left;
+	if (left < 1)
+		left = 1;
+	return ((conf->timeout_ms > 0 && conf->timeout_ms < left) ? conf->timeout_ms : left);
+}
+
 int be_http_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid) {
 	struct http_backend *conf = (struct http_backend *)handle;
+	long ms;
 	int re, try;
 	if (username == NULL) {
 		return BACKEND_DEFER;
@@ -317,8 +1732,10 @@ int be_http_getuser(void *handle, const char *username, const char *password, ch
 	try = 0;
 
 	while (re == BACKEND_ERROR && try <= conf->retry_count) {
+		if ((ms = try_timeout(conf, conf->retry_count + 1 - try)) < 0)
+			break;
 		try++;
-		re = http_post(handle, conf->getuser_uri, NULL, username, password, NULL, -1, METHOD_GETUSER);
+		re = http_post(handle, conf->getuser_uri, NULL, username, password, NULL, -1, METHOD_GETUSER, ms);
 	}
 	return re;
 };
@@ -326,13 +1743,25 @@ int be_http_getuser(void *handle, const char *username, const char *password, ch
 int be_http_superuser(void *handle, const char *username)
 {
 	struct http_backend *conf = (struct http_backend *)handle;
+	struct http_rules *r;
+	long ms;
 	int re, try;
 
+	if (username && (r = rules_get(conf, username)) != NULL) {
+		if ((re = r->superuser) >= 0)
+			backend_ttl(r->expires - time(NULL));
+		rules_put(conf, r);
+		if (re >= 0)
+			return (re ? BACKEND_ALLOW : BACKEND_DEFER);
+	}
+
 	re = BACKEND_ERROR;
 	try = 0;
 	while (re == BACKEND_ERROR && try <= conf->retry_count) {
+		if ((ms = try_timeout(conf, conf->retry_count + 1 - try)) < 0)
+			break;
 		try++;
-		re = http_post(handle, conf->superuser_uri, NULL, username, NULL, NULL, -1, METHOD_SUPERUSER);
+		re = http_post(handle, conf->superuser_uri, NULL, username, NULL, NULL, -1, METHOD_SUPERUSER, ms);
 	}
 	return re;
 };
@@ -340,14 +1769,32 @@ int be_http_superuser(void *handle, const char *username)
 int be_http_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct http_backend *conf = (struct http_backend *)handle;
+	struct http_rules *r;
+	long ms;
 	int re, try;
 
+	if (username && (r = rules_get(conf, username)) != NULL) {
+		re = -1;
+		if (r->nacl >= 0) {
+			re = backend_rules_aclcheck("http", r->acl, r->nacl, clientid, username, topic ? topic : "", acc);
+			backend_ttl(r->expires - time(NULL));
+		}
+		rules_put(conf, r);
+		if (re >= 0)
+			return (re);
+	}
+
 	re = BACKEND_ERROR;
 	try = 0;
 
 	while (re == BACKEND_ERROR && try <= conf->retry_count) {
+		if ((ms = try_timeout(conf, conf->retry_count + 1 - try)) < 0)
+			break;
 		try++;
-		re = http_post(conf, conf->aclcheck_uri, clientid, username, NULL, topic, acc, METHOD_ACLCHECK);
+		if (conf->aclcheck_batch_uri)
+			re = http_check(conf, clientid, username, topic, acc, ms);
+		else
+			re = http_post(conf, conf->aclcheck_uri, clientid, username, NULL, topic, acc, METHOD_ACLCHECK, ms);
 	}
 	return re;
 };
@@ -28,10 +28,16 @@
  */
 #ifdef BE_HTTP
 
+#include <pthread.h>
+#include <sys/time.h>
+#include <curl/curl.h>
+
 #define MAXPARAMSLEN  1024
 #define METHOD_GETUSER   1
 #define METHOD_SUPERUSER 2
 #define METHOD_ACLCHECK  3
+#define METHOD_BATCH     4
+#define METHODS          5
 
 struct http_backend {
 	char *hostname;
@@ -46,6 +52,49 @@ struct http_backend {
 	char *with_tls;
 	char *basic_auth;
 	int retry_count;
+	char *unix_socket;
+	char *getuser_params;		/* Escaped, each ending in '&' */
+	char *superuser_params;
+	char *aclcheck_params;
+	struct curl_slist *headers;
+	CURLSH *share;			/* DNS and TLS sessions */
+	pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+	long timeout_ms;		/* Per request, from submission */
+	int max_inflight;
+	int h2_prior_knowledge;
+	CURLM *multi;			/* Driven by the event thread only */
+	pthread_t thread;
+	pthread_mutex_t lock;		/* Protects what follows */
+	int running;
+	int inflight;			/* Requests added to multi */
+	struct http_request *queue;	/* Waiting for a free slot */
+	struct http_request *queue_tail;
+	struct http_request *idle;	/* Ready for reuse */
+	struct http_request *all;	/* Every request, for destroy */
+	char *aclcheck_batch_uri;	/* With the params as query string */
+	struct curl_slist *json_headers;
+	long batch_window_ms;
+	int batch_max;
+	struct http_check *pending;	/* ACL checks waiting to be batched */
+	struct http_check *pending_tail;
+	int npending;
+	struct timeval pending_since;	/* When the first of them came */
+	struct http_cached *cached;	/* Answers with max-age or an ETag */
+	unsigned cache_max;
+	struct http_endpoint *endpoints;	/* Used by the event thread only */
+	int nendpoints;
+	int next_endpoint;		/* Where picking starts, round robin */
+	int balance;			/* BALANCE_* */
+	int eject_failures;
+	long eject_ms;
+	int hedge;
+	long hedge_ms;			/* p95 of recent latencies, 0 if unknown */
+	long *latencies;		/* The last LATENCIES, in ms */
+	int nlatencies;
+	struct http_rules *rules;	/* From getuser answers, by username */
+	int rules_count;
+	long rules_cacheseconds;
+	pthread_mutex_t rules_lock;
 };
 
 void *be_http_init();
@@ -34,10 +34,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <mosquitto.h>
 #include "hash.h"
 #include "log.h"
 #include "envs.h"
+#include "json.h"
+#include "uthash.h"
 #include <curl/curl.h>
+#include <openssl/crypto.h>
+#include <openssl/ecdsa.h>
+#include <openssl/hmac.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
 
 static int get_string_envs(CURL * curl, const char *required_env, char *querystring)
 {
@@ -103,6 +117,7 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	int re;
 	int respCode = 0;
 	int ok = BACKEND_DEFER;
+	long timeout_ms;
 	char url[BUFSIZ];
 	char *data;
 
@@ -112,6 +127,10 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	clientid = (clientid && *clientid) ? clientid : "";
 	topic = (topic && *topic) ? topic : "";
 
+	/* Ten seconds, or what is left of check_deadline_ms */
+	if ((timeout_ms = backend_timeout(10000)) < 0)
+		return BACKEND_ERROR;
+
 	if ((curl = curl_easy_init()) == NULL) {
 		_fatal("create curl_easy_handle fails");
 		return BACKEND_ERROR;
@@ -184,7 +203,7 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	curl_easy_setopt(curl, CURLOPT_POST, 1L);
 	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
 
 	re = curl_easy_perform(curl);
 	if (re == CURLE_OK) {
@@ -212,6 +231,991 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	return (ok);
 }
 
+/*
+ * Local verification. With jwt_secret, jwt_public_key or jwt_jwks,
+ * tokens are verified here, and their claims say who is a superuser and what each
+ * may access, e.g.
+ * {"sub": "jane", "exp": 1700000000, "superuser": false,
+ *  "mqtt_acl": ["a/%u/#", {"pattern": "b/#", "access": "read"}]}.
+ * The claims of a verified token are kept, by the token's digest, until
+ * it expires; a set is immutable, and lookups hold a reference while
+ * they read it.
+ */
+
+struct jwt_claims {
+	char key[SHA256_DIGEST_LENGTH * 2 + 1];
+	time_t expires;
+	int refs;			/* Protected by conf->lock */
+	char *username;			/* What %u in patterns stands for */
+	int superuser;
+	int nacl;
+	struct backend_rule *acl;
+	UT_hash_handle hh;
+};
+
+struct jwt_key {
+	char *kid;			/* "" if it has none */
+	char *alg;			/* The only one it may be used with, or NULL */
+	EVP_PKEY *pkey;
+	unsigned char *secret;		/* For HS256, HS384 and HS512 */
+	size_t secretlen;
+	UT_hash_handle hh;
+};
+
+struct jwt_keyset {
+	struct jwt_key *keys;		/* By kid */
+	int refs;			/* Protected by conf->jwks_lock */
+};
+
+/* Decode the unpadded base64url `in' of `len' characters, or NULL */
+static unsigned char *b64url_decode(const char *in, size_t len, size_t *outlen)
+{
+	unsigned char *out;
+	unsigned long bits = 0;
+	size_t n, o = 0;
+	int nbits = 0, v;
+	char c;
+
+	if ((out = malloc(len * 3 / 4 + 1)) == NULL)
+		return (NULL);
+	for (n = 0; n < len; n++) {
+		c = in[n];
+		if (c >= 'A' && c <= 'Z')
+			v = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			v = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			v = c - '0' + 52;
+		else if (c == '-')
+			v = 62;
+		else if (c == '_')
+			v = 63;
+		else {
+			free(out);
+			return (NULL);
+		}
+		bits = (bits << 6) | v;
+		if ((nbits += 6) >= 8) {
+			nbits -= 8;
+			out[o++] = (bits >> nbits) & 0xff;
+		}
+	}
+	out[o] = 0;
+	*outlen = o;
+	return (out);
+}
+
+static struct json *b64url_json(const char *in, size_t len)
+{
+	unsigned char *text;
+	struct json *j;
+	size_t n;
+
+	if ((text = b64url_decode(in, len, &n)) == NULL)
+		return (NULL);
+	j = json_parse((char *)text, n);
+	free(text);
+	if (j && j->type != JSON_OBJECT) {
+		json_free(j);
+		j = NULL;
+	}
+	return (j);
+}
+
+/* The digest of alg, from its last three characters */
+static const EVP_MD *alg_md(const char *alg)
+{
+	size_t len = strlen(alg);
+
+	if (len != 5)
+		return (NULL);
+	if (strcmp(alg + 2, "256") == 0)
+		return (EVP_sha256());
+	if (strcmp(alg + 2, "384") == 0)
+		return (EVP_sha384());
+	if (strcmp(alg + 2, "512") == 0)
+		return (EVP_sha512());
+	return (NULL);
+}
+
+static int verify_hmac(struct jwt_key *k, const EVP_MD *md, const char *input, size_t len, const unsigned char *sig, size_t siglen)
+{
+	unsigned char mac[EVP_MAX_MD_SIZE];
+	unsigned int maclen = 0;
+
+	if (k->secret == NULL ||
+	    HMAC(md, k->secret, k->secretlen, (const unsigned char *)input, len, mac, &maclen) == NULL)
+		return (0);
+	return (maclen == siglen && CRYPTO_memcmp(mac, sig, siglen) == 0);
+}
+
+static int verify_digest(EVP_PKEY *pkey, const EVP_MD *md, int pss, const char *input, size_t len, const unsigned char *sig, size_t siglen)
+{
+	EVP_MD_CTX *ctx;
+	EVP_PKEY_CTX *pctx = NULL;
+	int ok;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000 || defined(LIBRESSL_VERSION_NUMBER)
+	if ((ctx = EVP_MD_CTX_create()) == NULL)
+		return (0);
+#else
+	if ((ctx = EVP_MD_CTX_new()) == NULL)
+		return (0);
+#endif
+	ok = EVP_DigestVerifyInit(ctx, &pctx, md, NULL, pkey) == 1;
+	if (ok && pss) {
+		ok = EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) > 0 &&
+		     EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx, -1) > 0;	/* The digest's length */
+	}
+	ok = ok && EVP_DigestVerifyUpdate(ctx, input, len) == 1 &&
+	     EVP_DigestVerifyFinal(ctx, sig, siglen) == 1;
+#if OPENSSL_VERSION_NUMBER < 0x10100000 || defined(LIBRESSL_VERSION_NUMBER)
+	EVP_MD_CTX_destroy(ctx);
+#else
+	EVP_MD_CTX_free(ctx);
+#endif
+	return (ok);
+}
+
+/* ES256 and friends sign with r and s side by side, OpenSSL wants DER */
+static int verify_ecdsa(EVP_PKEY *pkey, const EVP_MD *md, int bits, const char *input, size_t len, const unsigned char *sig, size_t siglen)
+{
+	ECDSA_SIG *es;
+	BIGNUM *r, *s;
+	unsigned char *der = NULL;
+	size_t half = (bits + 7) / 8;
+	int derlen, ok = 0;
+
+	if (EVP_PKEY_bits(pkey) != bits || siglen != half * 2 || (es = ECDSA_SIG_new()) == NULL)
+		return (0);
+	r = BN_bin2bn(sig, half, NULL);
+	s = BN_bin2bn(sig + half, half, NULL);
+#if OPENSSL_VERSION_NUMBER < 0x10100000 || defined(LIBRESSL_VERSION_NUMBER)
+	BN_free(es->r);
+	BN_free(es->s);
+	es->r = r;
+	es->s = s;
+#else
+	ECDSA_SIG_set0(es, r, s);
+#endif
+	if (r && s && (derlen = i2d_ECDSA_SIG(es, &der)) > 0)
+		ok = verify_digest(pkey, md, FALSE, input, len, der, derlen);
+	OPENSSL_free(der);
+	ECDSA_SIG_free(es);
+	return (ok);
+}
+
+/*
+ * Check the signature `sig' of `input' by `alg' with the key `k'. Each
+ * algorithm needs a key of its own kind, so that a public key can't be
+ * passed off as an HMAC secret, and "none" is never accepted.
+ */
+
+static int verify_signature(struct jwt_key *k, const char *alg, const char *input, size_t len, const unsigned char *sig, size_t siglen)
+{
+	EVP_PKEY *pkey = k->pkey;
+	const EVP_MD *md = alg_md(alg);
+	int type = pkey ? EVP_PKEY_base_id(pkey) : EVP_PKEY_NONE;
+
+	if (k->alg && strcmp(k->alg, alg) != 0)
+		return (0);
+
+	if (strcmp(alg, "EdDSA") == 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+		EVP_MD_CTX *ctx;
+		int ok;
+
+		if ((type != EVP_PKEY_ED25519 && type != EVP_PKEY_ED448) || (ctx = EVP_MD_CTX_new()) == NULL)
+			return (0);
+		ok = EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey) == 1 &&
+		     EVP_DigestVerify(ctx, sig, siglen, (const unsigned char *)input, len) == 1;
+		EVP_MD_CTX_free(ctx);
+		return (ok);
+#else
+		return (0);
+#endif
+	}
+	if (md == NULL)
+		return (0);
+	if (strncmp(alg, "HS", 2) == 0)
+		return (verify_hmac(k, md, input, len, sig, siglen));
+	if (strncmp(alg, "RS", 2) == 0 || strncmp(alg, "PS", 2) == 0)
+		return (type == EVP_PKEY_RSA && verify_digest(pkey, md, *alg == 'P', input, len, sig, siglen));
+	if (strncmp(alg, "ES", 2) == 0)
+		return (type == EVP_PKEY_EC &&
+			verify_ecdsa(pkey, md, (md == EVP_sha512()) ? 521 : EVP_MD_size(md) * 8, input, len, sig, siglen));
+	return (0);
+}
+
+/*
+ * JSON Web Key Sets. With jwt_jwks, the keys come from a JWKS document
+ * in a file or at a URL, and a token's kid picks its key. The set is
+ * parsed on a thread of its own, which fetches it again every
+ * jwt_jwks_refresh_seconds, revalidating with the ETag of a URL or the
+ * mtime and size of a file, and at once when a token names a kid the
+ * set doesn't have. A document which can't be had or has no usable key
+ * leaves the last good set in place.
+ */
+
+#define DER_MAX		(2048)
+#define RSA_MAX_BYTES	(8192 / 8)
+
+/* An RSA, EC P-256, P-384, P-521, Ed25519 and Ed448 AlgorithmIdentifier */
+static const unsigned char ALGID_RSA[] = { 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01, 0x05, 0x00 };
+static const unsigned char ALGID_P256[] = { 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 };
+static const unsigned char ALGID_P384[] = { 0x30, 0x10, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01, 0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22 };
+static const unsigned char ALGID_P521[] = { 0x30, 0x10, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01, 0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x23 };
+static const unsigned char ALGID_ED25519[] = { 0x30, 0x05, 0x06, 0x03, 0x2b, 0x65, 0x70 };
+static const unsigned char ALGID_ED448[] = { 0x30, 0x05, 0x06, 0x03, 0x2b, 0x65, 0x71 };
+
+/*
+ * Write `tag' and the `len' bytes at `c' to the `size' bytes at `out'
+ * as DER; its length, or 0 if it doesn't fit
+ */
+static size_t der(unsigned char *out, size_t size, int tag, const unsigned char *c, size_t len)
+{
+	size_t n = 0;
+
+	if (len > 0xffff || size < 4 || len > size - 4)
+		return (0);
+	out[n++] = tag;
+	if (len >= 0x100) {
+		out[n++] = 0x82;
+		out[n++] = len >> 8;
+	} else if (len >= 0x80) {
+		out[n++] = 0x81;
+	}
+	out[n++] = len & 0xff;
+	memmove(out + n, c, len);
+	return (n + len);
+}
+
+/* The unsigned big-endian number at `c' as a DER INTEGER in `size' bytes at `out' */
+static size_t der_int(unsigned char *out, size_t size, const unsigned char *c, size_t len)
+{
+	unsigned char buf[DER_MAX];
+
+	while (len > 1 && *c == 0) {
+		c++;
+		len--;
+	}
+	if (len == 0 || len + 1 > sizeof(buf))
+		return (0);
+	buf[0] = 0;
+	memcpy(buf + 1, c, len);
+	return ((*c & 0x80) ? der(out, size, 0x02, buf, len + 1) : der(out, size, 0x02, c, len));
+}
+
+/* A base64url member of `jwk', decoded, or NULL */
+static unsigned char *jwk_bytes(struct json *jwk, const char *name, size_t *len)
+{
+	const char *v = json_string(jwk, name);
+
+	return (v ? b64url_decode(v, strlen(v), len) : NULL);
+}
+
+/*
+ * The public key of an RSA, EC or OKP `jwk'. OpenSSL has no one way of
+ * building a key from its parts across its versions, but all of them
+ * read a SubjectPublicKeyInfo, so that is what is made of it.
+ */
+
+static EVP_PKEY *jwk_pkey(struct json *jwk)
+{
+	unsigned char a[DER_MAX], b[DER_MAX], *n = NULL, *e = NULL;
+	const unsigned char *algid = NULL, *p;
+	const char *kty = json_string(jwk, "kty"), *crv = json_string(jwk, "crv");
+	size_t nlen = 0, elen = 0, algidlen = 0, len = 0, half = 0, m;
+	EVP_PKEY *pkey = NULL;
+
+	if (kty == NULL)
+		return (NULL);
+	if (strcmp(kty, "RSA") == 0) {
+		if ((n = jwk_bytes(jwk, "n", &nlen)) != NULL && (e = jwk_bytes(jwk, "e", &elen)) != NULL)
+			for (p = n; nlen > 1 && *p == 0; p++)
+				nlen--;
+		/* Moduli over 8192 bits are refused before anything is built */
+		if (n && e && nlen <= RSA_MAX_BYTES && elen <= RSA_MAX_BYTES &&
+		    (len = der_int(a, sizeof(a), p, nlen)) > 0 &&
+		    (m = der_int(a + len, sizeof(a) - len, e, elen)) > 0 &&
+		    (m = der(b + 1, sizeof(b) - 1, 0x30, a, len + m)) > 0) {
+			b[0] = 0;
+			len = m + 1;
+			algid = ALGID_RSA;
+			algidlen = sizeof(ALGID_RSA);
+		}
+	} else if (strcmp(kty, "EC") == 0 && crv) {
+		if (strcmp(crv, "P-256") == 0) {
+			half = 32;
+			algid = ALGID_P256;
+			algidlen = sizeof(ALGID_P256);
+		} else if (strcmp(crv, "P-384") == 0) {
+			half = 48;
+			algid = ALGID_P384;
+			algidlen = sizeof(ALGID_P384);
+		} else if (strcmp(crv, "P-521") == 0) {
+			half = 66;
+			algid = ALGID_P521;
+			algidlen = sizeof(ALGID_P521);
+		}
+		if (algid && (n = jwk_bytes(jwk, "x", &nlen)) != NULL && (e = jwk_bytes(jwk, "y", &elen)) != NULL &&
+		    nlen == half && elen == half) {
+			b[0] = 0;
+			b[1] = 0x04;		/* Uncompressed */
+			memcpy(b + 2, n, half);
+			memcpy(b + 2 + half, e, half);
+			len = 2 + half * 2;
+		}
+	} else if (strcmp(kty, "OKP") == 0 && crv) {
+		if (strcmp(crv, "Ed25519") == 0) {
+			half = 32;
+			algid = ALGID_ED25519;
+			algidlen = sizeof(ALGID_ED25519);
+		} else if (strcmp(crv, "Ed448") == 0) {
+			half = 57;
+			algid = ALGID_ED448;
+			algidlen = sizeof(ALGID_ED448);
+		}
+		if (algid && (n = jwk_bytes(jwk, "x", &nlen)) != NULL && nlen == half) {
+			b[0] = 0;
+			memcpy(b + 1, n, half);
+			len = 1 + half;
+		}
+	}
+
+	/* SEQUENCE { AlgorithmIdentifier, BIT STRING { key } } */
+	if (len > 0 && (m = der(a + algidlen, sizeof(a) - algidlen, 0x03, b, len)) > 0) {
+		memcpy(a, algid, algidlen);
+		if ((len = der(b, sizeof(b), 0x30, a, algidlen + m)) > 0) {
+			p = b;
+			pkey = d2i_PUBKEY(NULL, &p, len);
+		}
+	}
+	free(n);
+	free(e);
+	return (pkey);
+}
+
+static void key_free(struct jwt_key *k)
+{
+	if (k == NULL)
+		return;
+	EVP_PKEY_free(k->pkey);
+	free(k->secret);
+	free(k->kid);
+	free(k->alg);
+	free(k);
+}
+
+static void keyset_free(struct jwt_keyset *ks)
+{
+	struct jwt_key *k, *tmp;
+
+	HASH_ITER(hh, ks->keys, k, tmp) {
+		HASH_DEL(ks->keys, k);
+		key_free(k);
+	}
+	free(ks);
+}
+
+/* The key set in the JWKS document `text', or NULL if it has no usable key */
+static struct jwt_keyset *keyset_parse(const char *text, size_t len)
+{
+	struct jwt_keyset *ks;
+	struct jwt_key *k, *dup;
+	struct json *j, *keys, *jwk;
+	const char *kid, *use, *alg, *kty;
+	int n;
+
+	if ((j = json_parse(text, len)) == NULL || (keys = json_get(j, "keys")) == NULL ||
+	    keys->type != JSON_ARRAY || (ks = calloc(1, sizeof(struct jwt_keyset))) == NULL) {
+		json_free(j);
+		return (NULL);
+	}
+	for (n = 0; n < keys->count; n++) {
+		jwk = keys->items[n];
+		kid = json_string(jwk, "kid");
+		use = json_string(jwk, "use");
+		alg = json_string(jwk, "alg");
+		kty = json_string(jwk, "kty");
+		if (use && strcmp(use, "sig") != 0)
+			continue;
+		HASH_FIND_STR(ks->keys, kid ? kid : "", dup);
+		if (dup || (k = calloc(1, sizeof(struct jwt_key))) == NULL)
+			continue;
+		k->kid = strdup(kid ? kid : "");
+		k->alg = alg ? strdup(alg) : NULL;
+		if (kty && strcmp(kty, "oct") == 0)
+			k->secret = jwk_bytes(jwk, "k", &k->secretlen);
+		else
+			k->pkey = jwk_pkey(jwk);
+		if (k->kid == NULL || (alg && k->alg == NULL) || (k->pkey == NULL && k->secret == NULL)) {
+			_log(LOG_NOTICE, "jwt: ignoring key %s of type %s", kid ? kid : "without kid", kty ? kty : "none");
+			key_free(k);
+			continue;
+		}
+		HASH_ADD_KEYPTR(hh, ks->keys, k->kid, strlen(k->kid), k);
+	}
+	json_free(j);
+	if (HASH_COUNT(ks->keys) == 0) {
+		keyset_free(ks);
+		return (NULL);
+	}
+	return (ks);
+}
+
+/* The current key set, with a reference dropped with keyset_put(), or NULL */
+static struct jwt_keyset *keyset_get(struct jwt_backend *conf)
+{
+	struct jwt_keyset *ks;
+
+	pthread_mutex_lock(&conf->jwks_lock);
+	if ((ks = conf->keyset) != NULL)
+		ks->refs++;
+	pthread_mutex_unlock(&conf->jwks_lock);
+	return (ks);
+}
+
+static void keyset_put(struct jwt_backend *conf, struct jwt_keyset *ks)
+{
+	int refs;
+
+	if (ks == NULL)
+		return;
+	pthread_mutex_lock(&conf->jwks_lock);
+	refs = --ks->refs;
+	pthread_mutex_unlock(&conf->jwks_lock);
+	if (refs == 0)
+		keyset_free(ks);
+}
+
+/* The key for `kid', or for a token without one the set's only key */
+static struct jwt_key *keyset_find(struct jwt_keyset *ks, const char *kid)
+{
+	struct jwt_key *k;
+
+	if (ks == NULL)
+		return (NULL);
+	HASH_FIND_STR(ks->keys, kid ? kid : "", k);
+	if (k == NULL && kid == NULL && HASH_COUNT(ks->keys) == 1)
+		k = ks->keys;
+	return (k);
+}
+
+struct jwks_answer {
+	char *text;
+	size_t len;
+	char *etag;
+};
+
+static size_t jwks_body(void *ptr, size_t size, size_t nmemb, void *arg)
+{
+	struct jwks_answer *a = (struct jwks_answer *)arg;
+	size_t n = size * nmemb;
+	char *text;
+
+	if (a->len + n > 1024 * 1024 || (text = realloc(a->text, a->len + n + 1)) == NULL)
+		return (0);
+	memcpy(text + a->len, ptr, n);
+	a->text = text;
+	a->len += n;
+	a->text[a->len] = 0;
+	return (n);
+}
+
+static size_t jwks_header(char *buf, size_t size, size_t nitems, void *arg)
+{
+	struct jwks_answer *a = (struct jwks_answer *)arg;
+	size_t n = size * nitems, len;
+
+	if (n > 5 && strncasecmp(buf, "ETag:", 5) == 0) {
+		for (buf += 5, len = n - 5; len > 0 && (*buf == ' ' || *buf == '\t'); buf++, len--)
+			;
+		while (len > 0 && (buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == ' '))
+			len--;
+		free(a->etag);
+		if ((a->etag = malloc(len + 1)) != NULL) {
+			memcpy(a->etag, buf, len);
+			a->etag[len] = 0;
+		}
+	}
+	return (n);
+}
+
+/*
+ * Get the JWKS document into `*a' unless it is as it was when last
+ * read. Returns 1 if it was read, 0 if it is unchanged, -1 on failure.
+ */
+
+static int jwks_fetch(struct jwt_backend *conf, struct jwks_answer *a)
+{
+	struct curl_slist *headers = NULL;
+	struct stat st;
+	char inm[1024];
+	CURL *curl;
+	CURLcode re;
+	long code = 0;
+	FILE *fp;
+
+	if (strncmp(conf->jwks, "http://", 7) != 0 && strncmp(conf->jwks, "https://", 8) != 0) {
+		if (stat(conf->jwks, &st) != 0 || st.st_size > 1024 * 1024) {
+			_log(LOG_NOTICE, "jwt: cannot read %s", conf->jwks);
+			return (-1);
+		}
+		snprintf(inm, sizeof(inm), "%ld-%ld", (long)st.st_mtime, (long)st.st_size);
+		if (conf->jwks_etag && strcmp(conf->jwks_etag, inm) == 0)
+			return (0);
+		if ((fp = fopen(conf->jwks, "r")) == NULL || (a->text = malloc(st.st_size + 1)) == NULL) {
+			if (fp)
+				fclose(fp);
+			return (-1);
+		}
+		a->len = fread(a->text, 1, st.st_size, fp);
+		a->text[a->len] = 0;
+		fclose(fp);
+		a->etag = strdup(inm);
+		return (1);
+	}
+
+	if ((curl = curl_easy_init()) == NULL)
+		return (-1);
+	if (conf->jwks_etag && strlen(conf->jwks_etag) < sizeof(inm) - 20) {
+		snprintf(inm, sizeof(inm), "If-None-Match: %s", conf->jwks_etag);
+		headers = curl_slist_append(headers, inm);
+	}
+	curl_easy_setopt(curl, CURLOPT_URL, conf->jwks);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, jwks_body);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, a);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, jwks_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, a);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 10000L);
+	re = curl_easy_perform(curl);
+	if (re == CURLE_OK)
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+	curl_easy_cleanup(curl);
+	curl_slist_free_all(headers);
+
+	if (re == CURLE_OK && code == 304 && conf->jwks_etag)
+		return (0);
+	if (re != CURLE_OK || code < 200 || code >= 300 || a->text == NULL) {
+		_log(LOG_NOTICE, "jwt: cannot fetch %s: %s, %ld", conf->jwks, curl_easy_strerror(re), code);
+		return (-1);
+	}
+	return (1);
+}
+
+/*
+ * Fetch the key set and, if it has changed and has usable keys, put it
+ * in place of the old one. Returns -1 if there is no good set to be had.
+ */
+
+static int jwks_load(struct jwt_backend *conf)
+{
+	struct jwks_answer a = { NULL, 0, NULL };
+	struct jwt_keyset *ks = NULL, *old;
+	int rc;
+
+	if ((rc = jwks_fetch(conf, &a)) > 0) {
+		if ((ks = keyset_parse(a.text, a.len)) == NULL) {
+			_log(LOG_NOTICE, "jwt: no usable keys in %s, keeping those I have", conf->jwks);
+			rc = -1;
+		} else {
+			_log(LOG_NOTICE, "jwt: %d keys from %s", HASH_COUNT(ks->keys), conf->jwks);
+			free(conf->jwks_etag);
+			conf->jwks_etag = a.etag;
+			a.etag = NULL;
+			ks->refs = 1;
+			pthread_mutex_lock(&conf->jwks_lock);
+			old = conf->keyset;
+			conf->keyset = ks;
+			pthread_mutex_unlock(&conf->jwks_lock);
+			keyset_put(conf, old);
+		}
+	}
+	free(a.text);
+	free(a.etag);
+	return (rc);
+}
+
+/*
+ * Fetch the key set every jwt_jwks_refresh_seconds, or when kicked, and
+ * after a failure again in jwt_jwks_min_refetch_seconds.
+ */
+
+static void *jwks_refresher(void *arg)
+{
+	struct jwt_backend *conf = (struct jwt_backend *)arg;
+	struct timespec ts;
+	int ok = TRUE;
+
+	pthread_mutex_lock(&conf->jwks_lock);
+	while (conf->jwks_running) {
+		ts.tv_sec = conf->jwks_fetched + (ok ? conf->jwks_refresh : conf->jwks_min_refetch);
+		ts.tv_nsec = 0;
+		while (conf->jwks_running && !conf->jwks_kick && time(NULL) < ts.tv_sec)
+			pthread_cond_timedwait(&conf->jwks_cond, &conf->jwks_lock, &ts);
+		if (!conf->jwks_running)
+			break;
+		conf->jwks_kick = FALSE;
+		pthread_mutex_unlock(&conf->jwks_lock);
+
+		ok = (jwks_load(conf) >= 0);
+
+		pthread_mutex_lock(&conf->jwks_lock);
+		conf->jwks_fetched = time(NULL);
+		conf->jwks_generation++;
+		pthread_cond_broadcast(&conf->jwks_cond);
+	}
+	pthread_mutex_unlock(&conf->jwks_lock);
+	return (NULL);
+}
+
+/*
+ * Have the key set fetched now, as a token names a kid it doesn't have,
+ * and wait for that. Lookups which miss together share the fetch, and
+ * such fetches are at least jwt_jwks_min_refetch_seconds apart, so
+ * made-up kids can't hammer the source. Returns 1 if there was one.
+ */
+
+static int jwks_refetch(struct jwt_backend *conf)
+{
+	struct timespec ts;
+	long ms;
+	int gen, done;
+
+	if ((ms = backend_timeout(5000)) < 0)
+		return (0);
+	deadline_after(ms, &ts);
+
+	pthread_mutex_lock(&conf->jwks_lock);
+	if (!conf->jwks_kick && time(NULL) - conf->jwks_fetched < conf->jwks_min_refetch) {
+		pthread_mutex_unlock(&conf->jwks_lock);
+		return (0);
+	}
+	gen = conf->jwks_generation;
+	conf->jwks_kick = TRUE;
+	pthread_cond_broadcast(&conf->jwks_cond);
+	while (conf->jwks_running && conf->jwks_generation == gen) {
+		if (pthread_cond_timedwait(&conf->jwks_cond, &conf->jwks_lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	done = (conf->jwks_generation != gen);
+	pthread_mutex_unlock(&conf->jwks_lock);
+	return (done);
+}
+
+/* Whether the claim `aud', a string or an array of them, names `audience' */
+static int has_audience(struct json *aud, const char *audience)
+{
+	int n;
+
+	if (aud && aud->type == JSON_STRING)
+		return (strcmp(aud->string, audience) == 0);
+	if (aud && aud->type == JSON_ARRAY) {
+		for (n = 0; n < aud->count; n++) {
+			if (aud->items[n]->type == JSON_STRING && strcmp(aud->items[n]->string, audience) == 0)
+				return (1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Verify `token' and return its claims, to be freed by the caller, or
+ * NULL if it is not to be trusted.
+ */
+
+static struct json *jwt_verify(struct jwt_backend *conf, const char *token)
+{
+	const char *dot1, *dot2;
+	struct json *header = NULL, *claims = NULL, *exp, *nbf;
+	struct jwt_keyset *ks = NULL;
+	struct jwt_key *k = conf->key;
+	const char *alg, *iss, *kid;
+	unsigned char *sig = NULL;
+	size_t siglen;
+	time_t now = time(NULL);
+
+	if ((dot1 = strchr(token, '.')) == NULL || (dot2 = strchr(dot1 + 1, '.')) == NULL ||
+	    strchr(dot2 + 1, '.') != NULL)
+		return (NULL);
+
+	if ((header = b64url_json(token, dot1 - token)) == NULL ||
+	    (alg = json_string(header, "alg")) == NULL ||
+	    (sig = b64url_decode(dot2 + 1, strlen(dot2 + 1), &siglen)) == NULL) {
+		_log(LOG_DEBUG, "jwt: malformed token");
+		goto bad;
+	}
+	if (conf->jwks) {
+		kid = json_string(header, "kid");
+		if ((k = keyset_find((ks = keyset_get(conf)), kid)) == NULL) {
+			keyset_put(conf, ks);
+			ks = NULL;
+			if (jwks_refetch(conf))
+				k = keyset_find((ks = keyset_get(conf)), kid);
+		}
+		if (k == NULL && (k = conf->key) == NULL) {
+			_log(LOG_DEBUG, "jwt: no key %s", kid ? kid : "without kid");
+			goto bad;
+		}
+	}
+	if (!verify_signature(k, alg, token, dot2 - token, sig, siglen)) {
+		_log(LOG_DEBUG, "jwt: bad %s signature", alg);
+		goto bad;
+	}
+	keyset_put(conf, ks);
+	ks = NULL;
+	if ((claims = b64url_json(dot1 + 1, dot2 - dot1 - 1)) == NULL)
+		goto bad;
+
+	exp = json_get(claims, "exp");
+	nbf = json_get(claims, "nbf");
+	if ((exp && (exp->type != JSON_NUMBER || exp->number + conf->leeway <= now)) ||
+	    (nbf && (nbf->type != JSON_NUMBER || nbf->number - conf->leeway > now))) {
+		_log(LOG_DEBUG, "jwt: token expired or not yet valid");
+		goto bad;
+	}
+	if (conf->audience && !has_audience(json_get(claims, "aud"), conf->audience)) {
+		_log(LOG_DEBUG, "jwt: token not for %s", conf->audience);
+		goto bad;
+	}
+	if (conf->issuer && ((iss = json_string(claims, "iss")) == NULL || strcmp(iss, conf->issuer) != 0)) {
+		_log(LOG_DEBUG, "jwt: token not issued by %s", conf->issuer);
+		goto bad;
+	}
+
+	json_free(header);
+	free(sig);
+	return (claims);
+
+  bad:
+	keyset_put(conf, ks);
+	json_free(header);
+	json_free(claims);
+	free(sig);
+	return (NULL);
+}
+
+static void claims_free(struct jwt_claims *c)
+{
+	int n;
+
+	for (n = 0; n < c->nacl; n++)
+		free(c->acl[n].pattern);
+	free(c->acl);
+	free(c->username);
+	free(c);
+}
+
+static void claims_put(struct jwt_backend *conf, struct jwt_claims *c)
+{
+	int refs;
+
+	pthread_mutex_lock(&conf->lock);
+	refs = --c->refs;
+	pthread_mutex_unlock(&conf->lock);
+	if (refs == 0)
+		claims_free(c);
+}
+
+/* Drop `c' from the cache. Called with conf->lock held. */
+static void claims_drop(struct jwt_backend *conf, struct jwt_claims *c)
+{
+	HASH_DEL(conf->claims, c);
+	if (--c->refs == 0)
+		claims_free(c);
+}
+
+/* What the plugin needs of the verified `claims' */
+static struct jwt_claims *claims_make(struct jwt_backend *conf, struct json *claims, const char *key)
+{
+	struct jwt_claims *c;
+	struct json *su, *acl, *item, *pattern, *exp;
+	const char *username;
+	time_t now = time(NULL);
+	int n, mask;
+
+	if ((c = calloc(1, sizeof(struct jwt_claims))) == NULL)
+		return (NULL);
+	strcpy(c->key, key);
+	c->refs = 1;
+	c->expires = now + conf->cacheseconds;
+	if ((exp = json_get(claims, "exp")) != NULL)
+		c->expires = (time_t)exp->number + conf->leeway;
+
+	username = json_string(claims, conf->username_claim);
+	su = json_get(claims, conf->superuser_claim);
+	c->superuser = (su && su->type == JSON_TRUE);
+	if ((c->username = strdup(username ? username : "")) == NULL)
+		goto fail;
+
+	if ((acl = json_get(claims, conf->acl_claim)) != NULL && acl->type == JSON_ARRAY) {
+		if ((c->acl = calloc(acl->count + 1, sizeof(struct backend_rule))) == NULL)
+			goto fail;
+		for (n = 0; n < acl->count; n++) {
+			item = acl->items[n];
+			pattern = (item->type == JSON_OBJECT) ? json_get(item, "pattern") : item;
+			mask = (item->type == JSON_OBJECT) ? backend_rule_mask(json_get(item, "access")) : BACKEND_ACL_ALL;
+			if (pattern == NULL || pattern->type != JSON_STRING ||
+			    strlen(pattern->string) != pattern->length || mask <= 0) {
+				_log(LOG_NOTICE, "jwt: ignoring rule %d of %s", n, c->username);
+				continue;
+			}
+			if ((c->acl[c->nacl].pattern = strdup(pattern->string)) == NULL)
+				goto fail;
+			c->acl[c->nacl++].mask = mask;
+		}
+	}
+	return (c);
+
+  fail:
+	claims_free(c);
+	return (NULL);
+}
+
+/* The key under which the claims of `token' are kept: its digest */
+static int claims_key(const char *token, char *key)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	unsigned int mdlen = 0, i;
+
+	if (EVP_Digest(token, strlen(token), md, &mdlen, EVP_sha256(), NULL) != 1)
+		return (0);
+	for (i = 0; i < mdlen; i++)
+		sprintf(key + i * 2, "%02x", md[i]);
+	key[mdlen * 2] = 0;
+	return (1);
+}
+
+/*
+ * The claims of `token' if it is valid, with a reference the caller
+ * drops with claims_put(), or NULL. The plugin's caches are told not to
+ * keep an answer past the token's expiry. The table is kept in order of
+ * use, so that the least recently used claims make room for new ones.
+ */
+
+static struct jwt_claims *claims_get(struct jwt_backend *conf, const char *token)
+{
+	struct jwt_claims *c, *old;
+	struct json *claims;
+	char key[SHA256_DIGEST_LENGTH * 2 + 1];
+	time_t now = time(NULL);
+
+	if (!claims_key(token, key))
+		return (NULL);
+
+	pthread_mutex_lock(&conf->lock);
+	HASH_FIND_STR(conf->claims, key, c);
+	if (c && c->expires > now) {
+		HASH_DEL(conf->claims, c);
+		HASH_ADD_STR(conf->claims, key, c);
+		c->refs++;
+		pthread_mutex_unlock(&conf->lock);
+		backend_ttl(c->expires - now);
+		return (c);
+	}
+	pthread_mutex_unlock(&conf->lock);
+
+	if ((claims = jwt_verify(conf, token)) == NULL)
+		return (NULL);
+	c = claims_make(conf, claims, key);
+	json_free(claims);
+	if (c == NULL)
+		return (NULL);
+	_log(LOG_DEBUG, "jwt: token of %s: superuser=%d, %d ACLs, for %lds",
+		c->username, c->superuser, c->nacl, (long)(c->expires - now));
+
+	pthread_mutex_lock(&conf->lock);
+	HASH_FIND_STR(conf->claims, key, old);
+	if (old)
+		claims_drop(conf, old);
+	if (conf->cache_max > 0) {
+		while (HASH_COUNT(conf->claims) >= conf->cache_max)
+			claims_drop(conf, conf->claims);
+		HASH_ADD_STR(conf->claims, key, c);
+		c->refs++;
+	}
+	pthread_mutex_unlock(&conf->lock);
+
+	backend_ttl(c->expires - now);
+	return (c);
+}
+
+/*
+ * Read the options of local verification, if any of its keys is given,
+ * and with jwt_jwks load the key set and start its refresher. Returns 0
+ * if a key was given and can't be used.
+ */
+
+static int jwt_local_init(struct jwt_backend *conf)
+{
+	char *secret = p_stab("jwt_secret"), *keyfile = p_stab("jwt_public_key");
+	int n;
+	FILE *fp;
+
+	conf->jwks = p_stab("jwt_jwks");
+	conf->local = (secret != NULL || keyfile != NULL || conf->jwks != NULL);
+	if (!conf->local)
+		return (1);
+
+	if ((secret || keyfile) && (conf->key = calloc(1, sizeof(struct jwt_key))) == NULL)
+		return (0);
+	if (secret) {
+		conf->key->secret = (unsigned char *)strdup(secret);
+		conf->key->secretlen = strlen(secret);
+	}
+	if (keyfile) {
+		if ((fp = fopen(keyfile, "r")) == NULL) {
+			_log(LOG_NOTICE, "jwt: cannot open %s", keyfile);
+			return (0);
+		}
+		conf->key->pkey = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+		fclose(fp);
+		if (conf->key->pkey == NULL) {
+			_log(LOG_NOTICE, "jwt: no public key in %s", keyfile);
+			return (0);
+		}
+	}
+
+	conf->audience = p_stab("jwt_audience");
+	conf->issuer = p_stab("jwt_issuer");
+	conf->leeway = p_stab("jwt_leeway") ? atol(p_stab("jwt_leeway")) : 0;
+	conf->username_claim = p_stab("jwt_username_claim") ? p_stab("jwt_username_claim") : "sub";
+	conf->superuser_claim = p_stab("jwt_superuser_claim") ? p_stab("jwt_superuser_claim") : "superuser";
+	conf->acl_claim = p_stab("jwt_acl_claim") ? p_stab("jwt_acl_claim") : "mqtt_acl";
+	conf->cacheseconds = p_stab("jwt_cacheseconds") ? atol(p_stab("jwt_cacheseconds")) : 300;
+	n = p_stab("jwt_cache_max") ? atoi(p_stab("jwt_cache_max")) : 10000;
+	conf->cache_max = (n > 0) ? n : 0;
+	conf->claims = NULL;
+	pthread_mutex_init(&conf->lock, NULL);
+
+	if (conf->jwks) {
+		conf->jwks_refresh = p_stab("jwt_jwks_refresh_seconds") ? atol(p_stab("jwt_jwks_refresh_seconds")) : 300;
+		conf->jwks_min_refetch = p_stab("jwt_jwks_min_refetch_seconds") ? atol(p_stab("jwt_jwks_min_refetch_seconds")) : 10;
+		pthread_mutex_init(&conf->jwks_lock, NULL);
+		pthread_cond_init(&conf->jwks_cond, NULL);
+
+		/* Tokens are deferred until there are keys, which the refresher keeps trying for */
+		if (jwks_load(conf) < 0) {
+			_log(LOG_NOTICE, "jwt: no keys yet from %s", conf->jwks);
+			conf->jwks_kick = TRUE;
+		}
+		conf->jwks_fetched = time(NULL);
+		conf->jwks_running = TRUE;
+		if (pthread_create(&conf->jwks_thread, NULL, jwks_refresher, conf) != 0) {
+			_log(LOG_NOTICE, "jwt: cannot start the key set refresher");
+			return (0);
+		}
+	}
+
+	_log(LOG_DEBUG, "jwt: verifying locally, audience=%s issuer=%s",
+		conf->audience ? conf->audience : "any", conf->issuer ? conf->issuer : "any");
+	return (1);
+}
+
 void *be_jwt_init()
 {
 	struct jwt_backend *conf;
@@ -224,6 +1228,18 @@ void *be_jwt_init()
 		_fatal("init curl fail");
 		return (NULL);
 	}
+	conf = (struct jwt_backend *)calloc(1, sizeof(struct jwt_backend));
+	if (conf == NULL) {
+		_fatal("ENOMEM");
+		return (NULL);
+	}
+	if (!jwt_local_init(conf)) {
+		_fatal("Cannot verify tokens with the configured jwt_public_key or jwt_jwks");
+		return (NULL);
+	}
+	if (conf->local)
+		return (conf);
+
 	if ((ip = p_stab("http_ip")) == NULL) {
 		_fatal("Mandatory parameter `http_ip' missing");
 		return (NULL);
@@ -240,7 +1256,6 @@ void *be_jwt_init()
 		_fatal("Mandatory parameter `http_aclcheck_uri' missing");
 		return (NULL);
 	}
-	conf = (struct jwt_backend *)malloc(sizeof(struct jwt_backend));
 	conf->ip = ip;
 	conf->hostname = NULL;
 	conf->hostheader = NULL;
@@ -278,8 +1293,27 @@ void be_jwt_destroy(void *handle)
 {
 	struct jwt_backend *conf = (struct jwt_backend *)handle;
 
+	struct jwt_claims *c, *tmp;
+
 	if (conf) {
-		if (conf->hostname) free(conf->hostname);
+		if (conf->local) {
+			if (conf->jwks) {
+				pthread_mutex_lock(&conf->jwks_lock);
+				conf->jwks_running = FALSE;
+				pthread_cond_broadcast(&conf->jwks_cond);
+				pthread_mutex_unlock(&conf->jwks_lock);
+				pthread_join(conf->jwks_thread, NULL);
+				keyset_put(conf, conf->keyset);
+				pthread_cond_destroy(&conf->jwks_cond);
+				pthread_mutex_destroy(&conf->jwks_lock);
+				free(conf->jwks_etag);
+			}
+			HASH_ITER(hh, conf->claims, c, tmp) {
+				claims_drop(conf, c);
+			}
+			pthread_mutex_destroy(&conf->lock);
+			key_free(conf->key);
+		}
 		if (conf->hostheader) free(conf->hostheader);
 		curl_global_cleanup();
 		free(conf);
@@ -289,10 +1323,17 @@ void be_jwt_destroy(void *handle)
 int be_jwt_getuser(void *handle, const char *token, const char *pass, char **phash, const char *clientid)
 {
 	struct jwt_backend *conf = (struct jwt_backend *)handle;
+	struct jwt_claims *c;
 	int re;
 	if (token == NULL) {
 		return BACKEND_DEFER;
 	}
+	if (conf->local) {
+		if ((c = claims_get(conf, token)) == NULL)
+			return BACKEND_DEFER;
+		claims_put(conf, c);
+		return BACKEND_ALLOW;
+	}
 	re = http_post(handle, conf->getuser_uri, NULL, token, NULL, -1, METHOD_GETUSER);
 	return re;
 };
@@ -300,13 +1341,32 @@ int be_jwt_getuser(void *handle, const char *token, const char *pass, char **pha
 int be_jwt_superuser(void *handle, const char *token)
 {
 	struct jwt_backend *conf = (struct jwt_backend *)handle;
+	struct jwt_claims *c;
+	int re;
 
+	if (conf->local) {
+		if (token == NULL || (c = claims_get(conf, token)) == NULL)
+			return BACKEND_DEFER;
+		re = c->superuser ? BACKEND_ALLOW : BACKEND_DEFER;
+		claims_put(conf, c);
+		return re;
+	}
 	return http_post(handle, conf->superuser_uri, NULL, token, NULL, -1, METHOD_SUPERUSER);
 };
 
 int be_jwt_aclcheck(void *handle, const char *clientid, const char *token, const char *topic, int acc)
 {
 	struct jwt_backend *conf = (struct jwt_backend *)handle;
+	struct jwt_claims *c;
+	int re;
+
+	if (conf->local) {
+		if (token == NULL || topic == NULL || (c = claims_get(conf, token)) == NULL)
+			return BACKEND_DEFER;
+		re = backend_rules_aclcheck("jwt", c->acl, c->nacl, clientid, c->username, topic, acc);
+		claims_put(conf, c);
+		return re;
+	}
 	return http_post(conf, conf->aclcheck_uri, clientid, token, topic, acc, METHOD_ACLCHECK);
 };
 
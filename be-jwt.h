@@ -28,6 +28,9 @@
  */
 #ifdef BE_JWT
 
+#include <pthread.h>
+#include <openssl/evp.h>
+
 #define MAXPARAMSLEN  1024
 #define METHOD_GETUSER   1
 #define METHOD_SUPERUSER 2
@@ -45,6 +48,30 @@ struct jwt_backend {
 	char *superuser_envs;
 	char *aclcheck_envs;
 	char *with_tls;
+	int local;			/* Verify tokens here, without the service */
+	struct jwt_key *key;		/* jwt_secret and jwt_public_key */
+	char *audience;
+	char *issuer;
+	long leeway;			/* Seconds of clock skew allowed */
+	char *username_claim;
+	char *superuser_claim;
+	char *acl_claim;
+	long cacheseconds;		/* For tokens without exp */
+	unsigned cache_max;
+	struct jwt_claims *claims;	/* Of verified tokens, by digest */
+	pthread_mutex_t lock;		/* Protects claims */
+	char *jwks;			/* File or URL of a key set, by kid */
+	long jwks_refresh;		/* Seconds between fetches */
+	long jwks_min_refetch;		/* For unknown kids, or after a failure */
+	char *jwks_etag;		/* Used by the refresher only */
+	pthread_t jwks_thread;
+	pthread_mutex_t jwks_lock;	/* Protects what follows */
+	pthread_cond_t jwks_cond;
+	struct jwt_keyset *keyset;	/* The last good one */
+	time_t jwks_fetched;		/* When last tried */
+	int jwks_generation;		/* Counts fetches */
+	int jwks_kick;			/* Fetch now: a kid is missing */
+	int jwks_running;
 };
 
 void *be_jwt_init();
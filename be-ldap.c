@@ -34,23 +34,147 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 #include <mosquitto.h>
 #include "backends.h"
 #include "be-ldap.h"
 #include "log.h"
 #include "hash.h"
+#include "supervisor.h"
+#include "uthash.h"
+#include <ldap_sync.h>
 
 struct ldap_backend {
 	char *ldap_uri;
 	char *connstr;		/* ldap_initialize() wants scheme://host:port  only */
 	LDAPURLDesc *lud;	
-	LDAP *ld;
+	struct supervisor *sv;	/* Owns the searching LDAP handles */
+	struct supervisor *bindsv; /* Owns the handles users bind on */
+	char *binddn;
+	char *bindpw;
 	char *user_uri;
 	char *superquery;
 	char *aclquery;
 	int acldeny;
+	struct timeval timeout;	/* Per operation, ldap_timeout_ms */
+	time_t dn_cacheseconds;
+	pthread_mutex_t dn_lock;
+	struct dn_entry *dns;	/* username -> DN, protected by dn_lock */
+	unsigned dn_count;
+	char *superuser_group;	/* DN of the superusers' group */
+	char *acl_attribute;	/* Attribute holding topic patterns */
+	char *group_base;
+	char *group_filter;	/* Groups with '@' as a member */
+	time_t authz_cacheseconds;
+	pthread_mutex_t authz_lock;
+	struct authz *authz;	/* username -> record, protected by authz_lock */
+	unsigned authz_count;
+	unsigned long authz_epoch; /* Bumped by replica changes, under authz_lock */
+	struct replica *replica; /* With ldap_replica only */
+};
+
+/*
+ * Logins resolve the username to a DN with a search before binding as
+ * it. The DN rarely changes, so it is remembered for a while and repeat
+ * logins go straight to the bind.
+ */
+
+#define DN_CACHE_MAX	(10000)
+
+struct dn_entry {
+	char *username;
+	char *dn;
+	time_t expires;
+	UT_hash_handle hh;
+};
+
+/*
+ * What a user may do: whether it is in the superusers' group, and the
+ * topic patterns from the ACL attribute of its entry and of every group
+ * it belongs to, directly or through other groups. Fetched once and
+ * cached for ldap_authz_cacheseconds, so that the superuser check and
+ * the ACL checks of every topic are answered in-process. A record is
+ * immutable; lookups hold a reference while they read it.
+ */
+
+#define GROUPS_MAX	(256)	/* Groups followed per user */
+#define NESTING_MAX	(8)	/* Levels of nested groups followed */
+
+struct authz {
+	char *username;			/* Lower-cased */
+	time_t expires;
+	int refs;			/* Protected by authz_lock */
+	int superuser;
+	int npatterns;
+	struct backend_rule *patterns;
+	UT_hash_handle hh;
 };
 
+/*
+ * With ldap_replica, a thread follows the directory under
+ * ldap_replica_base with a syncrepl (RFC 4533) refreshAndPersist search
+ * and keeps every entry's DN, username, group members and ACL attribute
+ * in memory. Once its first refresh is complete, logins take the DN
+ * from there and only bind, and superuser and ACL checks are answered
+ * without asking the directory; until then, they search as usual.
+ *
+ * Entries are keyed by their entryUUID, which is all the directory
+ * sends when one is deleted or left unchanged. An index from member DN
+ * to the groups listing it lets a user's groups be followed upwards,
+ * and a change drops the cached records of the users it reaches going
+ * downwards, and only those. If the connection drops,
+ * the replica keeps answering from what it has, and the thread resumes
+ * from the last sync cookie once it has reconnected.
+ */
+
+struct rentry {
+	char uuid[16];		/* entryUUID */
+	char *dn;
+	char *ldn;		/* Lower-cased DN */
+	char *username;		/* Lower-cased, or NULL if not a user */
+	char **members;		/* Lower-cased, NULL-terminated, or NULL if not a group */
+	int npatterns;
+	struct backend_rule *patterns;
+	int present;		/* Mentioned during the current refresh */
+	UT_hash_handle hh;	/* All entries, by uuid */
+	UT_hash_handle hu;	/* Users, by username */
+	UT_hash_handle hd;	/* All entries, by lower-cased DN */
+};
+
+/* The groups which list a DN as a member */
+struct rmember {
+	char *dn;		/* Lower-cased */
+	struct rentry **groups;
+	int count;
+	UT_hash_handle hh;
+};
+
+struct replica {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;		/* Protected by mutex */
+	pthread_rwlock_t lock;	/* Protects the entries and what follows */
+	struct rentry *entries;
+	struct rentry *users;
+	struct rentry *dns;
+	struct rmember *members;
+	int ready;		/* First refresh complete */
+	int sweep;		/* The refresh started afresh */
+	struct berval cookie;	/* Sync state to resume from; thread only */
+	char *base;
+	char *filter;
+	char **attrs;		/* User attribute, member attributes, ACL attribute */
+	int nmembers;		/* Number of member attributes */
+};
+
+static void authz_free(struct authz *a);
+static struct replica *replica_new(struct ldap_backend *conf);
+static void replica_destroy(struct replica *r);
+static int replica_dn(struct replica *r, const char *username, char **pdn);
+
 static char *get_bool(char *option, char *defval)
 {
 	char *flag = p_stab(option);
@@ -62,13 +186,68 @@ static char *get_bool(char *option, char *defval)
 	return defval;
 }
 
+/*
+ * Open and bind the connection used for searches. Runs on the
+ * supervisor thread.
+ */
+
+static void *be_ldap_connect(void *handle)
+{
+	struct ldap_backend *conf = (struct ldap_backend *)handle;
+	LDAP *ld;
+	int rc, opt;
+
+	if (ldap_initialize(&ld, conf->connstr) != LDAP_SUCCESS) {
+		_log(LOG_NOTICE, "Cannot ldap_initialize");
+		return (NULL);
+	}
+
+	opt = LDAP_VERSION3;
+	ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &opt);
+
+	/* Bound the connect and every synchronous operation, binds included */
+	ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &conf->timeout);
+	ldap_set_option(ld, LDAP_OPT_TIMEOUT, &conf->timeout);
+
+	if ((rc = ldap_simple_bind_s(ld, conf->binddn, conf->bindpw)) != LDAP_SUCCESS) {
+		_log(LOG_NOTICE, "Cannot bind to LDAP: %s", ldap_err2string(rc));
+		ldap_unbind(ld);
+		return (NULL);
+	}
+	return (ld);
+}
+
+/*
+ * Read the root DSE without attributes; any answer proves the
+ * connection is alive.
+ */
+
+static int be_ldap_probe(void *handle, void *conn)
+{
+	LDAPMessage *msg = NULL;
+	char *attrs[] = { LDAP_NO_ATTRS, NULL };
+	struct timeval tv = { 5, 0 };
+	int rc;
+
+	rc = ldap_search_ext_s((LDAP *)conn, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+		attrs, 0, NULL, NULL, &tv, 1, &msg);
+	if (msg != NULL)
+		ldap_msgfree(msg);
+	return (rc == LDAP_SUCCESS || rc == LDAP_NO_SUCH_OBJECT) ? 0 : 1;
+}
+
+static void be_ldap_close(void *handle, void *conn)
+{
+	ldap_unbind((LDAP *)conn);
+}
+
 void *be_ldap_init()
 {
 	struct ldap_backend *conf;
 	char *uri;
 	char *binddn, *bindpw;
 	char *opt_flag;
-	int rc, opt, len;
+	int len;
 
 	_log(LOG_DEBUG, "}}}} LDAP");
 
@@ -92,11 +271,22 @@ void *be_ldap_init()
 	conf->ldap_uri	= NULL;
 	conf->connstr	= NULL;
 	conf->lud	= NULL;
-	conf->ld	= NULL;
+	conf->sv	= NULL;
+	conf->bindsv	= NULL;
+	conf->binddn	= binddn;
+	conf->bindpw	= bindpw;
 	conf->user_uri	= NULL;
 	conf->superquery = NULL;
 	conf->aclquery	= NULL;
 	conf->acldeny = 0;
+	conf->dns	= NULL;
+	conf->dn_count	= 0;
+	pthread_mutex_init(&conf->dn_lock, NULL);
+
+	len = sv_opt("ldap", "timeout_ms", 5000);
+	conf->timeout.tv_sec = len / 1000;
+	conf->timeout.tv_usec = (len % 1000) * 1000;
+	conf->dn_cacheseconds = sv_opt("ldap", "dn_cacheseconds", 300);
 
 	conf->ldap_uri = strdup(uri);
 	if (ldap_url_parse(uri, &conf->lud) != 0) {
@@ -114,30 +304,52 @@ void *be_ldap_init()
 		return (NULL);
 	}
 	sprintf(conf->connstr, "%s://%s:%d", conf->lud->lud_scheme, conf->lud->lud_host, conf->lud->lud_port);
-	if (ldap_initialize(&conf->ld, conf->connstr) != LDAP_SUCCESS) {
-		ldap_free_urldesc(conf->lud);
-		free(conf->connstr);
-		free(conf->ldap_uri);
 
-		_fatal("Cannot ldap_initialize");
+	conf->sv = sv_new("ldap", conf, be_ldap_connect, be_ldap_probe, be_ldap_close);
+	if (conf->sv == NULL || !sv_healthy(conf->sv)) {
+		_fatal("Cannot bind to LDAP as %s", binddn ? binddn : "anonymous");
 		return (NULL);
 	}
 
-	opt = LDAP_VERSION3;
-	ldap_set_option(conf->ld, LDAP_OPT_PROTOCOL_VERSION, &opt);
+	/*
+	 * Users' passwords are checked by binding as them on a separate
+	 * pool of connections, so that the searching handles keep their
+	 * identity. A bind handle is connected (and bound as binddn) up
+	 * front, and simply re-bound for each authentication.
+	 */
 
-	if ((rc = ldap_simple_bind_s(conf->ld, binddn, bindpw)) != LDAP_SUCCESS) {
-		_fatal("Cannot bind to LDAP: %s", ldap_err2string(rc));
+	conf->bindsv = sv_new("ldap_bind", conf, be_ldap_connect, be_ldap_probe, be_ldap_close);
+	if (conf->bindsv == NULL) {
+		_fatal("Cannot start the LDAP bind pool");
 		return (NULL);
 	}
 
 	// conf->superquery	= p_stab("superquery");
 	// conf->aclquery		= p_stab("aclquery");
 
+	conf->superuser_group = p_stab("ldap_superuser_group");
+	conf->acl_attribute = p_stab("ldap_acl_attribute");
+	if ((conf->group_base = p_stab("ldap_group_base")) == NULL)
+		conf->group_base = conf->lud->lud_dn;
+	if ((conf->group_filter = p_stab("ldap_group_filter")) == NULL)
+		conf->group_filter = "(|(member=@)(uniqueMember=@))";
+	conf->authz_cacheseconds = sv_opt("ldap", "authz_cacheseconds", 300);
+	conf->authz = NULL;
+	conf->authz_count = 0;
+	conf->authz_epoch = 0;
+	pthread_mutex_init(&conf->authz_lock, NULL);
+
 	opt_flag = get_bool("ldap_acl_deny", "false");
 	if (!strcmp("true", opt_flag))
 		conf->acldeny = 1;
 
+	conf->replica = NULL;
+	opt_flag = get_bool("ldap_replica", "false");
+	if (!strcmp("true", opt_flag) && replica_new(conf) == NULL) {
+		_fatal("Cannot start the LDAP replica");
+		return (NULL);
+	}
+
 	return ((void *)conf);
 }
 
@@ -146,119 +358,1222 @@ void be_ldap_destroy(void *handle)
 	struct ldap_backend *conf = (struct ldap_backend *)handle;
 
 	if (conf) {
+		/* The replica thread connects with the settings below */
+		replica_destroy(conf->replica);
 		ldap_free_urldesc(conf->lud);
 		free(conf->ldap_uri);
 
 		if (conf->connstr)
 			free(conf->connstr);
-		if (conf->ld)
-			ldap_unbind(conf->ld);
+		struct dn_entry *e, *tmp;
+
+		sv_destroy(conf->bindsv);
+		sv_destroy(conf->sv);
+		HASH_ITER(hh, conf->dns, e, tmp) {
+			HASH_DEL(conf->dns, e);
+			free(e->username);
+			free(e->dn);
+			free(e);
+		}
+		pthread_mutex_destroy(&conf->dn_lock);
+		while (conf->authz) {
+			struct authz *a = conf->authz;
+
+			HASH_DEL(conf->authz, a);
+			authz_free(a);
+		}
+		pthread_mutex_destroy(&conf->authz_lock);
 		free(conf);
 	}
 }
 
 /*
- * Open a new connection to LDAP so that we don't lose the exising
- * binddn/pw. Check if the user's `dn' can bind with `password'.
- * Return T/F. `connstr' is a scheme://host:port thing.
+ * How long the next operation may wait, in `*tv': ldap_timeout_ms, or
+ * less if that is all check_deadline_ms leaves. Returns 1 if it was cut
+ * short, and -1 if there is no time left at all.
  */
 
-static int user_bind(char *connstr, char *dn, const char *password)
+static int op_timeout(struct ldap_backend *conf, struct timeval *tv)
+{
+	long own = conf->timeout.tv_sec * 1000 + conf->timeout.tv_usec / 1000;
+	long ms = backend_timeout(own);
+
+	*tv = conf->timeout;
+	if (ms < 0)
+		return (-1);
+	if (ms == 0 || ms == own)
+		return (0);
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = (ms % 1000) * 1000;
+	return (1);
+}
+
+/*
+ * Check if the user's `dn' can bind with `password', on a pooled
+ * connection. Returns BACKEND_ALLOW, BACKEND_DEFER if the credentials
+ * are wrong, or BACKEND_ERROR if the directory can't be asked. As in
+ * search(), running out of check_deadline_ms is LDAP_TIMELIMIT_EXCEEDED
+ * rather than a sign that the directory is down.
+ */
+
+static int user_bind(struct ldap_backend *conf, char *dn, const char *password)
 {
 	LDAP *ld;
-	int opt, rc;
+	struct timeval tv;
+	int rc, cut;
 
-	if (ldap_initialize(&ld, connstr) != LDAP_SUCCESS) {
-		_log(1, "Cannot ldap_initialize-2");
-		return (FALSE);
+	/* An empty password would be an unauthenticated bind, which succeeds */
+	if (password == NULL || *password == 0)
+		return (BACKEND_DEFER);
+
+	if ((cut = op_timeout(conf, &tv)) < 0 || (ld = sv_checkout(conf->bindsv)) == NULL)
+		return (BACKEND_ERROR);
+
+	if (cut)
+		ldap_set_option(ld, LDAP_OPT_TIMEOUT, &tv);
+	rc = ldap_simple_bind_s(ld, dn, password);
+	if (cut) {
+		ldap_set_option(ld, LDAP_OPT_TIMEOUT, &conf->timeout);
+		if (rc == LDAP_TIMEOUT)
+			rc = LDAP_TIMELIMIT_EXCEEDED;
+	}
+	if (rc == LDAP_SERVER_DOWN || rc == LDAP_TIMEOUT) {
+		_log(LOG_NOTICE, "Cannot bind to LDAP as %s: %s", dn, ldap_err2string(rc));
+		sv_checkin(conf->bindsv, ld, TRUE);
+		return (BACKEND_ERROR);
 	}
 
-	opt = LDAP_VERSION3;
-	ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &opt);
+	/*
+	 * A bind cut short is still outstanding and can't be abandoned; the
+	 * server may yet complete it, so the connection is not reused.
+	 */
+	if (rc == LDAP_TIMELIMIT_EXCEEDED) {
+		_log(1, "No time left to bind to LDAP as %s", dn);
+		sv_checkin(conf->bindsv, ld, TRUE);
+		return (BACKEND_ERROR);
+	}
 
-	if ((rc = ldap_simple_bind_s(ld, dn, password)) != LDAP_SUCCESS) {
+	/* A failed bind leaves the connection anonymous but usable */
+	sv_checkin(conf->bindsv, ld, FALSE);
+	if (rc != LDAP_SUCCESS) {
 		_log(1, "Cannot bind to LDAP as %s: %s", dn, ldap_err2string(rc));
-		return (FALSE);
+		return (BACKEND_DEFER);
 	}
+	return (BACKEND_ALLOW);
+}
+
+/* The cached DN of `username', to be freed by the caller, or NULL */
+static char *dn_get(struct ldap_backend *conf, const char *username)
+{
+	struct dn_entry *e;
+	char *dn = NULL;
 
-	ldap_unbind(ld);
-	return (TRUE);
+	if (conf->dn_cacheseconds <= 0)
+		return (NULL);
 
+	pthread_mutex_lock(&conf->dn_lock);
+	HASH_FIND_STR(conf->dns, username, e);
+	if (e && e->expires > time(NULL))
+		dn = strdup(e->dn);
+	pthread_mutex_unlock(&conf->dn_lock);
+	return (dn);
+}
+
+/* Remember the DN of `username', or forget it if `dn' is NULL */
+static void dn_put(struct ldap_backend *conf, const char *username, const char *dn)
+{
+	struct dn_entry *e, *tmp;
+	time_t now = time(NULL);
+
+	if (conf->dn_cacheseconds <= 0)
+		return;
+
+	pthread_mutex_lock(&conf->dn_lock);
+	HASH_FIND_STR(conf->dns, username, e);
+	if (e) {
+		HASH_DEL(conf->dns, e);
+		conf->dn_count--;
+		free(e->username);
+		free(e->dn);
+		free(e);
+	}
+	if (dn && conf->dn_count >= DN_CACHE_MAX) {
+		HASH_ITER(hh, conf->dns, e, tmp) {
+			if (e->expires <= now) {
+				HASH_DEL(conf->dns, e);
+				conf->dn_count--;
+				free(e->username);
+				free(e->dn);
+				free(e);
+			}
+		}
+	}
+	if (dn && conf->dn_count < DN_CACHE_MAX && (e = malloc(sizeof(struct dn_entry))) != NULL) {
+		e->username = strdup(username);
+		e->dn = strdup(dn);
+		e->expires = now + conf->dn_cacheseconds;
+		HASH_ADD_KEYPTR(hh, conf->dns, e->username, strlen(e->username), e);
+		conf->dn_count++;
+	}
+	pthread_mutex_unlock(&conf->dn_lock);
+}
+
+/*
+ * Copy `tmpl' replacing each '@' with `value', escaped as RFC 4515
+ * requires so that it can't widen the filter it is put into.
+ */
+
+static char *subst(const char *tmpl, const char *value)
+{
+	const char *bp, *up;
+	char *filter, *fp;
+	int n = 0;
+
+	for (bp = tmpl; bp && *bp; bp++)
+		n += (*bp == '@');
+	if ((filter = malloc(strlen(tmpl) + n * strlen(value) * 3 + 1)) == NULL)
+		return (NULL);
+
+	for (fp = filter, bp = tmpl; bp && *bp; bp++) {
+		if (*bp != '@') {
+			*fp++ = *bp;
+			continue;
+		}
+		for (up = value; *up; up++) {
+			if (*up == '*' || *up == '(' || *up == ')' || *up == '\\') {
+				fp += sprintf(fp, "\\%02x", (unsigned char)*up);
+			} else {
+				*fp++ = *up;
+			}
+		}
+	}
+	*fp = 0;
+	return (filter);
+}
+
+/*
+ * Run a search on `ld' and return the LDAP result code, with the entries
+ * in `*msg'. The search is sent asynchronously and its result awaited
+ * for at most ldap_timeout_ms; a directory which hangs is abandoned
+ * rather than holding the caller. When check_deadline_ms leaves less
+ * than that, running out of it is LDAP_TIMELIMIT_EXCEEDED, which unlike
+ * LDAP_TIMEOUT says nothing about the directory.
+ */
+
+static int search(struct ldap_backend *conf, LDAP *ld, const char *base, int scope, const char *filter, char **attrs, int sizelimit, LDAPMessage **msg)
+{
+	struct timeval tv;
+	int rc, msgid, cut, err = LDAP_SUCCESS;
+
+	*msg = NULL;
+	if ((cut = op_timeout(conf, &tv)) < 0)
+		return (LDAP_TIMELIMIT_EXCEEDED);
+	rc = ldap_search_ext(ld, base, scope, filter, attrs,
+		0, NULL, NULL, &tv, sizelimit, &msgid);
+	if (rc != LDAP_SUCCESS)
+		return (rc);
+
+	rc = ldap_result(ld, msgid, LDAP_MSG_ALL, &tv, msg);
+	if (rc == 0) {
+		ldap_abandon_ext(ld, msgid, NULL, NULL);
+		err = cut ? LDAP_TIMELIMIT_EXCEEDED : LDAP_TIMEOUT;
+	} else if (rc == -1) {
+		ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &err);
+	} else if (ldap_parse_result(ld, *msg, &err, NULL, NULL, NULL, NULL, 0) != LDAP_SUCCESS) {
+		err = LDAP_OTHER;
+	}
+	return (err);
+}
+
+static int is_down(int err)
+{
+	return (err == LDAP_SERVER_DOWN || err == LDAP_CONNECT_ERROR || err == LDAP_TIMEOUT);
+}
+
+/*
+ * Search for the entry of `username' with the filter of ldap_uri, which
+ * must find exactly one. Returns the LDAP result code; `*pentry' is NULL
+ * if there isn't exactly one entry. The caller frees `*msg'.
+ */
+
+static int find_user(struct ldap_backend *conf, LDAP *ld, const char *username, char **attrs, LDAPMessage **msg, LDAPMessage **pentry)
+{
+	char *filter;
+	int err;
+
+	*pentry = NULL;
+	*msg = NULL;
+	if ((filter = subst(conf->lud->lud_filter, username)) == NULL)
+		return (LDAP_NO_MEMORY);
+
+	/* A size limit of 2 is enough to tell "one" from "more than one" */
+	err = search(conf, ld, conf->lud->lud_dn, conf->lud->lud_scope, filter, attrs, 2, msg);
+	free(filter);
+
+	if (err == LDAP_SIZELIMIT_EXCEEDED)
+		err = LDAP_SUCCESS;
+	if (err == LDAP_SUCCESS) {
+		if (ldap_count_entries(ld, *msg) != 1)
+			_log(1, "LDAP search for %s returns != 1 entry", username);
+		else
+			*pentry = ldap_first_entry(ld, *msg);
+	} else {
+		_log(LOG_NOTICE, "Cannot search LDAP for user %s: %s", username, ldap_err2string(err));
+	}
+	return (err);
+}
+
+/* Search for the entry of `username' and return its DN in `*pdn' */
+static int find_dn(struct ldap_backend *conf, const char *username, char **pdn)
+{
+	LDAP *ld;
+	LDAPMessage *msg, *entry;
+	int err;
+
+	*pdn = NULL;
+	if ((ld = sv_checkout(conf->sv)) == NULL)
+		return (BACKEND_ERROR);
+
+	err = find_user(conf, ld, username, conf->lud->lud_attrs, &msg, &entry);
+	if (entry)
+		*pdn = ldap_get_dn(ld, entry);
+
+	if (msg)
+		ldap_msgfree(msg);
+	sv_checkin(conf->sv, ld, is_down(err));
+	return (err == LDAP_SUCCESS) ? BACKEND_DEFER : BACKEND_ERROR;
 }
 
 int be_ldap_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct ldap_backend *conf = (struct ldap_backend *)handle;
-	LDAPMessage *msg,*entry;
-	int rc, len;
-	char *filter, *bp, *fp, *up, *dn;
+	char *dn, *ldn;
+	int rc;
+
+	if (!conf || !username || !*username || !password || !*password)
+		return BACKEND_DEFER;
 
-	// printf("+++++++++++ GET %s USERNAME [%s] (%s)\n", conf->ldap_uri, username, password);
+	if (conf->replica && replica_dn(conf->replica, username, &dn)) {
+		if (dn == NULL)
+			return BACKEND_DEFER;
+		rc = user_bind(conf, dn, password);
+		free(dn);
+		return rc;
+	}
 
 	/*
-	 * Replace '@' in filter with `username'
+	 * A bind failure with a cached DN may mean the entry has moved, so
+	 * the DN is forgotten and the search done once more.
 	 */
 
-	len = strlen(conf->lud->lud_filter) + strlen(username) + 10;
-	filter = (char *)malloc(len);
+	if ((dn = dn_get(conf, username)) != NULL) {
+		_log(1, "Attempt to bind as cached %s\n", dn);
+		rc = user_bind(conf, dn, password);
+		free(dn);
+		if (rc != BACKEND_DEFER)
+			return rc;
+		dn_put(conf, username, NULL);
+	}
 
-	for (fp = filter, bp = conf->lud->lud_filter; bp && *bp;) {
-		if (*bp == '@') {
-			++bp;
-			for (up = (char *)username; up && *up; up++) {
-				*fp++ = *up;
+	if ((rc = find_dn(conf, username, &ldn)) != BACKEND_DEFER || ldn == NULL)
+		return rc;
+
+	_log(1, "Attempt to bind as %s\n", ldn);
+
+	if ((rc = user_bind(conf, ldn, password)) == BACKEND_ALLOW)
+		dn_put(conf, username, ldn);
+
+	ldap_memfree(ldn);
+	return rc;
+}
+
+static void authz_free(struct authz *a)
+{
+	int n;
+
+	for (n = 0; n < a->npatterns; n++)
+		free(a->patterns[n].pattern);
+	free(a->patterns);
+	free(a->username);
+	free(a);
+}
+
+static void authz_put(struct ldap_backend *conf, struct authz *a)
+{
+	int refs;
+
+	pthread_mutex_lock(&conf->authz_lock);
+	refs = --a->refs;
+	pthread_mutex_unlock(&conf->authz_lock);
+	if (refs == 0)
+		authz_free(a);
+}
+
+static char *bvstrdup(struct berval *bv)
+{
+	char *s;
+
+	if ((s = malloc(bv->bv_len + 1)) != NULL) {
+		memcpy(s, bv->bv_val, bv->bv_len);
+		s[bv->bv_len] = 0;
+	}
+	return (s);
+}
+
+/*
+ * Append the values of the ACL attribute of `entry' to `*patterns'. Each
+ * is a topic pattern, optionally preceded by an access mask and a blank.
+ */
+
+static void get_patterns(struct ldap_backend *conf, LDAP *ld, LDAPMessage *entry, struct backend_rule **patterns, int *npatterns)
+{
+	struct berval **vals;
+	struct backend_rule *ap;
+	const char *p;
+	char *v;
+	int n, count, mask;
+
+	if (!conf->acl_attribute || (vals = ldap_get_values_len(ld, entry, conf->acl_attribute)) == NULL)
+		return;
+
+	count = ldap_count_values_len(vals);
+	if ((ap = realloc(*patterns, (*npatterns + count) * sizeof(struct backend_rule))) != NULL) {
+		*patterns = ap;
+		for (n = 0; n < count; n++) {
+			if ((v = bvstrdup(vals[n])) == NULL)
+				continue;
+
+			if ((p = backend_rule_parse(v, strlen(v), &mask)) != v)
+				memmove(v, p, strlen(p) + 1);
+			ap[*npatterns].mask = mask;
+			ap[*npatterns].pattern = v;
+			(*npatterns)++;
+		}
+	}
+	ldap_value_free_len(vals);
+}
+
+static void add_patterns(struct ldap_backend *conf, LDAP *ld, LDAPMessage *entry, struct authz *a)
+{
+	get_patterns(conf, ld, entry, &a->patterns, &a->npatterns);
+}
+
+static char *lowercase(const char *s, size_t len)
+{
+	char *lc;
+	size_t n;
+
+	if ((lc = malloc(len + 1)) != NULL) {
+		for (n = 0; n < len; n++)
+			lc[n] = tolower((unsigned char)s[n]);
+		lc[len] = 0;
+	}
+	return (lc);
+}
+
+static void rentry_free(struct rentry *e)
+{
+	char **m;
+	int n;
+
+	for (m = e->members; m && *m; m++)
+		free(*m);
+	free(e->members);
+	for (n = 0; n < e->npatterns; n++)
+		free(e->patterns[n].pattern);
+	free(e->patterns);
+	free(e->username);
+	free(e->ldn);
+	free(e->dn);
+	free(e);
+}
+
+/* Index group `g' under each of its members; called with the replica write-locked */
+static void member_link(struct replica *r, struct rentry *g)
+{
+	struct rmember *rm;
+	struct rentry **gs;
+	char **m;
+
+	for (m = g->members; m && *m; m++) {
+		HASH_FIND(hh, r->members, *m, strlen(*m), rm);
+		if (rm == NULL) {
+			if ((rm = calloc(1, sizeof(struct rmember))) == NULL)
+				continue;
+			if ((rm->dn = strdup(*m)) == NULL) {
+				free(rm);
+				continue;
 			}
-		} else {
-			*fp++ = *bp++;
+			HASH_ADD_KEYPTR(hh, r->members, rm->dn, strlen(rm->dn), rm);
+		}
+		if ((gs = realloc(rm->groups, (rm->count + 1) * sizeof(struct rentry *))) != NULL) {
+			rm->groups = gs;
+			rm->groups[rm->count++] = g;
 		}
-		*fp = 0;
 	}
+}
 
-	rc = ldap_search_s(conf->ld,
-		conf->lud->lud_dn,
-		conf->lud->lud_scope,
-		filter,
-		conf->lud->lud_attrs,
-		0,
-		&msg);
-	if (rc != LDAP_SUCCESS) {
-		_fatal("Cannot search LDAP for user %s: %s", username, ldap_err2string(rc));
-		return BACKEND_ERROR;
+static void rmember_free(struct rmember *rm)
+{
+	free(rm->groups);
+	free(rm->dn);
+	free(rm);
+}
+
+/* Called with the replica write-locked */
+static void member_unlink(struct replica *r, struct rentry *g)
+{
+	struct rmember *rm;
+	char **m;
+	int n;
+
+	for (m = g->members; m && *m; m++) {
+		HASH_FIND(hh, r->members, *m, strlen(*m), rm);
+		if (rm == NULL)
+			continue;
+		for (n = 0; n < rm->count; ) {
+			if (rm->groups[n] == g)
+				rm->groups[n] = rm->groups[--rm->count];
+			else
+				n++;
+		}
+		if (rm->count == 0) {
+			HASH_DEL(r->members, rm);
+			rmember_free(rm);
+		}
 	}
+}
 
-	free(filter);
+/* The users reached from a changed entry */
+struct stale {
+	const char **users;
+	int count;
+	int size;
+	int overflow;		/* Too much to follow: drop every record */
+	struct rentry *seen[GROUPS_MAX];
+	int nseen;
+};
 
-	if (ldap_count_entries(conf->ld, msg) != 1) {
-		_log(1, "LDAP search for %s returns != 1 entry", username);
-		return BACKEND_DEFER;
+/* Follow `e' down through its members, as far as replica_authz() goes up */
+static void stale_walk(struct replica *r, struct rentry *e, int level, struct stale *st)
+{
+	struct rentry *child;
+	const char **users;
+	char **m;
+	int n;
+
+	if (e->username) {
+		if (st->count == st->size) {
+			if ((users = realloc(st->users, (st->size * 2 + 16) * sizeof(char *))) == NULL) {
+				st->overflow = TRUE;
+				return;
+			}
+			st->users = users;
+			st->size = st->size * 2 + 16;
+		}
+		st->users[st->count++] = e->username;
 	}
+	if (e->members == NULL || level >= NESTING_MAX)
+		return;
+	for (n = 0; n < st->nseen; n++) {
+		if (st->seen[n] == e)
+			return;
+	}
+	if (st->nseen == GROUPS_MAX) {
+		st->overflow = TRUE;
+		return;
+	}
+	st->seen[st->nseen++] = e;
+	for (m = e->members; *m && !st->overflow; m++) {
+		HASH_FIND(hd, r->dns, *m, strlen(*m), child);
+		if (child && child != e)
+			stale_walk(r, child, level + 1, st);
+	}
+}
+
+/* Called with authz_lock held */
+static void authz_drop(struct ldap_backend *conf, struct authz *a)
+{
+	HASH_DEL(conf->authz, a);
+	conf->authz_count--;
+	if (--a->refs == 0)
+		authz_free(a);
+}
 
-	rc = BACKEND_DEFER;
-	if ((entry = ldap_first_entry(conf->ld, msg)) != NULL) {
-		dn = ldap_get_dn(conf->ld, entry);
+/*
+ * Drop the cached records of the users whom a change to `e' may concern.
+ * Called with the replica write-locked, before `e' goes or after it has
+ * come; the epoch keeps a record built before the change from being
+ * cached after it.
+ */
 
-		_log(1, "Attempt to bind as %s\n", dn);
+static void replica_stale(struct ldap_backend *conf, struct rentry *e)
+{
+	struct stale st;
+	struct authz *a, *tmp;
+	int n;
 
-		if (user_bind(conf->connstr, dn, password)) {
-			rc = BACKEND_ALLOW;
+	memset(&st, 0, sizeof(st));
+	stale_walk(conf->replica, e, 0, &st);
+	if (st.count == 0 && !st.overflow)
+		return;
+
+	pthread_mutex_lock(&conf->authz_lock);
+	conf->authz_epoch++;
+	if (st.overflow) {
+		HASH_ITER(hh, conf->authz, a, tmp) {
+			authz_drop(conf, a);
+		}
+	} else {
+		for (n = 0; n < st.count; n++) {
+			HASH_FIND_STR(conf->authz, st.users[n], a);
+			if (a)
+				authz_drop(conf, a);
 		}
+	}
+	pthread_mutex_unlock(&conf->authz_lock);
+	free(st.users);
+}
+
+/* Called with the replica write-locked */
+static void rentry_remove(struct ldap_backend *conf, struct rentry *e)
+{
+	struct replica *r = conf->replica;
 
+	replica_stale(conf, e);
+	HASH_DELETE(hh, r->entries, e);
+	HASH_DELETE(hd, r->dns, e);
+	if (e->username)
+		HASH_DELETE(hu, r->users, e);
+	member_unlink(r, e);
+	rentry_free(e);
+}
+
+/* Called with the replica write-locked */
+static void rentry_add(struct ldap_backend *conf, struct rentry *e)
+{
+	struct replica *r = conf->replica;
+
+	HASH_ADD(hh, r->entries, uuid, sizeof(e->uuid), e);
+	HASH_ADD_KEYPTR(hd, r->dns, e->ldn, strlen(e->ldn), e);
+	if (e->username)
+		HASH_ADD_KEYPTR(hu, r->users, e->username, strlen(e->username), e);
+	member_link(r, e);
+	replica_stale(conf, e);
+}
+
+/* Copy what the replica needs of a sync'ed entry */
+static struct rentry *rentry_new(struct ldap_backend *conf, LDAP *ld, LDAPMessage *msg, struct berval *uuid)
+{
+	struct replica *r = conf->replica;
+	struct rentry *e;
+	struct berval **vals;
+	char *dn, **m;
+	int n, count, nm = 0;
+
+	if ((e = calloc(1, sizeof(struct rentry))) == NULL)
+		return (NULL);
+	memcpy(e->uuid, uuid->bv_val, sizeof(e->uuid));
+	e->present = TRUE;
+
+	if ((dn = ldap_get_dn(ld, msg)) == NULL || (e->dn = strdup(dn)) == NULL ||
+	    (e->ldn = lowercase(dn, strlen(dn))) == NULL) {
 		ldap_memfree(dn);
+		rentry_free(e);
+		return (NULL);
+	}
+	ldap_memfree(dn);
+
+	if ((vals = ldap_get_values_len(ld, msg, r->attrs[0])) != NULL) {
+		if (vals[0] != NULL)
+			e->username = lowercase(vals[0]->bv_val, vals[0]->bv_len);
+		ldap_value_free_len(vals);
+	}
+
+	for (n = 1; n <= r->nmembers; n++) {
+		if ((vals = ldap_get_values_len(ld, msg, r->attrs[n])) == NULL)
+			continue;
+		count = ldap_count_values_len(vals);
+		if ((m = realloc(e->members, (nm + count + 1) * sizeof(char *))) != NULL) {
+			e->members = m;
+			for (count = 0; vals[count]; count++) {
+				if ((m[nm] = lowercase(vals[count]->bv_val, vals[count]->bv_len)) != NULL)
+					nm++;
+			}
+			m[nm] = NULL;
+		}
+		ldap_value_free_len(vals);
+	}
+
+	get_patterns(conf, ld, msg, &e->patterns, &e->npatterns);
+	return (e);
+}
+
+static int replica_entry(ldap_sync_t *ls, LDAPMessage *msg, struct berval *uuid, ldap_sync_refresh_t phase)
+{
+	struct ldap_backend *conf = (struct ldap_backend *)ls->ls_private;
+	struct replica *r = conf->replica;
+	struct rentry *e = NULL, *old;
+
+	if (uuid == NULL || uuid->bv_len != sizeof(e->uuid))
+		return (LDAP_SUCCESS);
+	if (phase == LDAP_SYNC_CAPI_ADD || phase == LDAP_SYNC_CAPI_MODIFY) {
+		if ((e = rentry_new(conf, ls->ls_ld, msg, uuid)) == NULL)
+			return (LDAP_NO_MEMORY);
+	}
+
+	pthread_rwlock_wrlock(&r->lock);
+	HASH_FIND(hh, r->entries, uuid->bv_val, uuid->bv_len, old);
+	switch (phase) {
+		case LDAP_SYNC_CAPI_PRESENT:
+			if (old)
+				old->present = TRUE;
+			break;
+		case LDAP_SYNC_CAPI_DELETE:
+			if (old)
+				rentry_remove(conf, old);
+			break;
+		case LDAP_SYNC_CAPI_ADD:
+		case LDAP_SYNC_CAPI_MODIFY:
+			if (old)
+				rentry_remove(conf, old);
+			rentry_add(conf, e);
+			break;
+		default:
+			break;
+	}
+	pthread_rwlock_unlock(&r->lock);
+	return (LDAP_SUCCESS);
+}
+
+static int replica_reference(ldap_sync_t *ls, LDAPMessage *msg)
+{
+	return (LDAP_SUCCESS);
+}
+
+/*
+ * The directory lists entries in sets of entryUUIDs, and ends each phase
+ * of the refresh. After a present phase, entries it didn't mention have
+ * gone; so have those not sent again when the refresh started without a
+ * cookie.
+ */
+
+static int replica_intermediate(ldap_sync_t *ls, LDAPMessage *msg, BerVarray uuids, ldap_sync_refresh_t phase)
+{
+	struct ldap_backend *conf = (struct ldap_backend *)ls->ls_private;
+	struct replica *r = conf->replica;
+	struct rentry *e, *tmp;
+	int n;
+
+	pthread_rwlock_wrlock(&r->lock);
+	switch (phase) {
+		case LDAP_SYNC_CAPI_PRESENTS_IDSET:
+		case LDAP_SYNC_CAPI_DELETES_IDSET:
+			for (n = 0; uuids && uuids[n].bv_val; n++) {
+				HASH_FIND(hh, r->entries, uuids[n].bv_val, uuids[n].bv_len, e);
+				if (e == NULL)
+					continue;
+				if (phase == LDAP_SYNC_CAPI_PRESENTS_IDSET)
+					e->present = TRUE;
+				else
+					rentry_remove(conf, e);
+			}
+			break;
+		case LDAP_SYNC_CAPI_PRESENTS:
+		case LDAP_SYNC_CAPI_DELETES:
+			if (phase == LDAP_SYNC_CAPI_PRESENTS || r->sweep) {
+				HASH_ITER(hh, r->entries, e, tmp) {
+					if (!e->present)
+						rentry_remove(conf, e);
+				}
+			}
+			if (!r->ready)
+				_log(LOG_NOTICE, "LDAP replica holds %u entries", HASH_COUNT(r->entries));
+			r->ready = TRUE;
+			break;
+		default:
+			break;
+	}
+	pthread_rwlock_unlock(&r->lock);
+	return (LDAP_SUCCESS);
+}
+
+static int replica_result(ldap_sync_t *ls, LDAPMessage *msg, int refreshDeletes)
+{
+	return (LDAP_SUCCESS);
+}
+
+static int replica_running(struct replica *r)
+{
+	int running;
+
+	pthread_mutex_lock(&r->mutex);
+	running = r->running;
+	pthread_mutex_unlock(&r->mutex);
+	return (running);
+}
+
+/*
+ * Connect, refresh the replica and follow changes until the connection
+ * fails or the backend is destroyed. The search polls for one second at
+ * a time so that the latter is noticed.
+ */
+
+static void replica_session(struct ldap_backend *conf)
+{
+	struct replica *r = conf->replica;
+	struct rentry *e, *tmp;
+	ldap_sync_t ls;
+	int rc, n, idle = 60, probes = 3, interval = 10;
+
+	ldap_sync_initialize(&ls);
+	if ((ls.ls_ld = be_ldap_connect(conf)) == NULL)
+		return;
+
+	/* A peer which vanishes without a reset would stall the search forever */
+	ldap_set_option(ls.ls_ld, LDAP_OPT_X_KEEPALIVE_IDLE, &idle);
+	ldap_set_option(ls.ls_ld, LDAP_OPT_X_KEEPALIVE_PROBES, &probes);
+	ldap_set_option(ls.ls_ld, LDAP_OPT_X_KEEPALIVE_INTERVAL, &interval);
+
+	/* ldap_sync_destroy() frees these */
+	ls.ls_base = strdup(r->base);
+	ls.ls_scope = LDAP_SCOPE_SUBTREE;
+	ls.ls_filter = strdup(r->filter);
+	for (n = 0; r->attrs[n]; n++)
+		;
+	if ((ls.ls_attrs = calloc(n + 1, sizeof(char *))) != NULL) {
+		for (n = 0; r->attrs[n]; n++)
+			ls.ls_attrs[n] = strdup(r->attrs[n]);
+	}
+	ls.ls_timeout = 1;
+	ls.ls_search_entry = replica_entry;
+	ls.ls_search_reference = replica_reference;
+	ls.ls_intermediate = replica_intermediate;
+	ls.ls_search_result = replica_result;
+	ls.ls_private = conf;
+	if (r->cookie.bv_val)
+		ber_dupbv(&ls.ls_cookie, &r->cookie);
+
+	pthread_rwlock_wrlock(&r->lock);
+	HASH_ITER(hh, r->entries, e, tmp) {
+		e->present = FALSE;
+	}
+	r->sweep = (r->cookie.bv_val == NULL);
+	pthread_rwlock_unlock(&r->lock);
+
+	rc = ldap_sync_init(&ls, LDAP_SYNC_REFRESH_AND_PERSIST);
+	while (rc == LDAP_SUCCESS && replica_running(r))
+		rc = ldap_sync_poll(&ls);
+
+	if (rc != LDAP_SUCCESS)
+		_log(LOG_NOTICE, "LDAP replica: %s", ldap_err2string(rc));
+
+	/* The directory can't resume from the cookie: start afresh next time */
+	if (rc == LDAP_SYNC_REFRESH_REQUIRED || ls.ls_cookie.bv_val) {
+		ber_memfree(r->cookie.bv_val);
+		r->cookie.bv_val = NULL;
+		r->cookie.bv_len = 0;
+		if (rc != LDAP_SYNC_REFRESH_REQUIRED)
+			ber_dupbv(&r->cookie, &ls.ls_cookie);
+	}
+	ldap_sync_destroy(&ls, 0);
+}
+
+static void *replica_thread(void *arg)
+{
+	struct ldap_backend *conf = (struct ldap_backend *)arg;
+	struct replica *r = conf->replica;
+	struct timespec ts;
+	time_t started;
+	int backoff = 1;
+
+	pthread_mutex_lock(&r->mutex);
+	while (r->running) {
+		pthread_mutex_unlock(&r->mutex);
+		started = time(NULL);
+		replica_session(conf);
+
+		/* Retry at once after a long session, backing off up to a minute */
+		backoff = (time(NULL) - started > 60) ? 1 : (backoff < 32) ? backoff * 2 : 60;
+		pthread_mutex_lock(&r->mutex);
+		if (r->running) {
+			ts.tv_sec = time(NULL) + backoff;
+			ts.tv_nsec = 0;
+			pthread_cond_timedwait(&r->cond, &r->mutex, &ts);
+		}
+	}
+	pthread_mutex_unlock(&r->mutex);
+	return (NULL);
+}
+
+/* Start the replica thread and set conf->replica, or return NULL */
+static struct replica *replica_new(struct ldap_backend *conf)
+{
+	struct replica *r;
+	char *opt, *copy, *tok, *sp;
+	int n = 0, max;
+
+	if ((r = calloc(1, sizeof(struct replica))) == NULL)
+		return (NULL);
+
+	if ((opt = p_stab("ldap_replica_base")) == NULL)
+		opt = conf->lud->lud_dn;
+	r->base = strdup(opt ? opt : "");
+	if ((opt = p_stab("ldap_replica_filter")) == NULL)
+		opt = "(objectClass=*)";
+	r->filter = strdup(opt);
+
+	if ((opt = p_stab("ldap_replica_member_attributes")) == NULL)
+		opt = "member,uniqueMember";
+	max = strlen(opt) / 2 + 4;
+	r->attrs = calloc(max, sizeof(char *));
+	copy = strdup(opt);
+	if ((opt = p_stab("ldap_replica_user_attribute")) == NULL)
+		opt = "uid";
+	r->attrs[n++] = strdup(opt);
+	for (tok = strtok_r(copy, " ,", &sp); tok; tok = strtok_r(NULL, " ,", &sp))
+		r->attrs[n++] = strdup(tok);
+	r->nmembers = n - 1;
+	if (conf->acl_attribute)
+		r->attrs[n++] = strdup(conf->acl_attribute);
+	free(copy);
+
+	r->running = TRUE;
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	pthread_rwlock_init(&r->lock, NULL);
+
+	/* The thread finds the replica through the backend */
+	conf->replica = r;
+	if (pthread_create(&r->thread, NULL, replica_thread, conf) != 0) {
+		_log(LOG_NOTICE, "Cannot start the LDAP replica thread");
+		conf->replica = NULL;
+		r->running = FALSE;
+		replica_destroy(r);
+		return (NULL);
+	}
+	return (r);
+}
+
+static void replica_destroy(struct replica *r)
+{
+	struct rentry *e, *tmp;
+	struct rmember *rm, *rtmp;
+	int n;
+
+	if (r == NULL)
+		return;
+
+	pthread_mutex_lock(&r->mutex);
+	if (r->running) {
+		r->running = FALSE;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->mutex);
+		pthread_join(r->thread, NULL);
+	} else {
+		pthread_mutex_unlock(&r->mutex);
+	}
+
+	HASH_CLEAR(hu, r->users);
+	HASH_CLEAR(hd, r->dns);
+	HASH_ITER(hh, r->members, rm, rtmp) {
+		HASH_DEL(r->members, rm);
+		rmember_free(rm);
+	}
+	HASH_ITER(hh, r->entries, e, tmp) {
+		HASH_DELETE(hh, r->entries, e);
+		rentry_free(e);
+	}
+	ber_memfree(r->cookie.bv_val);
+	for (n = 0; r->attrs && r->attrs[n]; n++)
+		free(r->attrs[n]);
+	free(r->attrs);
+	free(r->base);
+	free(r->filter);
+	pthread_mutex_destroy(&r->mutex);
+	pthread_cond_destroy(&r->cond);
+	pthread_rwlock_destroy(&r->lock);
+	free(r);
+}
+
+/*
+ * Look `username' up in the replica. Returns FALSE if the replica isn't
+ * ready yet; otherwise `*pdn' is its DN, or NULL if there is no such
+ * user, to be freed by the caller.
+ */
+
+static int replica_dn(struct replica *r, const char *username, char **pdn)
+{
+	struct rentry *u;
+	char *key;
+	int ready;
+
+	*pdn = NULL;
+	if ((key = lowercase(username, strlen(username))) == NULL)
+		return (FALSE);
+
+	pthread_rwlock_rdlock(&r->lock);
+	if ((ready = r->ready) != 0) {
+		HASH_FIND(hu, r->users, key, strlen(key), u);
+		if (u)
+			*pdn = strdup(u->dn);
+	}
+	pthread_rwlock_unlock(&r->lock);
+	free(key);
+	return (ready);
+}
+
+static void copy_patterns(struct authz *a, struct rentry *e)
+{
+	struct backend_rule *ap;
+	int n;
+
+	if (e->npatterns == 0)
+		return;
+	if ((ap = realloc(a->patterns, (a->npatterns + e->npatterns) * sizeof(struct backend_rule))) == NULL)
+		return;
+	a->patterns = ap;
+	for (n = 0; n < e->npatterns; n++) {
+		if ((ap[a->npatterns].pattern = strdup(e->patterns[n].pattern)) != NULL)
+			ap[a->npatterns++].mask = e->patterns[n].mask;
 	}
-	
-	return rc;
 }
 
 /*
- * Return T/F if user is superuser
+ * Build the record of `username' from the replica, resolving nested
+ * groups the way authz_fetch() does, through the member index. Returns
+ * NULL if the replica isn't ready yet.
+ */
+
+static struct authz *replica_authz(struct ldap_backend *conf, const char *username)
+{
+	struct replica *r = conf->replica;
+	struct rentry *u, *g;
+	struct rmember *rm;
+	struct authz *a;
+	const char *groups[GROUPS_MAX];
+	int ngroups = 0, level, from, to, n, k, i;
+
+	if ((a = calloc(1, sizeof(struct authz))) == NULL)
+		return (NULL);
+	if ((a->username = lowercase(username, strlen(username))) == NULL) {
+		free(a);
+		return (NULL);
+	}
+
+	pthread_rwlock_rdlock(&r->lock);
+	if (!r->ready) {
+		pthread_rwlock_unlock(&r->lock);
+		authz_free(a);
+		return (NULL);
+	}
+
+	HASH_FIND(hu, r->users, a->username, strlen(a->username), u);
+	if (u) {
+		copy_patterns(a, u);
+		groups[ngroups++] = u->ldn;
+	}
+
+	/* groups[from..to) were found on the previous level */
+	for (level = 0, from = 0, to = ngroups; from < to && level < NESTING_MAX; level++) {
+		for (n = from; n < to; n++) {
+			HASH_FIND(hh, r->members, groups[n], strlen(groups[n]), rm);
+			for (k = 0; rm && k < rm->count && ngroups < GROUPS_MAX; k++) {
+				g = rm->groups[k];
+				for (i = 0; i < ngroups && strcmp(groups[i], g->ldn) != 0; i++)
+					;
+				if (i < ngroups)
+					continue;
+				groups[ngroups++] = g->ldn;
+				copy_patterns(a, g);
+				if (conf->superuser_group && strcasecmp(g->dn, conf->superuser_group) == 0)
+					a->superuser = TRUE;
+			}
+		}
+		from = to;
+		to = ngroups;
+	}
+	pthread_rwlock_unlock(&r->lock);
+	return (a);
+}
+
+/*
+ * Fetch the record of `username': its own entry, then the groups which
+ * have it as a member, then the groups which have those as members, and
+ * so on. Each level is one search for all the DNs found on the previous
+ * one. Returns NULL if the directory can't be asked.
+ */
+
+static struct authz *authz_fetch(struct ldap_backend *conf, const char *username)
+{
+	LDAP *ld;
+	LDAPMessage *msg, *entry;
+	struct authz *a;
+	char *attrs[] = { conf->acl_attribute ? conf->acl_attribute : LDAP_NO_ATTRS, NULL };
+	char *groups[GROUPS_MAX], *parts[GROUPS_MAX], *dn, *filter;
+	int err, ngroups = 0, level, from, to, n, k;
+	size_t len;
+
+	if ((a = calloc(1, sizeof(struct authz))) == NULL)
+		return (NULL);
+	if ((a->username = lowercase(username, strlen(username))) == NULL) {
+		free(a);
+		return (NULL);
+	}
+
+	if ((ld = sv_checkout(conf->sv)) == NULL) {
+		authz_free(a);
+		return (NULL);
+	}
+
+	err = find_user(conf, ld, username, attrs, &msg, &entry);
+	if (err == LDAP_SUCCESS && entry) {
+		add_patterns(conf, ld, entry, a);
+		if ((dn = ldap_get_dn(ld, entry)) != NULL) {
+			groups[ngroups++] = strdup(dn);
+			ldap_memfree(dn);
+		}
+	}
+	if (msg)
+		ldap_msgfree(msg);
+
+	/* groups[from..to) were found on the previous level; groups[0] is the user */
+	for (level = 0, from = 0, to = ngroups; err == LDAP_SUCCESS && from < to && level < NESTING_MAX; level++) {
+		/* Sized from the substituted filters; each may hold the DN many times */
+		for (len = 4, n = from; n < to; n++) {
+			if ((parts[n] = subst(conf->group_filter, groups[n])) != NULL)
+				len += strlen(parts[n]);
+		}
+		if ((filter = malloc(len)) != NULL) {
+			strcpy(filter, "(|");
+			for (n = from; n < to; n++) {
+				if (parts[n])
+					strcat(filter, parts[n]);
+			}
+			strcat(filter, ")");
+		}
+		for (n = from; n < to; n++)
+			free(parts[n]);
+		if (filter == NULL)
+			break;
+
+		err = search(conf, ld, conf->group_base, LDAP_SCOPE_SUBTREE, filter, attrs, LDAP_NO_LIMIT, &msg);
+		free(filter);
+		if (err != LDAP_SUCCESS) {
+			_log(LOG_NOTICE, "Cannot search LDAP for groups of %s: %s", username, ldap_err2string(err));
+			if (msg)
+				ldap_msgfree(msg);
+			break;
+		}
+
+		from = to;
+		for (entry = ldap_first_entry(ld, msg); entry; entry = ldap_next_entry(ld, entry)) {
+			if ((dn = ldap_get_dn(ld, entry)) == NULL)
+				continue;
+			for (k = 0; k < ngroups && strcasecmp(groups[k], dn) != 0; k++)
+				;
+			if (k == ngroups && ngroups < GROUPS_MAX) {
+				groups[ngroups++] = strdup(dn);
+				add_patterns(conf, ld, entry, a);
+				if (conf->superuser_group && strcasecmp(dn, conf->superuser_group) == 0)
+					a->superuser = TRUE;
+			}
+			ldap_memfree(dn);
+		}
+		to = ngroups;
+		ldap_msgfree(msg);
+	}
+	sv_checkin(conf->sv, ld, is_down(err));
+
+	for (n = 0; n < ngroups; n++)
+		free(groups[n]);
+	if (err != LDAP_SUCCESS) {
+		authz_free(a);
+		return (NULL);
+	}
+	return (a);
+}
+
+/*
+ * The record of `username' with a reference held, from the cache, the
+ * replica, or fetched from the directory. NULL if the directory can't be asked.
+ */
+
+static struct authz *authz_get(struct ldap_backend *conf, const char *username)
+{
+	struct authz *a, *old, *tmp;
+	time_t now = time(NULL);
+	unsigned long epoch;
+	char *key;
+
+	/* Records are kept by lower-cased name, the way the replica drops them */
+	if ((key = lowercase(username, strlen(username))) == NULL)
+		return (NULL);
+	pthread_mutex_lock(&conf->authz_lock);
+	HASH_FIND_STR(conf->authz, key, a);
+	if (a && a->expires > now) {
+		a->refs++;
+		pthread_mutex_unlock(&conf->authz_lock);
+		free(key);
+		return (a);
+	}
+	epoch = conf->authz_epoch;
+	pthread_mutex_unlock(&conf->authz_lock);
+	free(key);
+
+	if (conf->replica == NULL || (a = replica_authz(conf, username)) == NULL)
+		a = authz_fetch(conf, username);
+	if (a == NULL)
+		return (NULL);
+	a->refs = 1;
+	a->expires = now + conf->authz_cacheseconds;
+	if (conf->authz_cacheseconds <= 0)
+		return (a);
+
+	/* The replica changed while this was built: use it, but don't keep it */
+	pthread_mutex_lock(&conf->authz_lock);
+	if (conf->authz_epoch != epoch) {
+		pthread_mutex_unlock(&conf->authz_lock);
+		return (a);
+	}
+	HASH_FIND_STR(conf->authz, a->username, old);
+	if (old)
+		authz_drop(conf, old);
+	if (conf->authz_count >= DN_CACHE_MAX) {
+		HASH_ITER(hh, conf->authz, old, tmp) {
+			if (old->expires <= now)
+				authz_drop(conf, old);
+		}
+	}
+	if (conf->authz_count < DN_CACHE_MAX) {
+		a->refs++;
+		HASH_ADD_KEYPTR(hh, conf->authz, a->username, strlen(a->username), a);
+		conf->authz_count++;
+	}
+	pthread_mutex_unlock(&conf->authz_lock);
+	return (a);
+}
+
+/*
+ * A user is a superuser if it is a member of ldap_superuser_group,
+ * directly or through nested groups.
  */
 
 int be_ldap_superuser(void *handle, const char *username)
 {
 	struct ldap_backend *conf = (struct ldap_backend *)handle;
-	printf("%s\n", conf->ldap_uri);
+	struct authz *a;
+	int issuper;
+
+	if (!conf || !conf->superuser_group || !username)
+		return BACKEND_DEFER;
+
+	if ((a = authz_get(conf, username)) == NULL)
+		return BACKEND_ERROR;
+	issuper = (a->superuser) ? BACKEND_ALLOW : BACKEND_DEFER;
+	authz_put(conf, a);
 
-	return BACKEND_DEFER;
+	return issuper;
 }
 
 /*
@@ -271,14 +1586,32 @@ int be_ldap_superuser(void *handle, const char *username)
  *	for subscriptions (READ) (1)
  *	for publish (WRITE) (2)
  *
- * SELECT topic FROM table WHERE username = '%s' AND (acc & %d)		// may user SUB or PUB topic?
- * SELECT topic FROM table WHERE username = '%s'              		// ignore ACC
+ * Without ldap_acl_attribute, every topic is allowed, or denied with
+ * ldap_acl_deny. With it, the topic must match one of the user's
+ * patterns with a mask granting `acc'.
  */
 
 int be_ldap_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct ldap_backend *conf = (struct ldap_backend *)handle;
+	struct authz *a;
+	int match;
+
+	if (!conf)
+		return BACKEND_DEFER;
+	if (!conf->acl_attribute)
+		return (conf->acldeny ? BACKEND_DENY : BACKEND_ALLOW);
+	if (!username || !topic)
+		return BACKEND_DEFER;
+
+	if ((a = authz_get(conf, username)) == NULL)
+		return BACKEND_ERROR;
+
+	match = backend_rules_aclcheck("ldap", a->patterns, a->npatterns, clientid, username, topic, acc);
+	authz_put(conf, a);
 
-	return (conf->acldeny ? BACKEND_DENY : BACKEND_ALLOW);
+	if (match == BACKEND_DEFER && conf->acldeny)
+		match = BACKEND_DENY;
+	return match;
 }
 #endif /* BE_LDAP */
@@ -35,55 +35,139 @@
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
+#include "supervisor.h"
 #include <libmemcached/memcached.h>
 
 struct memcached_backend {
-	memcached_st *memcached;
-	char *host;
+	struct supervisor *sv;	/* Owns the clones of proto */
+	memcached_st *proto;	/* Configured client, only ever cloned */
+	char *servers;
 	char *userquery;
 	char *aclquery;
+	char *superquery;
 	char *dbpass;
-	int port;
+	int nservers;
 	int db;
 };
 
+/*
+ * Misses and keys memcached won't take are answers, not errors. Other
+ * failures break the client, unless it has more servers to turn to:
+ * then the client ejects the failed server and rehashes by itself.
+ */
 
-static int be_memcached_reconnect(struct memcached_backend *conf)
+static int mc_broken(struct memcached_backend *conf, memcached_return rc)
 {
-	if (conf->memcached != NULL) {
-		memcached_free(conf->memcached);
-		conf->memcached = NULL;
+	switch (rc) {
+		case MEMCACHED_SUCCESS:
+		case MEMCACHED_NOTFOUND:
+		case MEMCACHED_END:
+		case MEMCACHED_BAD_KEY_PROVIDED:
+		case MEMCACHED_NO_KEY_PROVIDED:
+			return FALSE;
+		default:
+			return conf->nservers == 1;
 	}
-	conf->memcached = memcached_create(NULL);
+}
 
-	memcached_return memcachedReply;
-	memcached_server_st *servers;
+/*
+ * Build a key from `tmpl' by replacing its first %s with `name', or by
+ * appending `name' if it has none. Returns NULL if the key is too long
+ * for memcached.
+ */
 
-	servers = memcached_server_list_append(NULL, conf->host, conf->port, &memcachedReply);
-	memcachedReply = memcached_server_push(conf->memcached, servers);
-	memcached_server_list_free(servers);
+static char *mc_key(const char *tmpl, const char *name, size_t *len)
+{
+	const char *s = strstr(tmpl, "%s");
+	size_t pre = (s) ? (size_t)(s - tmpl) : strlen(tmpl);
+	size_t post = (s) ? strlen(s + 2) : 0;
+	char *key;
 
-	//error message in memcached_st is called memcached_error_t but it is weird
-	if (conf->memcached == NULL) {
-		_log(LOG_NOTICE, "Memcached connection error for %s:%d\n",
-		     conf->host, conf->port);
-		return 1;
-	}
-	//there is no database password in memcached
+	*len = pre + strlen(name) + post;
+	if (*len >= MEMCACHED_MAX_KEY)
+		return (NULL);
+	if ((key = malloc(*len + 1)) == NULL)
+		return (NULL);
+	memcpy(key, tmpl, pre);
+	strcpy(key + pre, name);
+	if (s)
+		strcat(key, s + 2);
+	return (key);
+}
+
+/* The integer a result holds; memcached values are not NUL-terminated */
+static int mc_int(const memcached_result_st *res)
+{
+	char buf[32];
+	size_t len = memcached_result_length(res);
 
-		// check memcachced connection
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	memcpy(buf, memcached_result_value(res), len);
+	buf[len] = 0;
+	return atoi(buf);
+}
+
+static int be_memcached_probe(void *handle, void *conn)
+{
 	memcached_return rc;
-	memcached_stat_st *stats = memcached_stat(conf->memcached, NULL, &rc);
+	memcached_stat_st *stats = memcached_stat((memcached_st *)conn, NULL, &rc);
+
 	if (stats == NULL && rc != MEMCACHED_SUCCESS && rc != MEMCACHED_SOME_ERRORS) {
-		return 2;
+		return 1;
 	}
+	if (stats != NULL)
+		memcached_stat_free((memcached_st *)conn, stats);
 	return 0;
 }
 
+static void *be_memcached_connect(void *handle)
+{
+	struct memcached_backend *conf = (struct memcached_backend *)handle;
+	memcached_st *memcached;
+
+	/* The clone carries the server list and the behaviors set in init */
+	memcached = memcached_clone(NULL, conf->proto);
+
+	//error message in memcached_st is called memcached_error_t but it is weird
+	if (memcached == NULL) {
+		_log(LOG_NOTICE, "Memcached connection error for %s\n",
+		     conf->servers);
+		return (NULL);
+	}
+
+	//there is no database password in memcached
+
+	// check memcachced connection
+	if (be_memcached_probe(conf, memcached) != 0) {
+		memcached_free(memcached);
+		return (NULL);
+	}
+	return (memcached);
+}
+
+static void be_memcached_close(void *handle, void *conn)
+{
+	memcached_free((memcached_st *)conn);
+}
+
+static void be_memcached_free(struct memcached_backend *conf)
+{
+	if (conf->proto)
+		memcached_free(conf->proto);
+	free(conf->servers);
+	free(conf->userquery);
+	free(conf->dbpass);
+	free(conf->aclquery);
+	free(conf->superquery);
+	free(conf);
+}
+
 void *be_memcached_init()
 {
 	struct memcached_backend *conf;
-	char *host, *p, *db, *userquery, *password, *aclquery;
+	char *host, *p, *db, *userquery, *password, *aclquery, *superquery, *servers;
+	memcached_server_st *list;
 
 	_log(LOG_DEBUG, "}}}} Memcached");
 
@@ -101,25 +185,58 @@ void *be_memcached_init()
 	if ((aclquery = p_stab("memcached_aclquery")) == NULL) {
 		aclquery = "";
 	}
-	conf = (struct memcached_backend *)malloc(sizeof(struct memcached_backend));
+	if ((superquery = p_stab("memcached_superquery")) == NULL) {
+		superquery = "";
+	}
+	conf = (struct memcached_backend *)calloc(1, sizeof(struct memcached_backend));
 	if (conf == NULL)
 		_fatal("Out of memory");
 
-	conf->host = strdup(host);
-	conf->port = atoi(p);
+	if ((servers = p_stab("memcached_servers")) != NULL) {
+		conf->servers = strdup(servers);
+	} else {
+		conf->servers = malloc(strlen(host) + strlen(p) + 2);
+		sprintf(conf->servers, "%s:%s", host, p);
+	}
 	conf->db = atoi(db);
 	conf->dbpass = strdup(password);
 	conf->userquery = strdup(userquery);
 	conf->aclquery = strdup(aclquery);
+	conf->superquery = strdup(superquery);
 
-	conf->memcached = NULL;
+	/*
+	 * Every pooled client is cloned from this one. Keys are spread over
+	 * the servers on a ketama ring, honouring host:port:weight, and a
+	 * server which keeps failing is taken off the ring for a while.
+	 */
 
-	if (be_memcached_reconnect(conf)) {
-		free(conf->host);
-		free(conf->userquery);
-		free(conf->dbpass);
-		free(conf->aclquery);
-		free(conf);
+	if ((list = memcached_servers_parse(conf->servers)) == NULL ||
+	    (conf->proto = memcached_create(NULL)) == NULL) {
+		_log(LOG_NOTICE, "Memcached: cannot use servers %s", conf->servers);
+		memcached_server_list_free(list);
+		be_memcached_free(conf);
+		return (NULL);
+	}
+	memcached_server_push(conf->proto, list);
+	memcached_server_list_free(list);
+	conf->nservers = memcached_server_count(conf->proto);
+
+	memcached_behavior_set(conf->proto, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+	memcached_behavior_set(conf->proto, MEMCACHED_BEHAVIOR_TCP_NODELAY, 1);
+	memcached_behavior_set(conf->proto, MEMCACHED_BEHAVIOR_KETAMA_WEIGHTED, 1);
+	if (conf->nservers > 1) {
+		memcached_behavior_set(conf->proto, MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT, 2);
+		memcached_behavior_set(conf->proto, MEMCACHED_BEHAVIOR_REMOVE_FAILED_SERVERS, 1);
+		memcached_behavior_set(conf->proto, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT, 30);
+	}
+	if (backend_deadline_ms() > 0)
+		memcached_behavior_set(conf->proto, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, backend_deadline_ms());
+
+	conf->sv = sv_new("memcached", conf, be_memcached_connect, be_memcached_probe, be_memcached_close);
+
+	if (conf->sv == NULL || !sv_healthy(conf->sv)) {
+		sv_destroy(conf->sv);
+		be_memcached_free(conf);
 		return (NULL);
 	}
 	return (conf);
@@ -130,73 +247,122 @@ void be_memcached_destroy(void *handle)
 	struct memcached_backend *conf = (struct memcached_backend *)handle;
 
 	if (conf != NULL) {
-		memcached_free(conf->memcached);
-		conf->memcached = NULL;
-		free(conf);
+		sv_destroy(conf->sv);
+		conf->sv = NULL;
+		be_memcached_free(conf);
 	}
 }
 
 int be_memcached_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct memcached_backend *conf = (struct memcached_backend *)handle;
-
+	memcached_st *memcached;
 	memcached_return rc;
 	size_t value_length;
 	uint32_t flags;
 	char *value = NULL;
 
-	if (conf == NULL || conf->memcached == NULL || username == NULL)
+	if (conf == NULL || username == NULL)
 		return (BACKEND_ERROR);
 
-	value = memcached_get(conf->memcached, username, strlen(username), &value_length, &flags, &rc);
+	if ((memcached = sv_checkout(conf->sv)) == NULL)
+		return (BACKEND_ERROR);
+
+	value = memcached_get(memcached, username, strlen(username), &value_length, &flags, &rc);
 
 	if (value == NULL || rc != MEMCACHED_SUCCESS) {
-		be_memcached_reconnect(conf);
-		return (BACKEND_DEFER);
-	}
-	if (rc == MEMCACHED_SUCCESS) {
-		*phash = strdup(value);
+		/* A NOTFOUND is an ordinary miss, not a broken connection */
+		sv_checkin(conf->sv, memcached, mc_broken(conf, rc));
+		return (rc == MEMCACHED_NOTFOUND) ? BACKEND_DEFER : BACKEND_ERROR;
 	}
+	sv_checkin(conf->sv, memcached, FALSE);
+
+	*phash = strdup(value);
+	free(value);
 	return (BACKEND_DEFER);
 }
 
+/*
+ * The superuser key is fetched along with the ACL key in
+ * be_memcached_aclcheck(), so that a miss costs one round trip.
+ */
+
 int be_memcached_superuser(void *conf, const char *username)
 {
-	return 0;
+	return BACKEND_DEFER;
 }
 
 int be_memcached_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct memcached_backend *conf = (struct memcached_backend *)handle;
-
+	memcached_st *memcached;
+	memcached_result_st *res;
 	memcached_return rc;
-	size_t value_length;
-	uint32_t flags;
-	char *value = NULL;
+	const char *keys[2];
+	size_t lens[2];
+	char *aclkey, *superkey = NULL;
+	int nkeys = 1, super = 0, level = 0, answer = BACKEND_DEFER;
 
-	if (conf == NULL || conf->memcached == NULL || username == NULL)
-		return 0;
+	if (conf == NULL || username == NULL)
+		return BACKEND_DEFER;
 
 	if (strlen(conf->aclquery) == 0) {
-		return 1;
+		return BACKEND_ALLOW;
 	}
-	char *query = malloc(strlen(conf->aclquery) + strlen(username) + strlen(topic) + 128);
-	sprintf(query, "%s-%s", username, topic);
-	value = memcached_get(conf->memcached, query, strlen(query), &value_length, &flags, &rc);
 
-	if (value == NULL || rc != MEMCACHED_SUCCESS) {
-		be_memcached_reconnect(conf);
+	/* Keys are <username>-<topic> and, optionally, from memcached_superquery */
+	if ((aclkey = malloc(strlen(username) + strlen(topic) + 2)) == NULL)
 		return BACKEND_ERROR;
+	sprintf(aclkey, "%s-%s", username, topic);
+	keys[0] = aclkey;
+	lens[0] = strlen(aclkey);
+	if (lens[0] >= MEMCACHED_MAX_KEY) {
+		free(aclkey);
+		return BACKEND_DEFER;
+	}
+	if (*conf->superquery && (superkey = mc_key(conf->superquery, username, &lens[1])) != NULL) {
+		keys[nkeys++] = superkey;
 	}
-	free(query);
 
-	int answer = 0;
-	if (rc == MEMCACHED_SUCCESS) {
-		int x = atoi(value);
-		if (x >= acc)
-			answer = 1;
+	if ((memcached = sv_checkout(conf->sv)) == NULL) {
+		free(aclkey);
+		free(superkey);
+		return BACKEND_ERROR;
+	}
+
+	rc = memcached_mget(memcached, keys, lens, nkeys);
+	if (rc != MEMCACHED_SUCCESS) {
+		sv_checkin(conf->sv, memcached, mc_broken(conf, rc));
+		free(aclkey);
+		free(superkey);
+		return BACKEND_ERROR;
+	}
+
+	/* Drain every result, or the next request on this client misreads */
+	while ((res = memcached_fetch_result(memcached, NULL, &rc)) != NULL) {
+		size_t klen = memcached_result_key_length(res);
+
+		if (superkey && klen == lens[1] && !memcmp(memcached_result_key_value(res), superkey, klen))
+			super = mc_int(res);
+		else
+			level = mc_int(res);
+		memcached_result_free(res);
+	}
+	free(aclkey);
+	free(superkey);
+
+	if (rc != MEMCACHED_END && rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND) {
+		sv_checkin(conf->sv, memcached, mc_broken(conf, rc));
+		return BACKEND_ERROR;
+	}
+	sv_checkin(conf->sv, memcached, FALSE);
+
+	if (super != 0) {
+		_log(LOG_DEBUG, "Memcached: %s is a superuser", username);
+		answer = BACKEND_ALLOW;
+	} else if (level >= acc) {
+		answer = BACKEND_ALLOW;
 	}
-	free(value);
 	return answer;
 }
 #endif				/* BE_MEMCACHED */
@@ -10,15 +10,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <mosquitto.h>
 #include <mongoc.h>
 #include "hash.h"
 #include "log.h"
 #include "backends.h"
+#include "supervisor.h"
 
 
 struct mongo_backend {
-	mongoc_client_t *client;
+	mongoc_client_pool_t *pool;
+	long wait_ms;			/* pool_wait_ms */
+	pthread_mutex_t mutex;		/* signalled when a client is pushed */
+	pthread_cond_t cond;
 	char *database;
 	char *user_coll;
 	char *topiclist_coll;
@@ -57,12 +62,64 @@ void *be_mongo_init()
 	if (!uri) {
 		_fatal("MongoDB connection options invalid");
 	}
-	conf->client = mongoc_client_new_from_uri(uri);
+	/*
+	 * The driver's client pool gives each caller its own client and
+	 * handles (re)connecting and server monitoring in the background.
+	 */
+
+	conf->pool = mongoc_client_pool_new(uri);
 	mongoc_uri_destroy(uri);
+	if (!conf->pool) {
+		_fatal("Cannot create MongoDB client pool");
+	}
+	mongoc_client_pool_max_size(conf->pool, sv_opt("mongo", "pool_max", 4));
+	conf->wait_ms = sv_opt("mongo", "pool_wait_ms", 1000);
+	pthread_mutex_init(&conf->mutex, NULL);
+	pthread_cond_init(&conf->cond, NULL);
 
 	return (conf);
 }
 
+/*
+ * Take a client from the pool. If all pool_max clients are busy, wait up
+ * to pool_wait_ms, or what is left of check_deadline_ms, for one to be
+ * pushed back; the driver's own blocking pop can't be given a timeout.
+ */
+
+static mongoc_client_t *mongo_pop(struct mongo_backend *conf)
+{
+	mongoc_client_t *client;
+	struct timespec ts;
+	long wait = backend_timeout(conf->wait_ms);
+
+	if (wait < 0)
+		return (NULL);
+	if ((client = mongoc_client_pool_try_pop(conf->pool)) != NULL || conf->wait_ms <= 0)
+		return (client);
+
+	deadline_after(wait, &ts);
+	pthread_mutex_lock(&conf->mutex);
+	while ((client = mongoc_client_pool_try_pop(conf->pool)) == NULL) {
+		if (pthread_cond_timedwait(&conf->cond, &conf->mutex, &ts) != 0) {
+			client = mongoc_client_pool_try_pop(conf->pool);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conf->mutex);
+
+	if (client == NULL)
+		_log(LOG_NOTICE, "[mongo] no client available after %ld ms", wait);
+	return (client);
+}
+
+static void mongo_push(struct mongo_backend *conf, mongoc_client_t *client)
+{
+	mongoc_client_pool_push(conf->pool, client);
+	pthread_mutex_lock(&conf->mutex);
+	pthread_cond_signal(&conf->cond);
+	pthread_mutex_unlock(&conf->mutex);
+}
+
 // Get an option value via p_stab, fallback to a deprecated option (log a warning if present), fallback to a default
 const char *be_mongo_get_option(const char *opt_name, const char *dep_opt_name, const char *default_val) {
 	const char *value;
@@ -111,12 +168,18 @@ mongoc_uri_t *be_mongo_new_uri_from_options() {
 		uri = mongoc_uri_new_for_host_port("localhost", 27017);
 	}
 
+	// With check_deadline_ms, no socket read outlasts it unless the URI says otherwise
+	if (uri && backend_deadline_ms() > 0 && mongoc_uri_get_option_as_int32(uri, "socketTimeoutMS", 0) == 0) {
+		mongoc_uri_set_option_as_int32(uri, "socketTimeoutMS", (int32_t)backend_deadline_ms());
+	}
+
 	return uri;
 }
 
 int be_mongo_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct mongo_backend *conf = (struct mongo_backend *)handle;
+	mongoc_client_t *client;
 	mongoc_collection_t *collection;
 	mongoc_cursor_t *cursor;
 	bson_error_t error;
@@ -125,11 +188,14 @@ int be_mongo_getuser(void *handle, const char *username, const char *password, c
 	bson_t query;
 	char *result = NULL;
 
+	if ((client = mongo_pop(conf)) == NULL)
+		return BACKEND_ERROR;
+
 	bson_init (&query);
 
 	bson_append_utf8 (&query, conf->user_username_prop, -1, username, -1);
 
-	collection = mongoc_client_get_collection (conf->client, conf->database, conf->user_coll);
+	collection = mongoc_client_get_collection (client, conf->database, conf->user_coll);
 	cursor = mongoc_collection_find_with_opts(collection, &query, NULL, NULL);
 
 	if (!mongoc_cursor_error (cursor, &error) &&
@@ -153,6 +219,7 @@ int be_mongo_getuser(void *handle, const char *username, const char *password, c
 	bson_destroy (&query);
 	mongoc_cursor_destroy (cursor);
 	mongoc_collection_destroy (collection);
+	mongo_push(conf, client);
 
 	*phash = result;
 	return BACKEND_DEFER;
@@ -176,8 +243,10 @@ void be_mongo_destroy(void *handle)
 		free(conf->topiclist_key_prop);
 		free(conf->topiclist_topics_prop);
 
-		mongoc_client_destroy(conf->client);
-		conf->client = NULL;
+		mongoc_client_pool_destroy(conf->pool);
+		conf->pool = NULL;
+		pthread_cond_destroy(&conf->cond);
+		pthread_mutex_destroy(&conf->mutex);
 		free(conf);
 	}
 }
@@ -185,6 +254,7 @@ void be_mongo_destroy(void *handle)
 int be_mongo_superuser(void *conf, const char *username)
 {
 	struct mongo_backend *handle = (struct mongo_backend *) conf;
+	mongoc_client_t *client;
 	mongoc_collection_t *collection;
 	mongoc_cursor_t *cursor;
 	bson_error_t error;
@@ -193,10 +263,14 @@ int be_mongo_superuser(void *conf, const char *username)
 
 	bson_t query;
 	bson_iter_t iter;
+
+	if ((client = mongo_pop(handle)) == NULL)
+		return BACKEND_ERROR;
+
 	bson_init (&query);
 	bson_append_utf8(&query, handle->user_username_prop, -1, username, -1);
 
-	collection = mongoc_client_get_collection(handle->client, handle->database, handle->user_coll);
+	collection = mongoc_client_get_collection(client, handle->database, handle->user_coll);
 
 	cursor = mongoc_collection_find_with_opts(collection, &query, NULL, NULL);
 
@@ -215,6 +289,7 @@ int be_mongo_superuser(void *conf, const char *username)
 	bson_destroy (&query);
 	mongoc_cursor_destroy (cursor);
 	mongoc_collection_destroy (collection);
+	mongo_push(handle, client);
 
 	return (result) ? BACKEND_ALLOW : BACKEND_DEFER;
 }
@@ -222,6 +297,7 @@ int be_mongo_superuser(void *conf, const char *username)
 int be_mongo_aclcheck(void *conf, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct mongo_backend *handle = (struct mongo_backend *) conf;
+	mongoc_client_t *client;
 	mongoc_collection_t *collection;
 	mongoc_cursor_t *cursor;
 	bson_error_t error;
@@ -234,10 +310,13 @@ int be_mongo_aclcheck(void *conf, const char *clientid, const char *username, co
 
 	bson_t query;
 
+	if ((client = mongo_pop(handle)) == NULL)
+		return BACKEND_ERROR;
+
 	bson_init(&query);
 	bson_append_utf8(&query, handle->user_username_prop, -1, username, -1);
 
-	collection = mongoc_client_get_collection(handle->client, handle->database, handle->user_coll);
+	collection = mongoc_client_get_collection(client, handle->database, handle->user_coll);
 
 	cursor = mongoc_collection_find_with_opts(collection, &query, NULL, NULL);
 
@@ -282,7 +361,7 @@ int be_mongo_aclcheck(void *conf, const char *clientid, const char *username, co
 		} else if (topic_lookup_utf8 != NULL) {
 			bson_append_utf8(&query, handle->topiclist_key_prop, -1, topic_lookup_utf8, -1);
 		}
-		collection = mongoc_client_get_collection(handle->client, handle->database, handle->topiclist_coll);
+		collection = mongoc_client_get_collection(client, handle->database, handle->topiclist_coll);
 		cursor = mongoc_collection_find_with_opts(collection, &query, NULL, NULL);
 
 
@@ -309,6 +388,7 @@ int be_mongo_aclcheck(void *conf, const char *clientid, const char *username, co
 		mongoc_cursor_destroy(cursor);
 		mongoc_collection_destroy(collection);
 	}
+	mongo_push(handle, client);
 
 	return (match) ? BACKEND_ALLOW : BACKEND_DEFER;
 }
@@ -38,15 +38,23 @@
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
+#include "supervisor.h"
+#include <errmsg.h>
 
 struct mysql_backend {
-	MYSQL *mysql;
+	struct supervisor *sv;	/* Owns the MYSQL handle */
 	char *host;
 	int port;	
 	char *dbname;
 	char *user;
 	char *pass;
 	bool auto_connect;
+	bool ssl_enabled;
+	char *ssl_key;
+	char *ssl_cert;
+	char *ssl_ca;
+	char *ssl_capath;
+	char *ssl_cipher;
 	char *userquery; //MUST return 1 row, 1 column
 	char *superquery; //MUST return 1 row, 1 column,[0, 1]
 	char *aclquery; //MAY return n rows, 1 column, string
@@ -63,6 +71,64 @@ static char *get_bool(char *option, char *defval)
 	return defval;
 }
 
+/*
+ * Runs on the supervisor thread. MYSQL_OPT_RECONNECT is deliberately
+ * not set: it would reconnect inline on the broker thread.
+ */
+
+static void *be_mysql_connect(void *handle)
+{
+	struct mysql_backend *conf = (struct mysql_backend *)handle;
+	MYSQL *mysql;
+	unsigned int secs;
+
+	if ((mysql = mysql_init(NULL)) == NULL)
+		return (NULL);
+
+	/*
+	 * The client library counts whole seconds, from when the connection
+	 * is made, so a query can at most take the whole of check_deadline_ms.
+	 */
+
+	if (backend_deadline_ms() > 0) {
+		secs = (backend_deadline_ms() + 999) / 1000;
+		mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &secs);
+		mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &secs);
+	}
+
+	if (conf->ssl_enabled) {
+		mysql_ssl_set(mysql, conf->ssl_key, conf->ssl_cert, conf->ssl_ca, conf->ssl_capath, conf->ssl_cipher);
+	}
+	if (!mysql_real_connect(mysql, conf->host, conf->user, conf->pass, conf->dbname, conf->port, NULL, 0)) {
+		_log(LOG_NOTICE, "%s", mysql_error(mysql));
+		mysql_close(mysql);
+		return (NULL);
+	}
+	return (mysql);
+}
+
+static int be_mysql_probe(void *handle, void *conn)
+{
+	return (mysql_ping((MYSQL *)conn));
+}
+
+static void be_mysql_close(void *handle, void *conn)
+{
+	mysql_close((MYSQL *)conn);
+}
+
+/*
+ * Client-side errors (CR_*) mean the connection itself is unusable;
+ * server-side errors such as a bad query do not.
+ */
+
+static bool is_broken(MYSQL *mysql)
+{
+	unsigned int err = mysql_errno(mysql);
+
+	return (err >= CR_MIN_ERROR && err <= CR_MAX_ERROR);
+}
+
 void *be_mysql_init()
 {
 	struct mysql_backend *conf;
@@ -72,7 +138,7 @@ void *be_mysql_init()
 	char *opt_flag;
 	int port;
 	bool ssl_enabled;	
-	my_bool reconnect = false;
+	bool reconnect = false;
 	
 
 	_log(LOG_DEBUG, "}}}} MYSQL");
@@ -111,7 +177,6 @@ void *be_mysql_init()
 	if ((conf = (struct mysql_backend *)malloc(sizeof(struct mysql_backend))) == NULL)
 		return (NULL);
 
-	conf->mysql = mysql_init(NULL);
 	conf->host = host;
 	conf->port = port;
 	conf->user = user;
@@ -122,9 +187,12 @@ void *be_mysql_init()
 	conf->superquery = p_stab("superquery");
 	conf->aclquery = p_stab("aclquery");
 
-	if(ssl_enabled){
-		mysql_ssl_set(conf->mysql, ssl_key, ssl_cert, ssl_ca, ssl_capath, ssl_cipher);
-	}
+	conf->ssl_enabled = ssl_enabled;
+	conf->ssl_key = ssl_key;
+	conf->ssl_cert = ssl_cert;
+	conf->ssl_ca = ssl_ca;
+	conf->ssl_capath = ssl_capath;
+	conf->ssl_cipher = ssl_cipher;
 	
 	opt_flag = get_bool("mysql_auto_connect", "true");
 	if (!strcmp("true", opt_flag)) {
@@ -133,15 +201,18 @@ void *be_mysql_init()
 	opt_flag = get_bool("mysql_opt_reconnect", "true");
 	if (!strcmp("true", opt_flag)) {
 		reconnect = true;
-		mysql_options(conf->mysql, MYSQL_OPT_RECONNECT, &reconnect);
 	}
-	if (!mysql_real_connect(conf->mysql, host, user, pass, dbname, port, NULL, 0)) {
-		_log(LOG_NOTICE, "%s", mysql_error(conf->mysql));
-		if (!conf->auto_connect && !reconnect) {
-			free(conf);
-			mysql_close(conf->mysql);
-			return (NULL);
-		}
+
+	/*
+	 * Either flag lets the plugin start without a database; the
+	 * supervisor keeps trying to connect in the background.
+	 */
+
+	conf->sv = sv_new("mysql", conf, be_mysql_connect, be_mysql_probe, be_mysql_close);
+	if (conf->sv == NULL || (!sv_healthy(conf->sv) && !conf->auto_connect && !reconnect)) {
+		sv_destroy(conf->sv);
+		free(conf);
+		return (NULL);
 	}
 	return ((void *)conf);
 }
@@ -151,7 +222,7 @@ void be_mysql_destroy(void *handle)
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
 
 	if (conf) {
-		mysql_close(conf->mysql);
+		sv_destroy(conf->sv);
 		if (conf->userquery)
 			free(conf->userquery);
 		if (conf->superquery)
@@ -162,35 +233,24 @@ void be_mysql_destroy(void *handle)
 	}
 }
 
-static char *escape(void *handle, const char *value, long *vlen)
+static char *escape(MYSQL *mysql, const char *value, long *vlen)
 {
-	struct mysql_backend *conf = (struct mysql_backend *)handle;
 	char *v;
 
 	*vlen = strlen(value) * 2 + 1;
 	if ((v = malloc(*vlen)) == NULL)
 		return (NULL);
-	mysql_real_escape_string(conf->mysql, v, value, strlen(value));
+	mysql_real_escape_string(mysql, v, value, strlen(value));
 	return (v);
 }
 
-static bool auto_connect(struct mysql_backend *conf)
-{
-	if (conf->auto_connect) {
-		if (!mysql_real_connect(conf->mysql, conf->host, conf->user, conf->pass, conf->dbname, conf->port, NULL, 0)) {
-			fprintf(stderr, "do auto_connect but %s\n", mysql_error(conf->mysql));
-			return false;
-		}
-		return true;
-	}
-	return false;
-}
-
 int be_mysql_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
 	char *query = NULL, *u = NULL, *value = NULL, *v;
 	long nrows, ulen;
+	int rc = BACKEND_DEFER;
+	MYSQL *mysql;
 	MYSQL_RES *res = NULL;
 	MYSQL_ROW rowdata;
 
@@ -198,27 +258,27 @@ int be_mysql_getuser(void *handle, const char *username, const char *password, c
 	if (!conf || !conf->userquery || !username || !*username)
 		return BACKEND_DEFER;
 
-	if (mysql_ping(conf->mysql)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		if (!auto_connect(conf)) {
-			return BACKEND_ERROR;
-		}
-	}
-	if ((u = escape(conf, username, &ulen)) == NULL)
+	if ((mysql = sv_checkout(conf->sv)) == NULL)
 		return BACKEND_ERROR;
 
+	if ((u = escape(mysql, username, &ulen)) == NULL) {
+		sv_checkin(conf->sv, mysql, FALSE);
+		return BACKEND_ERROR;
+	}
+
 	if ((query = malloc(strlen(conf->userquery) + ulen + 128)) == NULL) {
 		free(u);
+		sv_checkin(conf->sv, mysql, FALSE);
 		return BACKEND_ERROR;
 	}
 	sprintf(query, conf->userquery, u, clientid);
 	free(u);
 
-	if (mysql_query(conf->mysql, query)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
+	if (mysql_query(mysql, query)) {
+		fprintf(stderr, "%s\n", mysql_error(mysql));
 		goto out;
 	}
-	res = mysql_store_result(conf->mysql);
+	res = mysql_store_result(mysql);
 	if ((nrows = mysql_num_rows(res)) != 1) {
 		//DEBUG fprintf(stderr, "rowcount = %ld; not ok\n", nrows);
 		goto out;
@@ -238,9 +298,12 @@ out:
 
 	mysql_free_result(res);
 	free(query);
+	if (is_broken(mysql))
+		rc = BACKEND_ERROR;
+	sv_checkin(conf->sv, mysql, rc == BACKEND_ERROR);
 
 	*phash = value;
-	return BACKEND_DEFER;
+	return rc;
 }
 
 /*
@@ -253,6 +316,7 @@ int be_mysql_superuser(void *handle, const char *username)
 	char *query = NULL, *u = NULL;
 	long nrows, ulen;
 	int issuper = BACKEND_DEFER;
+	MYSQL *mysql;
 	MYSQL_RES *res = NULL;
 	MYSQL_ROW rowdata;
 
@@ -260,28 +324,28 @@ int be_mysql_superuser(void *handle, const char *username)
 	if (!conf || !conf->superquery)
 		return BACKEND_DEFER;
 
-	if (mysql_ping(conf->mysql)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		if (!auto_connect(conf)) {
-			return (BACKEND_ERROR);
-		}
-	}
-	if ((u = escape(conf, username, &ulen)) == NULL)
+	if ((mysql = sv_checkout(conf->sv)) == NULL)
 		return (BACKEND_ERROR);
 
+	if ((u = escape(mysql, username, &ulen)) == NULL) {
+		sv_checkin(conf->sv, mysql, FALSE);
+		return (BACKEND_ERROR);
+	}
+
 	if ((query = malloc(strlen(conf->superquery) + ulen + 128)) == NULL) {
 		free(u);
+		sv_checkin(conf->sv, mysql, FALSE);
 		return (BACKEND_ERROR);
 	}
 	sprintf(query, conf->superquery, u);
 	free(u);
 
-	if (mysql_query(conf->mysql, query)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
+	if (mysql_query(mysql, query)) {
+		fprintf(stderr, "%s\n", mysql_error(mysql));
 		issuper = BACKEND_ERROR;
 		goto out;
 	}
-	res = mysql_store_result(conf->mysql);
+	res = mysql_store_result(mysql);
 	if ((nrows = mysql_num_rows(res)) != 1) {
 		goto out;
 	}
@@ -298,6 +362,7 @@ out:
 
 	mysql_free_result(res);
 	free(query);
+	sv_checkin(conf->sv, mysql, is_broken(mysql));
 
 	return (issuper);
 }
@@ -320,23 +385,24 @@ int be_mysql_aclcheck(void *handle, const char *clientid, const char *username,
 	long ulen;
 	int match = BACKEND_DEFER;
 	bool bf;
+	MYSQL *mysql;
 	MYSQL_RES *res = NULL;
 	MYSQL_ROW rowdata;
 
 	if (!conf || !conf->aclquery)
 		return BACKEND_DEFER;
 
-	if (mysql_ping(conf->mysql)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		if (!auto_connect(conf)) {
-			return (BACKEND_ERROR);
-		}
-	}
-	if ((u = escape(conf, username, &ulen)) == NULL)
+	if ((mysql = sv_checkout(conf->sv)) == NULL)
 		return (BACKEND_ERROR);
 
+	if ((u = escape(mysql, username, &ulen)) == NULL) {
+		sv_checkin(conf->sv, mysql, FALSE);
+		return (BACKEND_ERROR);
+	}
+
 	if ((query = malloc(strlen(conf->aclquery) + ulen + 128)) == NULL) {
 		free(u);
+		sv_checkin(conf->sv, mysql, FALSE);
 		return (BACKEND_ERROR);
 	}
 	sprintf(query, conf->aclquery, u, acc);
@@ -344,12 +410,12 @@ int be_mysql_aclcheck(void *handle, const char *clientid, const char *username,
 
 	//_log(LOG_DEBUG, "SQL: %s", query);
 
-	if (mysql_query(conf->mysql, query)) {
-		_log(LOG_NOTICE, "%s", mysql_error(conf->mysql));
+	if (mysql_query(mysql, query)) {
+		_log(LOG_NOTICE, "%s", mysql_error(mysql));
 		match = BACKEND_ERROR;
 		goto out;
 	}
-	res = mysql_store_result(conf->mysql);
+	res = mysql_store_result(mysql);
 	if (mysql_num_fields(res) != 1) {
 		fprintf(stderr, "numfields not ok\n");
 		goto out;
@@ -380,6 +446,7 @@ out:
 
 	mysql_free_result(res);
 	free(query);
+	sv_checkin(conf->sv, mysql, is_broken(mysql));
 
 	return (match);
 }
@@ -38,10 +38,13 @@
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
+#include "supervisor.h"
 #include <arpa/inet.h>
+#include <poll.h>
+#include <errno.h>
 
 struct pg_backend {
-	PGconn *conn;
+	struct supervisor *sv;	/* Owns the PGconn */
 	char *host;
 	char *port;
 	char *dbname;
@@ -60,13 +63,137 @@ struct pg_backend {
 static int addKeyValue(char **keywords, char **values, char *key, char *value,
 		const int MAX_KEYS);
 
+/*
+ * Runs on the supervisor thread; the broker never waits for a
+ * PQconnectdbParams() or PQreset().
+ */
+
+static void *be_pg_connect(void *handle)
+{
+	struct pg_backend *conf = (struct pg_backend *)handle;
+	PGconn *conn;
+	char **keywords = NULL;
+	char **values = NULL;
+	char options[64];
+
+	const uint8_t MAX_KEYS = 8;
+	keywords = (char **) calloc(MAX_KEYS + 1, sizeof(char *));
+	values = (char **) calloc(MAX_KEYS + 1, sizeof(char *));
+
+	if (conf->host) {
+		addKeyValue(keywords, values, "host", conf->host, MAX_KEYS);
+	}
+	if (conf->port) {
+		addKeyValue(keywords, values, "port", conf->port, MAX_KEYS);
+	}
+	if (conf->dbname) {
+		addKeyValue(keywords, values, "dbname", conf->dbname, MAX_KEYS);
+	}
+	if (conf->user) {
+		addKeyValue(keywords, values, "user", conf->user, MAX_KEYS);
+	}
+	if (conf->pass) {
+		addKeyValue(keywords, values, "password", conf->pass, MAX_KEYS);
+	}
+	if (conf->sslcert) {
+		addKeyValue(keywords, values, "sslcert", conf->sslcert, MAX_KEYS);
+	}
+	if (conf->sslkey) {
+		addKeyValue(keywords, values, "sslkey", conf->sslkey, MAX_KEYS);
+	}
+	if (backend_deadline_ms() > 0) {
+		/* The server gives up too, rather than run on for nobody */
+		snprintf(options, sizeof(options), "-c statement_timeout=%ld", backend_deadline_ms());
+		addKeyValue(keywords, values, "options", options, MAX_KEYS);
+	}
+
+	conn = PQconnectdbParams(
+		(const char * const *)keywords, (const char * const *)values, 0);
+
+	free(keywords);
+	free(values);
+
+	if (PQstatus(conn) != CONNECTION_OK) {
+		_log(LOG_NOTICE, "%s", PQerrorMessage(conn));
+		PQfinish(conn);
+		return (NULL);
+	}
+	return (conn);
+}
+
+static int be_pg_probe(void *handle, void *conn)
+{
+	PGresult *res;
+	int rc;
+
+	res = PQexec((PGconn *)conn, "");
+	rc = (PQresultStatus(res) == PGRES_EMPTY_QUERY) ? 0 : 1;
+	PQclear(res);
+	return (rc);
+}
+
+static void be_pg_close(void *handle, void *conn)
+{
+	PQfinish((PGconn *)conn);
+}
+
+/*
+ * PQexecParams(), but with check_deadline_ms waiting for the answer no
+ * longer than backend_timeout() allows. A query still running then, or
+ * one whose socket can't be polled, is cancelled and `*timedout' set: the connection, with the remains of the
+ * query on it, is not to be used again. Returns the last result, or NULL
+ * if the query was not sent or did not finish.
+ */
+
+static PGresult *pg_exec(PGconn *conn, const char *query, int nparams, const char * const *values, const int *lengths, const int *formats, int *timedout)
+{
+	PGresult *res, *last = NULL;
+	PGcancel *cancel;
+	struct pollfd pfd;
+	long ms;
+	int n;
+	char err[256];
+
+	*timedout = FALSE;
+	if ((ms = backend_timeout(0)) == 0)
+		return (PQexecParams(conn, query, nparams, NULL, values, lengths, formats, 0));
+	if (ms < 0) {
+		*timedout = TRUE;
+		return (NULL);
+	}
+	if (!PQsendQueryParams(conn, query, nparams, NULL, values, lengths, formats, 0))
+		return (NULL);
+
+	pfd.fd = PQsocket(conn);
+	pfd.events = POLLIN;
+	while (PQconsumeInput(conn) && PQisBusy(conn)) {
+		n = 0;
+		if ((ms = backend_timeout(0)) > 0 &&
+		    ((n = poll(&pfd, 1, (int)ms)) > 0 || (n < 0 && errno == EINTR)))
+			continue;
+		if (n < 0)
+			_log(LOG_NOTICE, "postgres: poll: %s, cancelling query", strerror(errno));
+		else
+			_log(LOG_NOTICE, "postgres: out of time, cancelling query");
+		if ((cancel = PQgetCancel(conn)) != NULL) {
+			PQcancel(cancel, err, sizeof(err));
+			PQfreeCancel(cancel);
+		}
+		*timedout = TRUE;
+		return (NULL);
+	}
+	while ((res = PQgetResult(conn)) != NULL) {
+		PQclear(last);
+		last = res;
+	}
+	return (last);
+}
+
 void *be_pg_init()
 {
 	struct pg_backend *conf;
 	char *host, *user, *pass, *dbname, *p, *port, *sslcert, *sslkey;
 	char *userquery;
-	char **keywords = NULL;
-	char **values = NULL;
 
 	_log(LOG_DEBUG, "}}}} POSTGRES");
 
@@ -90,7 +217,6 @@ void *be_pg_init()
 	if ((conf = (struct pg_backend *)malloc(sizeof(struct pg_backend))) == NULL)
 		return (NULL);
 
-	conf->conn = NULL;
 	conf->host = host;
 	conf->port = port;
 	conf->user = user;
@@ -105,39 +231,9 @@ void *be_pg_init()
 	_log(LOG_DEBUG, "HERE: %s", conf->superquery);
 	_log(LOG_DEBUG, "HERE: %s", conf->aclquery);
 
-	const uint8_t MAX_KEYS = 7;
-	keywords = (char **) calloc(MAX_KEYS + 1, sizeof(char *));
-	values = (char **) calloc(MAX_KEYS + 1, sizeof(char *));
-
-	if (conf->host) {
-		addKeyValue(keywords, values, "host", conf->host, MAX_KEYS);
-	}
-	if (conf->port) {
-		addKeyValue(keywords, values, "port", conf->port, MAX_KEYS);
-	}
-	if (conf->dbname) {
-		addKeyValue(keywords, values, "dbname", conf->dbname, MAX_KEYS);
-	}
-	if (conf->user) {
-		addKeyValue(keywords, values, "user", conf->user, MAX_KEYS);
-	}
-	if (conf->pass) {
-		addKeyValue(keywords, values, "password", conf->pass, MAX_KEYS);
-	}
-	if (conf->sslcert) {
-		addKeyValue(keywords, values, "sslcert", conf->sslcert, MAX_KEYS);
-	}
-	if (conf->sslkey) {
-		addKeyValue(keywords, values, "sslkey", conf->sslkey, MAX_KEYS);
-	}
-
-	conf->conn = PQconnectdbParams(
-		(const char * const *)keywords, (const char * const *)values, 0);
-
-	free(keywords);
-	free(values);
-
-	if (PQstatus(conf->conn) == CONNECTION_BAD) {
+	conf->sv = sv_new("postgres", conf, be_pg_connect, be_pg_probe, be_pg_close);
+	if (conf->sv == NULL || !sv_healthy(conf->sv)) {
+		sv_destroy(conf->sv);
 		free(conf);
 		_fatal("We were unable to connect to the database");
 		return (NULL);
@@ -151,7 +247,7 @@ void be_pg_destroy(void *handle)
 	struct pg_backend *conf = (struct pg_backend *)handle;
 
 	if (conf) {
-		PQfinish(conf->conn);
+		sv_destroy(conf->sv);
 		if (conf->userquery)
 			free(conf->userquery);
 		if (conf->superquery)
@@ -167,6 +263,8 @@ int be_pg_getuser(void *handle, const char *username, const char *password, char
 	struct pg_backend *conf = (struct pg_backend *)handle;
 	char *value = NULL, *v = NULL;
 	long nrows;
+	int rc = BACKEND_DEFER, timedout;
+	PGconn *conn;
 	PGresult *res = NULL;
 
 	_log(LOG_DEBUG, "GETTING USERS: %s", username);
@@ -174,19 +272,23 @@ int be_pg_getuser(void *handle, const char *username, const char *password, char
 	if (!conf || !conf->userquery || !username || !*username)
 		return BACKEND_DEFER;
 
+	if ((conn = sv_checkout(conf->sv)) == NULL)
+		return BACKEND_ERROR;
+
 	const char *values[1] = {username};
 	int lengths[1] = {strlen(username)};
 	int binary[1] = {0};
 
-	res = PQexecParams(conf->conn, conf->userquery, 1, NULL, values, lengths, binary, 0);
+	res = pg_exec(conn, conf->userquery, 1, values, lengths, binary, &timedout);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		_log(LOG_DEBUG, "%s\n", PQresultErrorMessage(res));
-		if(PQstatus(conf->conn) == CONNECTION_BAD){
-			_log(LOG_NOTICE, "Noticed a postgres connection loss. Trying to reconnect ...\n");
-			//try to reinitiate the database connection
-			PQreset(conf->conn);
+		if(PQstatus(conn) == CONNECTION_BAD){
+			_log(LOG_NOTICE, "Noticed a postgres connection loss. Reconnecting in background ...\n");
+			rc = BACKEND_ERROR;
 		}
+		if (timedout)
+			rc = BACKEND_ERROR;
 		
 		goto out;
 	}
@@ -207,9 +309,10 @@ int be_pg_getuser(void *handle, const char *username, const char *password, char
 out:
 
 	PQclear(res);
+	sv_checkin(conf->sv, conn, timedout || PQstatus(conn) == CONNECTION_BAD);
 
 	*phash = value;
-	return BACKEND_DEFER;
+	return rc;
 }
 
 /*
@@ -221,7 +324,8 @@ int be_pg_superuser(void *handle, const char *username)
 	struct pg_backend *conf = (struct pg_backend *)handle;
 	char *v = NULL;
 	long nrows;
-	int issuper = BACKEND_DEFER;
+	int issuper = BACKEND_DEFER, timedout;
+	PGconn *conn;
 	PGresult *res = NULL;
 
 	_log(LOG_DEBUG, "SUPERUSER: %s", username);
@@ -229,21 +333,21 @@ int be_pg_superuser(void *handle, const char *username)
 	if (!conf || !conf->superquery || !username || !*username)
 		return BACKEND_DEFER;
 
+	if ((conn = sv_checkout(conf->sv)) == NULL)
+		return BACKEND_ERROR;
+
 	//query for postgres $1 instead of % s
 	const char *values[1] = {username};
 	int lengths[1] = {strlen(username)};
 	int binary[1] = {0};
 
-	res = PQexecParams(conf->conn, conf->superquery, 1, NULL, values, lengths, binary, 0);
+	res = pg_exec(conn, conf->superquery, 1, values, lengths, binary, &timedout);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		fprintf(stderr, "%s\n", PQresultErrorMessage(res));
 		issuper = BACKEND_ERROR;
-		//try to reset connection if failing because of database connection lost
-		if(PQstatus(conf->conn) == CONNECTION_BAD){
-			_log(LOG_NOTICE, "Noticed a postgres connection loss. Trying to reconnect ...\n");
-			//try to reinitiate the database connection
-			PQreset(conf->conn);
+		if(PQstatus(conn) == CONNECTION_BAD){
+			_log(LOG_NOTICE, "Noticed a postgres connection loss. Reconnecting in background ...\n");
 		}
 
 		goto out;
@@ -265,6 +369,7 @@ out:
 	_log(LOG_DEBUG, "user is %d", issuper);
 
 	PQclear(res);
+	sv_checkin(conf->sv, conn, timedout || PQstatus(conn) == CONNECTION_BAD);
 
 	return (issuper);
 }
@@ -286,8 +391,9 @@ int be_pg_aclcheck(void *handle, const char *clientid, const char *username, con
 {
 	struct pg_backend *conf = (struct pg_backend *)handle;
 	char *v = NULL;
-	int match = BACKEND_DEFER;
+	int match = BACKEND_DEFER, timedout;
 	bool bf;
+	PGconn *conn;
 	PGresult *res = NULL;
 
 	_log(LOG_DEBUG, "USERNAME: %s, TOPIC: %s, acc: %d", username, topic, acc);
@@ -296,6 +402,9 @@ int be_pg_aclcheck(void *handle, const char *clientid, const char *username, con
 	if (!conf || !conf->aclquery)
 		return BACKEND_DEFER;
 
+	if ((conn = sv_checkout(conf->sv)) == NULL)
+		return BACKEND_ERROR;
+
 	const int buflen = 11;
 	//10 for 2^32 + 1
 	char accbuffer[buflen];
@@ -304,17 +413,14 @@ int be_pg_aclcheck(void *handle, const char *clientid, const char *username, con
 	const char *values[2] = {username, accbuffer};
 	int lengths[2] = {strlen(username), buflen};
 
-	res = PQexecParams(conf->conn, conf->aclquery, 2, NULL, values, lengths, NULL, 0);
+	res = pg_exec(conn, conf->aclquery, 2, values, lengths, NULL, &timedout);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		fprintf(stderr, "%s\n", PQresultErrorMessage(res));
 		match = BACKEND_ERROR;
 
-		//try to reset connection if failing because of database connection lost
-		if(PQstatus(conf->conn) == CONNECTION_BAD){
-			_log(LOG_NOTICE, "Noticed a postgres connection loss. Trying to reconnect ...\n");
-			//try to reinitiate the database connection
-			PQreset(conf->conn);
+		if(PQstatus(conn) == CONNECTION_BAD){
+			_log(LOG_NOTICE, "Noticed a postgres connection loss. Reconnecting in background ...\n");
 		}
 
 		goto out;
@@ -353,6 +459,7 @@ int be_pg_aclcheck(void *handle, const char *clientid, const char *username, con
 out:
 
 	PQclear(res);
+	sv_checkin(conf->sv, conn, timedout || PQstatus(conn) == CONNECTION_BAD);
 
 	return (match);
 }
@@ -32,58 +32,1585 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
+#include "be-redis.h"
+#include "supervisor.h"
+#include "uthash.h"
+#include <mosquitto.h>
 #include <hiredis/hiredis.h>
 
+#define MAXARGS		16
+#define MAXNODES	64
+#define CLUSTER_SLOTS	16384
+
+#define REDIS_STANDALONE	0
+#define REDIS_SENTINEL		1
+#define REDIS_CLUSTER		2
+
+/*
+ * Client-side cache. Each entry is the reply to one command; entries
+ * are grouped by the Redis key the command read, which is what the
+ * server names in its invalidation messages.
+ */
+
+struct rc_item {
+	char *cmd;			/* key: command with args */
+	char *value;			/* string reply, NULL for nil */
+	UT_hash_handle hh;
+};
+
+struct rc_key {
+	char *key;			/* Redis key */
+	struct rc_item *items;
+	int nitems;
+	UT_hash_handle hh;
+};
+
+/*
+ * Schema mode: a user is described by the hash <user_prefix><name> with
+ * fields `pwhash', `superuser' and optionally `acl', naming the hash of
+ * topic patterns to access masks (default <acl_prefix><name>). Both are
+ * fetched in one round trip and kept as one record.
+ */
+
+struct rs_user {
+	char *name;			/* key */
+	int exists;			/* user hash was found */
+	char *pwhash;
+	int superuser;
+	char *aclkey;
+	int nacl;
+	struct backend_rule *acl;
+	time_t expires;			/* 0 if kept until invalidated */
+	int refs;			/* Protected by the mutex */
+	UT_hash_handle hh;
+};
+
+/*
+ * A Redis server: the primary, a replica, or a cluster node. Each has
+ * its own connection pool and, with client caching, its own
+ * invalidation connection. Nodes which drop out of the topology are
+ * retired and freed once the last lookup using them is done.
+ */
+
+struct redis_node {
+	struct redis_backend *be;
+	char *host;
+	int port;
+	int replica;
+	struct redis_node *master;	/* for replicas */
+	struct supervisor *sv;		/* Owns the redis_conn pool */
+	double rtt_ms;			/* moving average of round trip time */
+	int refs;			/* lookups using this node */
+	int retired;
+	int seen;			/* during topology updates */
+
+	long long inv_id;		/* CLIENT ID of invalidation conn, 0 if down */
+	unsigned long inv_gen;		/* bumped on each invalidation connection */
+	redisContext *inv;
+	int inv_running;
+	pthread_t inv_thread;
+
+	struct redis_node *next;
+};
+
+struct redis_conn {
+	redisContext *c;
+	struct redis_node *node;
+	unsigned long track_gen;	/* inv_gen tracking was enabled for */
+};
+
 struct redis_backend {
-	redisContext *redis;
 	char *host;
 	char *userquery;
 	char *aclquery;
 	char *dbpass;
 	int port;
 	int db;
+
+	int mode;			/* REDIS_STANDALONE, _SENTINEL or _CLUSTER */
+	int read_replicas;		/* send lookups to replicas */
+	char *replicas;			/* static replica list */
+	char *sentinels;
+	char *sentinel_master;
+	char *sentinel_pass;
+	long topology_ms;
+	struct redis_node *nodes;
+	struct redis_node *primary;	/* not used in cluster mode */
+	struct redis_node *dead;	/* retired and unused, to be freed */
+	struct redis_node **slots;	/* cluster mode: slot -> master */
+	unsigned int seed;
+	int running;
+	int topo_stale;
+	pthread_t topo_thread;
+	pthread_cond_t topo_cond;
+
+	int schema;			/* user records instead of queries */
+	char *user_prefix;
+	char *acl_prefix;
+	time_t schema_cacheseconds;	/* record lifetime without tracking */
+	struct rs_user *users;
+	long rs_count;
+
+	int client_cache;		/* CLIENT TRACKING near-cache enabled */
+	long rc_max;			/* max cached replies */
+	long rc_count;
+	struct rc_key *rc;
+	unsigned long rc_seq;		/* bumped on each invalidation */
+	pthread_mutex_t mutex;		/* protects nodes, topology and caches */
+	pthread_cond_t cond;
+};
+
+/*
+ * Entries of a topology as read from Sentinel or CLUSTER SLOTS, before
+ * they are applied to the node list.
+ */
+
+struct topo_ent {
+	char host[256];
+	int port;
+	int master;			/* index of master, -1 for masters */
+};
+
+struct topo_range {
+	int start, end;
+	int ent;
 };
 
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000L + ts.tv_nsec / 1000000L);
+}
+
+static void timed_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, long ms)
+{
+	struct timespec ts;
+
+	deadline_after(ms, &ts);
+	pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+/*
+ * Connect, authenticate and select the database. Runs on the supervisor
+ * and topology threads (and once from init) so the 2.5s connect timeout
+ * never blocks the broker. Cluster replicas are put in READONLY mode so
+ * that they answer reads for their slots instead of redirecting.
+ */
+
+static redisContext *be_redis_open(struct redis_backend *conf, const char *host, int port, int readonly)
+{
+	redisContext *redis;
+	redisReply *r;
+	struct timeval timeout = {2, 500000};	//2.5 seconds
+
+	redis = redisConnectWithTimeout(host, port, timeout);
+	if (redis == NULL || redis->err) {
+		_log(LOG_NOTICE, "Redis connection error: %s for %s:%d\n",
+		     redis ? redis->errstr : "out of memory", host, port);
+		goto fail;
+	}
+	if (strlen(conf->dbpass) > 0) {
+		_log(LOG_NOTICE, "Using password protected redis\n");
+		r = redisCommand(redis, "AUTH %s", conf->dbpass);
+		if (r == NULL || redis->err != REDIS_OK) {
+			_log(LOG_NOTICE, "Redis authentication error: %s\n", redis->errstr);
+			goto fail;
+		}
+		freeReplyObject(r);
+	}
+	if (conf->mode != REDIS_CLUSTER) {
+		r = redisCommand(redis, "SELECT %i", conf->db);
+		if (r == NULL || redis->err != REDIS_OK) {
+			goto fail;
+		}
+		freeReplyObject(r);
+	} else if (readonly) {
+		r = redisCommand(redis, "READONLY");
+		if (r == NULL || redis->err != REDIS_OK) {
+			goto fail;
+		}
+		freeReplyObject(r);
+	}
+
+	return (redis);
+
+    fail:
+	if (redis != NULL)
+		redisFree(redis);
+	return (NULL);
+}
+
+static void rtt_update(struct redis_node *node, long ms)
+{
+	struct redis_backend *conf = node->be;
+
+	pthread_mutex_lock(&conf->mutex);
+	node->rtt_ms = (node->rtt_ms > 0) ? 0.8 * node->rtt_ms + 0.2 * ms : ms;
+	pthread_mutex_unlock(&conf->mutex);
+}
+
+static void *be_redis_connect(void *handle)
+{
+	struct redis_node *node = (struct redis_node *)handle;
+	struct redis_conn *rc;
+	redisContext *redis;
+	int replica;
+
+	pthread_mutex_lock(&node->be->mutex);
+	replica = node->replica;
+	pthread_mutex_unlock(&node->be->mutex);
+
+	if ((redis = be_redis_open(node->be, node->host, node->port, replica)) == NULL)
+		return (NULL);
+
+	if ((rc = (struct redis_conn *)malloc(sizeof(struct redis_conn))) == NULL) {
+		redisFree(redis);
+		return (NULL);
+	}
+	rc->c = redis;
+	rc->node = node;
+	rc->track_gen = 0;
+	return (rc);
+}
+
+static int be_redis_probe(void *handle, void *conn)
+{
+	redisContext *redis = ((struct redis_conn *)conn)->c;
+	redisReply *r;
+	long t0 = now_ms();
+	int rc = 0;
+
+	r = redisCommand(redis, "PING");
+	if (r == NULL || redis->err != REDIS_OK || r->type == REDIS_REPLY_ERROR)
+		rc = 1;
+	else
+		rtt_update((struct redis_node *)handle, now_ms() - t0);
+	if (r != NULL)
+		freeReplyObject(r);
+	return (rc);
+}
+
+static void be_redis_close(void *handle, void *conn)
+{
+	redisFree(((struct redis_conn *)conn)->c);
+	free(conn);
+}
+
+/*
+ * Remove key `k' and its replies from the cache. Called with the mutex
+ * held.
+ */
+
+static void rc_drop(struct redis_backend *conf, struct rc_key *k)
+{
+	struct rc_item *i, *itmp;
+
+	HASH_ITER(hh, k->items, i, itmp) {
+		HASH_DEL(k->items, i);
+		free(i->cmd);
+		free(i->value);
+		free(i);
+	}
+	conf->rc_count -= k->nitems;
+	HASH_DEL(conf->rc, k);
+	free(k->key);
+	free(k);
+}
+
+static void rs_free(struct rs_user *u)
+{
+	int n;
+
+	for (n = 0; n < u->nacl; n++)
+		free(u->acl[n].pattern);
+	free(u->acl);
+	free(u->aclkey);
+	free(u->pwhash);
+	free(u->name);
+	free(u);
+}
+
+/* Drop a reference to `u'. Called with the mutex held. */
+static void rs_unref(struct rs_user *u)
+{
+	if (--u->refs == 0)
+		rs_free(u);
+}
+
+/* Remove `u' from the cache. Called with the mutex held. */
+static void rs_drop(struct redis_backend *conf, struct rs_user *u)
+{
+	HASH_DEL(conf->users, u);
+	conf->rs_count--;
+	rs_unref(u);
+}
+
+/*
+ * Drop the user records built from Redis key `key', or all of them if
+ * `key' is NULL. Called with the mutex held.
+ */
+
+static void rs_invalidate(struct redis_backend *conf, const char *key)
+{
+	struct rs_user *u, *tmp;
+	size_t plen = strlen(conf->user_prefix);
+
+	if (key != NULL && strncmp(key, conf->user_prefix, plen) == 0) {
+		HASH_FIND_STR(conf->users, key + plen, u);
+		if (u != NULL)
+			rs_drop(conf, u);
+	}
+
+	/*
+	 * ACL hashes may be shared between users, and may be named under
+	 * the user prefix too (or it may be empty), so look at them all.
+	 */
+	HASH_ITER(hh, conf->users, u, tmp) {
+		if (key == NULL || strcmp(u->aclkey, key) == 0)
+			rs_drop(conf, u);
+	}
+}
+
+/*
+ * Drop all replies cached for Redis key `key', or the whole cache if
+ * `key' is NULL. Called with the mutex held.
+ */
+
+static void rc_invalidate(struct redis_backend *conf, const char *key)
+{
+	struct rc_key *k, *ktmp;
+
+	if (conf->schema)
+		rs_invalidate(conf, key);
+
+	if (key != NULL) {
+		HASH_FIND_STR(conf->rc, key, k);
+		if (k != NULL)
+			rc_drop(conf, k);
+	} else {
+		HASH_ITER(hh, conf->rc, k, ktmp) {
+			rc_drop(conf, k);
+		}
+	}
+	conf->rc_seq++;
+}
+
+/*
+ * Look up `cmd' in the cache. Returns 1 on a hit and sets *value to a
+ * copy of the cached reply (NULL for nil). Called with the mutex held.
+ */
+
+static int rc_get(struct redis_backend *conf, const char *key, const char *cmd, char **value)
+{
+	struct rc_key *k;
+	struct rc_item *i;
+
+	HASH_FIND_STR(conf->rc, key, k);
+	if (k == NULL)
+		return (0);
+	HASH_FIND_STR(k->items, cmd, i);
+	if (i == NULL)
+		return (0);
+	*value = (i->value) ? strdup(i->value) : NULL;
+	return (1);
+}
+
+/*
+ * Insert a reply. When the cache is full the key cached longest ago is
+ * evicted. Called with the mutex held.
+ */
+
+static void rc_put(struct redis_backend *conf, const char *key, const char *cmd, const char *value)
+{
+	struct rc_key *k;
+	struct rc_item *i;
+
+	HASH_FIND_STR(conf->rc, key, k);
+	if (k == NULL) {
+		while (conf->rc_count >= conf->rc_max && conf->rc != NULL)
+			rc_drop(conf, conf->rc);
+		k = (struct rc_key *)malloc(sizeof(struct rc_key));
+		k->key = strdup(key);
+		k->items = NULL;
+		k->nitems = 0;
+		HASH_ADD_KEYPTR(hh, conf->rc, k->key, strlen(k->key), k);
+	}
+
+	HASH_FIND_STR(k->items, cmd, i);
+	if (i != NULL)
+		return;
+
+	i = (struct rc_item *)malloc(sizeof(struct rc_item));
+	i->cmd = strdup(cmd);
+	i->value = (value) ? strdup(value) : NULL;
+	HASH_ADD_KEYPTR(hh, k->items, i->cmd, strlen(i->cmd), i);
+	k->nitems++;
+	conf->rc_count++;
+}
+
+/*
+ * Handle one message from the invalidation channel: an array of keys,
+ * or nil when the server flushed its database.
+ */
+
+static void be_redis_invalidated(struct redis_backend *conf, redisReply *r)
+{
+	redisReply *keys;
+	size_t n;
+
+	if (r->type != REDIS_REPLY_ARRAY || r->elements != 3 ||
+	    r->element[0]->type != REDIS_REPLY_STRING ||
+	    strcmp(r->element[0]->str, "message") != 0)
+		return;
+
+	keys = r->element[2];
+
+	pthread_mutex_lock(&conf->mutex);
+	if (keys->type == REDIS_REPLY_ARRAY) {
+		for (n = 0; n < keys->elements; n++) {
+			if (keys->element[n]->type == REDIS_REPLY_STRING)
+				rc_invalidate(conf, keys->element[n]->str);
+		}
+	} else {
+		rc_invalidate(conf, NULL);
+	}
+	pthread_mutex_unlock(&conf->mutex);
+}
+
+/*
+ * Invalidation thread, one per node. Keeps a connection subscribed to
+ * the node's invalidation channel; data connections to the node
+ * redirect their tracking messages to it. Whenever this connection is
+ * down the cache is emptied, as invalidations could have been missed,
+ * and replies read from the node are not cached.
+ */
+
+static void *be_redis_invalidator(void *arg)
+{
+	struct redis_node *node = (struct redis_node *)arg;
+	struct redis_backend *conf = node->be;
+	struct timeval forever = {0, 0};
+	long backoff = 250;
+	long long id;
+	redisContext *redis;
+	redisReply *r;
+
+	pthread_mutex_lock(&conf->mutex);
+	while (node->inv_running) {
+		pthread_mutex_unlock(&conf->mutex);
+
+		id = 0;
+		if ((redis = be_redis_open(conf, node->host, node->port, FALSE)) != NULL) {
+			redisSetTimeout(redis, forever);
+			redisEnableKeepAlive(redis);
+
+			r = redisCommand(redis, "CLIENT ID");
+			if (r != NULL && r->type == REDIS_REPLY_INTEGER)
+				id = r->integer;
+			if (r != NULL)
+				freeReplyObject(r);
+
+			r = (id) ? redisCommand(redis, "SUBSCRIBE __redis__:invalidate") : NULL;
+			if (r == NULL || r->type != REDIS_REPLY_ARRAY) {
+				_log(LOG_NOTICE, "[redis] cannot subscribe to invalidations on %s:%d; client cache disabled until it can",
+					node->host, node->port);
+				id = 0;
+			}
+			if (r != NULL)
+				freeReplyObject(r);
+		}
+
+		pthread_mutex_lock(&conf->mutex);
+		if (id != 0 && node->inv_running) {
+			node->inv = redis;
+			node->inv_id = id;
+			node->inv_gen++;
+			backoff = 250;
+			pthread_mutex_unlock(&conf->mutex);
+
+			_log(LOG_DEBUG, "[redis] tracking invalidations on %s:%d client %lld", node->host, node->port, id);
+			while (redisGetReply(redis, (void **)&r) == REDIS_OK && r != NULL) {
+				be_redis_invalidated(conf, r);
+				freeReplyObject(r);
+			}
+
+			pthread_mutex_lock(&conf->mutex);
+			node->inv = NULL;
+			node->inv_id = 0;
+			rc_invalidate(conf, NULL);
+			if (node->inv_running)
+				_log(LOG_NOTICE, "[redis] invalidation connection to %s:%d lost; client cache flushed",
+					node->host, node->port);
+		}
+		if (redis != NULL) {
+			pthread_mutex_unlock(&conf->mutex);
+			redisFree(redis);
+			pthread_mutex_lock(&conf->mutex);
+		}
+		if (!node->inv_running)
+			break;
+
+		timed_wait(&conf->cond, &conf->mutex, backoff);
+		if ((backoff *= 2) > 30000)
+			backoff = 30000;
+	}
+	pthread_mutex_unlock(&conf->mutex);
+
+	return (NULL);
+}
+
+static struct redis_node *node_new(struct redis_backend *conf, const char *host, int port, int replica)
+{
+	struct redis_node *node;
+
+	if ((node = (struct redis_node *)malloc(sizeof(struct redis_node))) == NULL)
+		return (NULL);
+	memset(node, 0, sizeof(struct redis_node));
+	node->be = conf;
+	node->host = strdup(host);
+	node->port = port;
+	node->replica = replica;
+
+	if ((node->sv = sv_new("redis", node, be_redis_connect, be_redis_probe, be_redis_close)) == NULL) {
+		free(node->host);
+		free(node);
+		return (NULL);
+	}
+
+	if (conf->client_cache) {
+		node->inv_running = 1;
+		if (pthread_create(&node->inv_thread, NULL, be_redis_invalidator, node) != 0) {
+			_log(LOG_NOTICE, "[redis] cannot start invalidation thread for %s:%d: %s",
+				host, port, strerror(errno));
+			node->inv_running = 0;
+		}
+	}
+
+	_log(LOG_DEBUG, "[redis] using %s %s:%d", replica ? "replica" : "master", host, port);
+	return (node);
+}
+
+/*
+ * Stop the node's threads and close its connections. The node must
+ * not be in use.
+ */
+
+static void node_free(struct redis_node *node)
+{
+	struct redis_backend *conf = node->be;
+	int joined;
+
+	pthread_mutex_lock(&conf->mutex);
+	joined = node->inv_running;
+	node->inv_running = 0;
+	if (node->inv != NULL)
+		shutdown(node->inv->fd, SHUT_RDWR);
+	pthread_cond_broadcast(&conf->cond);
+	pthread_mutex_unlock(&conf->mutex);
+	if (joined)
+		pthread_join(node->inv_thread, NULL);
+
+	sv_destroy(node->sv);
+	free(node->host);
+	free(node);
+}
+
+/* Called with the mutex held */
+
+static struct redis_node *node_find(struct redis_backend *conf, const char *host, int port)
+{
+	struct redis_node *node;
+
+	for (node = conf->nodes; node != NULL; node = node->next) {
+		if (node->port == port && strcmp(node->host, host) == 0)
+			return (node);
+	}
+	return (NULL);
+}
+
+/*
+ * Drop a lookup's reference to `node'. The last user of a retired node
+ * hands it to the topology thread to free, as that joins its
+ * invalidation thread and closes its pool.
+ */
+
+static void node_release(struct redis_backend *conf, struct redis_node *node)
+{
+	int gone;
+
+	pthread_mutex_lock(&conf->mutex);
+	gone = (--node->refs == 0 && node->retired);
+	if (gone) {
+		node->next = conf->dead;
+		conf->dead = node;
+		pthread_cond_signal(&conf->topo_cond);
+	}
+	pthread_mutex_unlock(&conf->mutex);
+}
+
+/*
+ * CRC16 (XMODEM) of the key, or of its {hash tag}, as used by Redis
+ * Cluster to assign keys to slots.
+ */
+
+static int key_slot(const char *key)
+{
+	const char *s = key, *e;
+	unsigned int crc = 0;
+	size_t len = strlen(key);
+	int i;
+
+	if ((s = strchr(key, '{')) != NULL && (e = strchr(s + 1, '}')) != NULL && e > s + 1) {
+		key = s + 1;
+		len = e - key;
+	}
+
+	while (len--) {
+		crc ^= (unsigned char)*key++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return (crc & 0xffff) % CLUSTER_SLOTS;
+}
+
+/*
+ * Choose the node to read `key' from and take a reference on it. With
+ * read_from_replicas, two healthy replicas of the key's master are
+ * picked at random and the one with the lower round trip time wins,
+ * which spreads the load while steering it away from slow replicas.
+ * Falls back to the master.
+ */
+
+static struct redis_node *node_pick(struct redis_backend *conf, const char *key, int replicas)
+{
+	struct redis_node *master, *node, *cand[MAXNODES], *a, *b;
+	int n = 0;
+
+	pthread_mutex_lock(&conf->mutex);
+	if (conf->mode == REDIS_CLUSTER) {
+		master = conf->slots[key_slot(key)];
+		for (node = conf->nodes; master == NULL && node != NULL; node = node->next) {
+			if (!node->replica)
+				master = node;
+		}
+	} else {
+		master = conf->primary;
+	}
+
+	if (replicas && master != NULL) {
+		for (node = conf->nodes; node != NULL && n < MAXNODES; node = node->next) {
+			if (node->master == master && sv_healthy(node->sv))
+				cand[n++] = node;
+		}
+	}
+
+	node = master;
+	if (n == 1) {
+		node = cand[0];
+	} else if (n > 1) {
+		a = cand[rand_r(&conf->seed) % n];
+		b = cand[rand_r(&conf->seed) % n];
+		node = (a->rtt_ms <= b->rtt_ms) ? a : b;
+	}
+	if (node != NULL)
+		node->refs++;
+	pthread_mutex_unlock(&conf->mutex);
+
+	return (node);
+}
+
+/*
+ * Ask the topology thread to refresh the topology now, e.g. after a
+ * redirect or a lost connection.
+ */
+
+static void topo_kick(struct redis_backend *conf)
+{
+	if (conf->mode == REDIS_STANDALONE)
+		return;
+
+	pthread_mutex_lock(&conf->mutex);
+	conf->topo_stale = 1;
+	pthread_cond_signal(&conf->topo_cond);
+	pthread_mutex_unlock(&conf->mutex);
+}
+
+/*
+ * Check out a connection to the node serving `key', or to the node at
+ * `host':`port' if given. A replica whose pool is down is passed over
+ * for the master. The connection holds a reference on its node until
+ * conn_put(), and with check_deadline_ms its commands time out when
+ * the check's share of it runs out.
+ */
+
+static struct redis_conn *conn_get(struct redis_backend *conf, const char *key, const char *host, int port)
+{
+	struct redis_node *node;
+	struct redis_conn *rc = NULL;
+	struct timeval tv;
+	long ms;
+
+	if ((ms = backend_timeout(0)) < 0)
+		return (NULL);
+
+	if (host != NULL) {
+		pthread_mutex_lock(&conf->mutex);
+		if ((node = node_find(conf, host, port)) != NULL)
+			node->refs++;
+		pthread_mutex_unlock(&conf->mutex);
+	} else {
+		node = node_pick(conf, key, conf->read_replicas);
+	}
+
+	if (node != NULL && (rc = sv_checkout(node->sv)) == NULL && node->replica && host == NULL) {
+		node_release(conf, node);
+		if ((node = node_pick(conf, key, FALSE)) != NULL)
+			rc = sv_checkout(node->sv);
+	}
+
+	if (rc == NULL) {
+		if (node != NULL)
+			node_release(conf, node);
+		topo_kick(conf);
+	} else if (ms > 0) {
+		tv.tv_sec = ms / 1000;
+		tv.tv_usec = (ms % 1000) * 1000;
+		redisSetTimeout(rc->c, tv);
+	}
+	return (rc);
+}
+
+static void conn_put(struct redis_backend *conf, struct redis_conn *rc, int broken)
+{
+	struct redis_node *node = rc->node;
+	struct timeval forever = {0, 0};
+
+	if (backend_deadline_ms() > 0 && !broken)
+		redisSetTimeout(rc->c, forever);
+	sv_checkin(node->sv, rc, broken);
+	if (broken)
+		topo_kick(conf);
+	node_release(conf, node);
+}
+
+/*
+ * Make sure the data connection `rc' sends its tracking messages to its
+ * node's invalidation connection. Returns 1 if replies read on it may
+ * be cached.
+ */
+
+static int be_redis_track(struct redis_backend *conf, struct redis_conn *rc)
+{
+	redisReply *r;
+	long long id;
+	unsigned long gen;
+	int ok;
+
+	pthread_mutex_lock(&conf->mutex);
+	id = rc->node->inv_id;
+	gen = rc->node->inv_gen;
+	pthread_mutex_unlock(&conf->mutex);
+
+	if (id == 0)
+		return (0);
+	if (rc->track_gen == gen)
+		return (1);
+
+	r = redisCommand(rc->c, "CLIENT TRACKING on REDIRECT %lld", id);
+	ok = (r != NULL && r->type == REDIS_REPLY_STATUS);
+	if (r != NULL) {
+		if (!ok && r->type == REDIS_REPLY_ERROR)
+			_log(LOG_NOTICE, "[redis] CLIENT TRACKING failed: %s", r->str);
+		freeReplyObject(r);
+	}
+	if (ok)
+		rc->track_gen = gen;
+	return (ok);
+}
+
+/*
+ * Bring the node list in line with the `n' entries in `ents'. Nodes are
+ * created outside the mutex as that connects; only the topology thread
+ * (or init, before it runs) changes the list, so nobody else adds them
+ * meanwhile. In cluster mode `ranges' maps slots to entries.
+ */
 
-static int be_redis_reconnect(struct redis_backend *conf)
+static void topo_apply(struct redis_backend *conf, struct topo_ent *ents, int n, struct topo_range *ranges, int nranges)
 {
-	if (conf->redis != NULL) {
-		redisFree(conf->redis);
-		conf->redis = NULL;
+	struct redis_node *map[MAXNODES], *node, **pp, *dead = NULL;
+	int i, s, flush = 0;
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_lock(&conf->mutex);
+		node = node_find(conf, ents[i].host, ents[i].port);
+		pthread_mutex_unlock(&conf->mutex);
+
+		if (node == NULL && (node = node_new(conf, ents[i].host, ents[i].port, ents[i].master >= 0)) != NULL) {
+			pthread_mutex_lock(&conf->mutex);
+			node->next = conf->nodes;
+			conf->nodes = node;
+			pthread_mutex_unlock(&conf->mutex);
+		}
+		map[i] = node;
 	}
-	struct timeval timeout = {2, 500000};
-	//2.5 seconds
-		conf->redis = redisConnectWithTimeout(conf->host, conf->port, timeout);
-	if (conf->redis->err) {
-		_log(LOG_NOTICE, "Redis connection error: %s for %s:%d\n",
-		     conf->redis->errstr, conf->host, conf->port);
-		return 1;
+
+	pthread_mutex_lock(&conf->mutex);
+	for (i = 0; i < n; i++) {
+		if ((node = map[i]) == NULL)
+			continue;
+		node->seen = 1;
+		node->replica = (ents[i].master >= 0);
+		node->master = (node->replica) ? map[ents[i].master] : NULL;
 	}
-	if (strlen(conf->dbpass) > 0) {
-		_log(LOG_NOTICE, "Using password protected redis\n");
-		redisReply *r = redisCommand(conf->redis, "AUTH %s", conf->dbpass);
-		if (r == NULL || conf->redis->err != REDIS_OK) {
-			_log(LOG_NOTICE, "Redis authentication error: %s\n", conf->redis->errstr);
-			return 3;
+
+	if (conf->mode == REDIS_CLUSTER) {
+		memset(conf->slots, 0, sizeof(struct redis_node *) * CLUSTER_SLOTS);
+		for (i = 0; i < nranges; i++) {
+			for (s = ranges[i].start; s <= ranges[i].end && s < CLUSTER_SLOTS; s++)
+				conf->slots[s] = map[ranges[i].ent];
+		}
+	} else if (n > 0 && map[0] != NULL && conf->primary != map[0]) {
+		if (conf->primary != NULL)
+			_log(LOG_NOTICE, "[redis] master is now %s:%d", map[0]->host, map[0]->port);
+		conf->primary = map[0];
+	}
+
+	for (pp = &conf->nodes; (node = *pp) != NULL; ) {
+		if (node->seen) {
+			node->seen = 0;
+			pp = &node->next;
+			continue;
+		}
+		_log(LOG_NOTICE, "[redis] %s:%d left the topology", node->host, node->port);
+		*pp = node->next;
+		node->retired = 1;
+		if (node->inv_running)
+			flush = 1;
+		if (conf->primary == node)
+			conf->primary = NULL;
+		if (node->refs == 0) {
+			node->next = dead;
+			dead = node;
+		}
+	}
+	if (flush)
+		rc_invalidate(conf, NULL);
+	pthread_mutex_unlock(&conf->mutex);
+
+	while ((node = dead) != NULL) {
+		dead = node->next;
+		node_free(node);
+	}
+}
+
+/*
+ * Parse a comma-separated list of host:port into `ents', each with
+ * master index `master'. Returns the new number of entries.
+ */
+
+static int topo_parse(const char *list, int defport, struct topo_ent *ents, int n, int master)
+{
+	char *copy = strdup(list), *tok, *save, *colon;
+
+	for (tok = strtok_r(copy, ", ", &save); tok && n < MAXNODES; tok = strtok_r(NULL, ", ", &save)) {
+		ents[n].port = defport;
+		if ((colon = strrchr(tok, ':')) != NULL) {
+			*colon = 0;
+			ents[n].port = atoi(colon + 1);
+		}
+		snprintf(ents[n].host, sizeof(ents[n].host), "%s", tok);
+		ents[n].master = master;
+		n++;
+	}
+	free(copy);
+	return (n);
+}
+
+static int topo_addr(redisReply *ip, redisReply *port, struct topo_ent *ent)
+{
+	if (ip == NULL || ip->type != REDIS_REPLY_STRING || port == NULL)
+		return (0);
+	snprintf(ent->host, sizeof(ent->host), "%s", ip->str);
+	ent->port = (port->type == REDIS_REPLY_INTEGER) ? (int)port->integer :
+		(port->type == REDIS_REPLY_STRING) ? atoi(port->str) : 0;
+	return (ent->port > 0);
+}
+
+/*
+ * Ask the Sentinels for the current master and, when reading from
+ * replicas, for its replicas which are up. Returns 1 on success.
+ */
+
+static int topo_sentinel(struct redis_backend *conf)
+{
+	struct topo_ent sents[MAXNODES], ents[MAXNODES];
+	struct timeval timeout = {1, 0};
+	redisContext *redis;
+	redisReply *r, *e;
+	const char *ip, *port, *flags;
+	int nsent, i, n = 0;
+	size_t j, k;
+
+	nsent = topo_parse(conf->sentinels, 26379, sents, 0, -1);
+
+	for (i = 0; i < nsent && n == 0; i++) {
+		redis = redisConnectWithTimeout(sents[i].host, sents[i].port, timeout);
+		if (redis == NULL || redis->err) {
+			_log(LOG_NOTICE, "[redis] sentinel %s:%d unreachable", sents[i].host, sents[i].port);
+			if (redis != NULL)
+				redisFree(redis);
+			continue;
+		}
+		redisSetTimeout(redis, timeout);
+		if (conf->sentinel_pass != NULL) {
+			if ((r = redisCommand(redis, "AUTH %s", conf->sentinel_pass)) != NULL)
+				freeReplyObject(r);
+		}
+
+		r = redisCommand(redis, "SENTINEL get-master-addr-by-name %s", conf->sentinel_master);
+		if (r != NULL && r->type == REDIS_REPLY_ARRAY && r->elements == 2 &&
+		    topo_addr(r->element[0], r->element[1], &ents[0])) {
+			ents[0].master = -1;
+			n = 1;
+		}
+		if (r != NULL)
+			freeReplyObject(r);
+
+		if (n == 1 && conf->read_replicas) {
+			r = redisCommand(redis, "SENTINEL replicas %s", conf->sentinel_master);
+			if (r != NULL && r->type == REDIS_REPLY_ERROR) {
+				freeReplyObject(r);
+				r = redisCommand(redis, "SENTINEL slaves %s", conf->sentinel_master);
+			}
+			for (j = 0; r != NULL && r->type == REDIS_REPLY_ARRAY && j < r->elements && n < MAXNODES; j++) {
+				e = r->element[j];
+				ip = port = flags = NULL;
+				for (k = 0; e->type == REDIS_REPLY_ARRAY && k + 1 < e->elements; k += 2) {
+					if (e->element[k]->str == NULL)
+						continue;
+					if (!strcmp(e->element[k]->str, "ip"))
+						ip = e->element[k + 1]->str;
+					else if (!strcmp(e->element[k]->str, "port"))
+						port = e->element[k + 1]->str;
+					else if (!strcmp(e->element[k]->str, "flags"))
+						flags = e->element[k + 1]->str;
+				}
+				if (ip == NULL || port == NULL || (flags != NULL &&
+				    (strstr(flags, "s_down") || strstr(flags, "o_down") || strstr(flags, "disconnected"))))
+					continue;
+				snprintf(ents[n].host, sizeof(ents[n].host), "%s", ip);
+				ents[n].port = atoi(port);
+				ents[n].master = 0;
+				n++;
+			}
+			if (r != NULL)
+				freeReplyObject(r);
+		}
+		redisFree(redis);
+	}
+
+	if (n == 0) {
+		_log(LOG_NOTICE, "[redis] no sentinel knows master %s", conf->sentinel_master);
+		return (0);
+	}
+	topo_apply(conf, ents, n, NULL, 0);
+	return (1);
+}
+
+/*
+ * Read the slot map with CLUSTER SLOTS from the first node which
+ * answers, starting with the configured seed. Returns 1 on success.
+ */
+
+static int topo_cluster(struct redis_backend *conf)
+{
+	struct topo_ent seeds[MAXNODES], ents[MAXNODES];
+	struct topo_range *ranges = NULL;
+	struct redis_node *node;
+	redisContext *redis;
+	redisReply *r = NULL, *e;
+	int nseeds, nranges = 0, n = 0, i, m, x, full = 0;
+	size_t j, k;
+
+	nseeds = topo_parse(conf->host, conf->port, seeds, 0, -1);
+	pthread_mutex_lock(&conf->mutex);
+	for (node = conf->nodes; node != NULL && nseeds < MAXNODES; node = node->next) {
+		snprintf(seeds[nseeds].host, sizeof(seeds[nseeds].host), "%s", node->host);
+		seeds[nseeds++].port = node->port;
+	}
+	pthread_mutex_unlock(&conf->mutex);
+
+	for (i = 0; i < nseeds && r == NULL; i++) {
+		if ((redis = be_redis_open(conf, seeds[i].host, seeds[i].port, FALSE)) == NULL)
+			continue;
+		r = redisCommand(redis, "CLUSTER SLOTS");
+		if (r != NULL && r->type != REDIS_REPLY_ARRAY) {
+			_log(LOG_NOTICE, "[redis] CLUSTER SLOTS on %s:%d failed: %s",
+				seeds[i].host, seeds[i].port, r->str ? r->str : "?");
+			freeReplyObject(r);
+			r = NULL;
+		}
+		redisFree(redis);
+		if (r == NULL)
+			continue;
+
+		/* At most one range per element */
+		if ((ranges = (struct topo_range *)calloc(r->elements, sizeof(struct topo_range))) == NULL) {
+			freeReplyObject(r);
+			break;
+		}
+		for (j = 0; j < r->elements && !full; j++) {
+			e = r->element[j];
+			if (e->type != REDIS_REPLY_ARRAY || e->elements < 3)
+				continue;
+
+			/* Master, then its replicas */
+			for (m = -1, k = 2; k < e->elements; k++) {
+				struct topo_ent ent;
+
+				if (e->element[k]->type != REDIS_REPLY_ARRAY || e->element[k]->elements < 2 ||
+				    !topo_addr(e->element[k]->element[0], e->element[k]->element[1], &ent))
+					continue;
+				if (!*ent.host)
+					snprintf(ent.host, sizeof(ent.host), "%s", seeds[i].host);
+				if (k > 2 && !conf->read_replicas)
+					break;
+				for (x = 0; x < n; x++) {
+					if (ents[x].port == ent.port && !strcmp(ents[x].host, ent.host))
+						break;
+				}
+				if (x == n && n == MAXNODES) {
+					if (k == 2)
+						full = 1;
+					break;
+				}
+				if (x == n) {
+					ent.master = m;
+					ents[n++] = ent;
+				}
+				if (k == 2)
+					m = x;
+			}
+			if (m >= 0) {
+				ranges[nranges].start = (int)e->element[0]->integer;
+				ranges[nranges].end = (int)e->element[1]->integer;
+				ranges[nranges].ent = m;
+				nranges++;
+			}
 		}
 		freeReplyObject(r);
+		break;
+	}
+
+	if (full) {
+		_log(LOG_NOTICE, "[redis] cluster has more than %d nodes, keeping the old slot map", MAXNODES);
+		free(ranges);
+		return (0);
+	}
+	if (nranges == 0) {
+		_log(LOG_NOTICE, "[redis] cannot read cluster slot map");
+		free(ranges);
+		return (0);
+	}
+	topo_apply(conf, ents, n, ranges, nranges);
+	free(ranges);
+	return (1);
+}
+
+static int topo_refresh(struct redis_backend *conf)
+{
+	return (conf->mode == REDIS_CLUSTER) ? topo_cluster(conf) : topo_sentinel(conf);
+}
+
+/*
+ * Topology thread: re-reads the topology every redis_topology_seconds,
+ * or at once when a lookup saw a redirect or a lost connection. It also
+ * frees the retired nodes node_release() leaves on conf->dead.
+ */
+
+static void *be_redis_topology(void *arg)
+{
+	struct redis_backend *conf = (struct redis_backend *)arg;
+	struct redis_node *dead, *node;
+	long last = now_ms(), left;
+
+	pthread_mutex_lock(&conf->mutex);
+	while (conf->running) {
+		left = conf->topology_ms - (now_ms() - last);
+		if (!conf->topo_stale && conf->dead == NULL && left > 0)
+			timed_wait(&conf->topo_cond, &conf->mutex, left);
+		if (!conf->running)
+			break;
+
+		if ((dead = conf->dead) != NULL) {
+			conf->dead = NULL;
+			pthread_mutex_unlock(&conf->mutex);
+			while ((node = dead) != NULL) {
+				dead = node->next;
+				node_free(node);
+			}
+			pthread_mutex_lock(&conf->mutex);
+		}
+		if (!conf->topo_stale && now_ms() - last < conf->topology_ms)
+			continue;
+
+		/* Don't let a flood of redirects hammer the servers */
+		if (conf->topo_stale && now_ms() - last < 500) {
+			timed_wait(&conf->topo_cond, &conf->mutex, 500);
+			if (!conf->running)
+				break;
+		}
+		conf->topo_stale = 0;
+		pthread_mutex_unlock(&conf->mutex);
+
+		topo_refresh(conf);
+		last = now_ms();
+
+		pthread_mutex_lock(&conf->mutex);
+	}
+	pthread_mutex_unlock(&conf->mutex);
+
+	return (NULL);
+}
+
+/*
+ * Send one command to the node serving its key (argv[1]) and return the
+ * reply. MOVED and ASK redirections are followed once; MOVED also
+ * triggers a topology refresh. With `track' set, *tracked tells whether
+ * the reply was read with invalidation tracking in place. Returns NULL
+ * if no node could be used.
+ */
+
+static redisReply *be_redis_command(struct redis_backend *conf, int argc, const char **argv, int track, int *tracked)
+{
+	struct redis_conn *rc;
+	redisReply *r = NULL, *a;
+	char host[256], *colon;
+	int port = 0, asking = 0, attempt, slot;
+	long t0;
+
+	*tracked = 0;
+	for (attempt = 0; attempt < 2; attempt++) {
+		rc = conn_get(conf, argc > 1 ? argv[1] : "", (port) ? host : NULL, port);
+		if (rc == NULL)
+			return (NULL);
+
+		*tracked = track && be_redis_track(conf, rc);
+
+		t0 = now_ms();
+		if (asking) {
+			redisAppendCommand(rc->c, "ASKING");
+			redisAppendCommandArgv(rc->c, argc, argv, NULL);
+			if (redisGetReply(rc->c, (void **)&a) == REDIS_OK && a != NULL)
+				freeReplyObject(a);
+			if (redisGetReply(rc->c, (void **)&r) != REDIS_OK)
+				r = NULL;
+		} else {
+			r = redisCommandArgv(rc->c, argc, argv, NULL);
+		}
+
+		if (r == NULL || rc->c->err != REDIS_OK) {
+			if (r != NULL)
+				freeReplyObject(r);
+			conn_put(conf, rc, TRUE);
+			return (NULL);
+		}
+		rtt_update(rc->node, now_ms() - t0);
+
+		if (r->type == REDIS_REPLY_ERROR && r->str != NULL &&
+		    (!strncmp(r->str, "MOVED ", 6) || !strncmp(r->str, "ASK ", 4)) &&
+		    sscanf(strchr(r->str, ' ') + 1, "%d %255s", &slot, host) == 2 &&
+		    (colon = strrchr(host, ':')) != NULL) {
+			*colon = 0;
+			port = atoi(colon + 1);
+			asking = (r->str[1] == 'S');
+			if (!asking)
+				topo_kick(conf);
+			_log(LOG_DEBUG, "[redis] %s redirected to %s:%d", argv[1], host, port);
+			freeReplyObject(r);
+			r = NULL;
+			conn_put(conf, rc, FALSE);
+			continue;
+		}
+
+		conn_put(conf, rc, FALSE);
+		break;
+	}
+	return (r);
+}
+
+/*
+ * Split the configured query `fmt' on blanks into an argument vector,
+ * substituting each %s with the next of `a1', `a2'. Arguments are passed
+ * to Redis as-is, so user names containing blanks or `%' cannot alter
+ * the command. Returns the number of arguments; the caller frees them.
+ */
+
+static int be_redis_argv(const char *fmt, const char *a1, const char *a2, char **argv)
+{
+	const char *subst[2] = { a1, a2 };
+	const char *s, *e, *p;
+	int argc = 0, nsubst = 0;
+	size_t len;
+	char *arg;
+
+	for (s = fmt; *s && argc < MAXARGS; s = e) {
+		while (*s == ' ' || *s == '\t')
+			s++;
+		if (!*s)
+			break;
+		for (e = s; *e && *e != ' ' && *e != '\t'; e++)
+			;
+
+		len = e - s + 1 + (a1 ? strlen(a1) : 0) + (a2 ? strlen(a2) : 0);
+		arg = argv[argc++] = (char *)malloc(len);
+		for (p = s; p < e; p++) {
+			if (p[0] == '%' && p + 1 < e && p[1] == 's' && nsubst < 2) {
+				strcpy(arg, subst[nsubst] ? subst[nsubst] : "");
+				arg += strlen(arg);
+				nsubst++;
+				p++;
+			} else if (p[0] == '%' && p + 1 < e && p[1] == '%') {
+				*arg++ = '%';
+				p++;
+			} else {
+				*arg++ = *p;
+			}
+		}
+		*arg = 0;
+	}
+	return (argc);
+}
+
+/*
+ * Only single-key reads whose first argument is the key are cached;
+ * for anything else the key named in an invalidation couldn't be
+ * matched to the cached reply.
+ */
+
+static int be_redis_cacheable(int argc, char **argv)
+{
+	return (argc >= 2 && (!strcasecmp(argv[0], "GET") || !strcasecmp(argv[0], "HGET")));
+}
+
+/*
+ * Run the command in `argv' and return its string reply in *value, or
+ * NULL if the reply was nil or not a string. Served from the client
+ * cache when possible. Returns BACKEND_ERROR if no connection could be
+ * used, else BACKEND_DEFER.
+ */
+
+static int be_redis_get(struct redis_backend *conf, int argc, char **argv, char **value)
+{
+	redisReply *r;
+	char cmd[1024], *p;
+	unsigned long seq = 0;
+	int n, cache, tracked;
+
+	*value = NULL;
+
+	cache = conf->client_cache && be_redis_cacheable(argc, argv);
+	if (cache) {
+		for (n = 0, p = cmd; n < argc; n++) {
+			if (p + strlen(argv[n]) + 2 > cmd + sizeof(cmd)) {
+				cache = 0;
+				break;
+			}
+			p += sprintf(p, "%s%s", n ? "\x1f" : "", argv[n]);
+		}
+	}
+
+	if (cache) {
+		pthread_mutex_lock(&conf->mutex);
+		n = rc_get(conf, argv[1], cmd, value);
+		seq = conf->rc_seq;
+		pthread_mutex_unlock(&conf->mutex);
+		if (n) {
+			_log(LOG_DEBUG, "[redis] client cache hit for %s", argv[1]);
+			return BACKEND_DEFER;
+		}
 	}
-	redisReply *r = redisCommand(conf->redis, "SELECT %i", conf->db);
-	if (r == NULL || conf->redis->err != REDIS_OK) {
-		return 2;
+
+	if ((r = be_redis_command(conf, argc, (const char **)argv, cache, &tracked)) == NULL)
+		return BACKEND_ERROR;
+
+	if (r->type == REDIS_REPLY_STRING) {
+		*value = strdup(r->str);
+	} else if (r->type != REDIS_REPLY_NIL) {
+		tracked = 0;
 	}
 	freeReplyObject(r);
 
-	return 0;
+	/*
+	 * An invalidation processed since the lookup above may concern the
+	 * reply we just read; don't cache it in that case.
+	 */
+
+	if (cache && tracked) {
+		pthread_mutex_lock(&conf->mutex);
+		if (conf->rc_seq == seq)
+			rc_put(conf, argv[1], cmd, *value);
+		pthread_mutex_unlock(&conf->mutex);
+	}
+
+	return BACKEND_DEFER;
+}
+
+/*
+ * Turn an HGETALL reply into `r', or NULL if the key doesn't hold a
+ * hash. Returns -1 if the reply is a redirect the caller couldn't
+ * follow, which must not be mistaken for a missing user.
+ */
+
+static int rs_hash(redisReply **r)
+{
+	if (*r != NULL && (*r)->type == REDIS_REPLY_ERROR && (*r)->str != NULL &&
+	    (!strncmp((*r)->str, "MOVED ", 6) || !strncmp((*r)->str, "ASK ", 4))) {
+		freeReplyObject(*r);
+		*r = NULL;
+		return (-1);
+	}
+	if (*r != NULL && (*r)->type != REDIS_REPLY_ARRAY) {
+		freeReplyObject(*r);
+		*r = NULL;
+	}
+	return (0);
+}
+
+/*
+ * Fetch and compile the record for `username'. The user hash and the
+ * default ACL hash are requested in one pipelined round trip; only a
+ * user whose `acl' field names another hash costs a second one. In
+ * cluster mode the two keys may live on different nodes, so they are
+ * routed separately. Returns BACKEND_ERROR if Redis could not be used.
+ */
+
+static int rs_fetch(struct redis_backend *conf, const char *username, struct rs_user **pu, int *tracked)
+{
+	struct redis_conn *rc = NULL;
+	struct rs_user *u;
+	redisReply *ru = NULL, *ra = NULL;
+	char *ukey, *akey;
+	const char *argv[2];
+	size_t n;
+	int track = conf->client_cache, t, rv = BACKEND_ERROR, broken = FALSE;
+
+	ukey = malloc(strlen(conf->user_prefix) + strlen(username) + 1);
+	sprintf(ukey, "%s%s", conf->user_prefix, username);
+	akey = malloc(strlen(conf->acl_prefix) + strlen(username) + 1);
+	sprintf(akey, "%s%s", conf->acl_prefix, username);
+
+	argv[0] = "HGETALL";
+	if (conf->mode == REDIS_CLUSTER) {
+		argv[1] = ukey;
+		if ((ru = be_redis_command(conf, 2, argv, track, tracked)) == NULL)
+			goto out;
+		argv[1] = akey;
+		if ((ra = be_redis_command(conf, 2, argv, track, &t)) == NULL)
+			goto out;
+		*tracked = *tracked && t;
+	} else {
+		if ((rc = conn_get(conf, ukey, NULL, 0)) == NULL)
+			goto out;
+		*tracked = track && be_redis_track(conf, rc);
+
+		argv[1] = ukey;
+		redisAppendCommandArgv(rc->c, 2, argv, NULL);
+		argv[1] = akey;
+		redisAppendCommandArgv(rc->c, 2, argv, NULL);
+		if (redisGetReply(rc->c, (void **)&ru) != REDIS_OK ||
+		    redisGetReply(rc->c, (void **)&ra) != REDIS_OK) {
+			broken = TRUE;
+			goto out;
+		}
+	}
+	if (rs_hash(&ru) || rs_hash(&ra))
+		goto out;
+
+	u = (struct rs_user *)malloc(sizeof(struct rs_user));
+	memset(u, 0, sizeof(struct rs_user));
+	u->name = strdup(username);
+	u->exists = (ru != NULL && ru->elements > 0);
+
+	for (n = 0; ru != NULL && n + 1 < ru->elements; n += 2) {
+		const char *f = ru->element[n]->str, *v = ru->element[n + 1]->str;
+
+		if (f == NULL || v == NULL)
+			continue;
+		if (!strcmp(f, "pwhash")) {
+			free(u->pwhash);
+			u->pwhash = strdup(v);
+		} else if (!strcmp(f, "superuser")) {
+			u->superuser = (!strcmp(v, "1") || !strcmp(v, "true"));
+		} else if (!strcmp(f, "acl")) {
+			free(u->aclkey);
+			u->aclkey = strdup(v);
+		}
+	}
+
+	if (u->aclkey != NULL && strcmp(u->aclkey, akey) != 0) {
+		if (ra != NULL)
+			freeReplyObject(ra);
+		argv[1] = u->aclkey;
+		if (rc != NULL) {
+			ra = redisCommandArgv(rc->c, 2, argv, NULL);
+			broken = (rc->c->err != REDIS_OK);
+		} else {
+			ra = be_redis_command(conf, 2, argv, track, &t);
+			broken = (ra == NULL);
+			*tracked = *tracked && t;
+		}
+		if (broken || rs_hash(&ra)) {
+			rs_free(u);
+			goto out;
+		}
+	} else if (u->aclkey == NULL) {
+		u->aclkey = strdup(akey);
+	}
+
+	if (ra != NULL && ra->elements > 1) {
+		u->acl = (struct backend_rule *)malloc(sizeof(struct backend_rule) * (ra->elements / 2));
+		for (n = 0; n + 1 < ra->elements; n += 2) {
+			if (ra->element[n]->str == NULL || ra->element[n + 1]->str == NULL)
+				continue;
+			u->acl[u->nacl].pattern = strdup(ra->element[n]->str);
+			u->acl[u->nacl].mask = atoi(ra->element[n + 1]->str);
+			u->nacl++;
+		}
+	}
+	*pu = u;
+	rv = BACKEND_DEFER;
+
+    out:
+	if (ru != NULL)
+		freeReplyObject(ru);
+	if (ra != NULL)
+		freeReplyObject(ra);
+	free(ukey);
+	free(akey);
+	if (rc != NULL)
+		conn_put(conf, rc, broken);
+
+	return (rv);
+}
+
+/*
+ * Return the record for `username' with a reference held, which the
+ * caller drops with rs_release(). A freshly fetched record is also put
+ * in the cache, unless an invalidation raced with the fetch. The mutex
+ * is never held on return, so the record is read without it.
+ */
+
+static struct rs_user *rs_lookup(struct redis_backend *conf, const char *username, int *rc)
+{
+	struct rs_user *u;
+	unsigned long seq;
+	int tracked;
+	time_t now = time(NULL);
+
+	*rc = BACKEND_DEFER;
+
+	pthread_mutex_lock(&conf->mutex);
+	HASH_FIND_STR(conf->users, username, u);
+	if (u != NULL && u->expires && now > u->expires) {
+		rs_drop(conf, u);
+		u = NULL;
+	}
+	if (u != NULL) {
+		u->refs++;
+		pthread_mutex_unlock(&conf->mutex);
+		return (u);
+	}
+	seq = conf->rc_seq;
+	pthread_mutex_unlock(&conf->mutex);
+
+	u = NULL;
+	if ((*rc = rs_fetch(conf, username, &u, &tracked)) != BACKEND_DEFER)
+		return (NULL);
+	u->refs = 1;
+
+	pthread_mutex_lock(&conf->mutex);
+	if (conf->rc_seq == seq && (tracked || conf->schema_cacheseconds > 0)) {
+		u->expires = (tracked) ? 0 : now + conf->schema_cacheseconds;
+		while (conf->rs_count >= conf->rc_max && conf->users != NULL)
+			rs_drop(conf, conf->users);
+		u->refs++;
+		HASH_ADD_KEYPTR(hh, conf->users, u->name, strlen(u->name), u);
+		conf->rs_count++;
+	}
+	pthread_mutex_unlock(&conf->mutex);
+
+	return (u);
+}
+
+static void rs_release(struct redis_backend *conf, struct rs_user *u)
+{
+	pthread_mutex_lock(&conf->mutex);
+	rs_unref(u);
+	pthread_mutex_unlock(&conf->mutex);
+}
+
+static int rs_getuser(struct redis_backend *conf, const char *username, char **phash)
+{
+	struct rs_user *u;
+	int rc;
+
+	if ((u = rs_lookup(conf, username, &rc)) == NULL)
+		return (rc);
+	if (u->pwhash != NULL)
+		*phash = strdup(u->pwhash);
+	rs_release(conf, u);
+
+	return BACKEND_DEFER;
+}
+
+static int rs_superuser(struct redis_backend *conf, const char *username)
+{
+	struct rs_user *u;
+	int rc;
+
+	if ((u = rs_lookup(conf, username, &rc)) == NULL)
+		return (rc);
+	rc = (u->superuser) ? BACKEND_ALLOW : BACKEND_DEFER;
+	rs_release(conf, u);
+
+	return (rc);
+}
+
+/*
+ * Grant `acc' if any of the user's patterns matches `topic' with a mask
+ * containing all of the requested access bits.
+ */
+
+static int rs_aclcheck(struct redis_backend *conf, const char *clientid, const char *username, const char *topic, int acc)
+{
+	struct rs_user *u;
+	int rc;
+
+	if ((u = rs_lookup(conf, username, &rc)) == NULL)
+		return (rc);
+
+	rc = backend_rules_aclcheck("redis", u->acl, u->nacl, clientid, username, topic, acc);
+	rs_release(conf, u);
+
+	return (rc);
 }
 
 void *be_redis_init()
 {
 	struct redis_backend *conf;
+	struct topo_ent ents[MAXNODES];
 	char *host, *p, *db, *userquery, *password, *aclquery;
+	int n, ok;
 
 	_log(LOG_DEBUG, "}}}} Redis");
 
@@ -95,8 +1622,8 @@ void *be_redis_init()
 		db = "0";
 	if ((password = p_stab("redis_pass")) == NULL)
 		password = "";
-	if ((userquery = p_stab("redis_userquery")) == NULL) {
-		userquery = "";
+	if ((userquery = p_stab("redis_userquery")) == NULL || !*userquery) {
+		userquery = "GET %s";
 	}
 	if ((aclquery = p_stab("redis_aclquery")) == NULL) {
 		aclquery = "";
@@ -104,6 +1631,7 @@ void *be_redis_init()
 	conf = (struct redis_backend *)malloc(sizeof(struct redis_backend));
 	if (conf == NULL)
 		_fatal("Out of memory");
+	memset(conf, 0, sizeof(struct redis_backend));
 
 	conf->host = strdup(host);
 	conf->port = atoi(p);
@@ -112,14 +1640,76 @@ void *be_redis_init()
 	conf->userquery = strdup(userquery);
 	conf->aclquery = strdup(aclquery);
 
-	conf->redis = NULL;
+	p = p_stab("redis_schema");
+	conf->schema = (p && (!strcmp(p, "true") || !strcmp(p, "1")));
+	if ((p = p_stab("redis_user_prefix")) == NULL)
+		p = "user:";
+	conf->user_prefix = strdup(p);
+	if ((p = p_stab("redis_acl_prefix")) == NULL)
+		p = "acl:";
+	conf->acl_prefix = strdup(p);
+	conf->schema_cacheseconds = ((p = p_stab("redis_schema_cacheseconds")) != NULL) ? atol(p) : 30;
 
-	if (be_redis_reconnect(conf)) {
-		free(conf->host);
-		free(conf->userquery);
-		free(conf->dbpass);
-		free(conf->aclquery);
-		free(conf);
+	p = p_stab("redis_client_cache");
+	conf->client_cache = (p && (!strcmp(p, "true") || !strcmp(p, "1")));
+	conf->rc_max = ((p = p_stab("redis_client_cache_size")) != NULL) ? atol(p) : 10000;
+	if (conf->rc_max <= 0) {
+		conf->client_cache = 0;
+		conf->schema_cacheseconds = 0;
+	}
+
+	/*
+	 * Topology: a single server, optionally with static replicas, a
+	 * master found through Sentinel, or a cluster seeded by redis_host.
+	 */
+
+	p = p_stab("redis_read_from_replicas");
+	conf->read_replicas = (p && (!strcmp(p, "true") || !strcmp(p, "1")));
+	conf->sentinels = ((p = p_stab("redis_sentinels")) != NULL) ? strdup(p) : NULL;
+	conf->sentinel_master = strdup(((p = p_stab("redis_sentinel_master")) != NULL) ? p : "mymaster");
+	conf->sentinel_pass = ((p = p_stab("redis_sentinel_pass")) != NULL) ? strdup(p) : NULL;
+	conf->replicas = ((p = p_stab("redis_replicas")) != NULL) ? strdup(p) : NULL;
+	conf->topology_ms = (((p = p_stab("redis_topology_seconds")) != NULL) ? atol(p) : 10) * 1000L;
+	if (conf->topology_ms <= 0)
+		conf->topology_ms = 10000;
+	p = p_stab("redis_cluster");
+	if (p && (!strcmp(p, "true") || !strcmp(p, "1")))
+		conf->mode = REDIS_CLUSTER;
+	else if (conf->sentinels != NULL)
+		conf->mode = REDIS_SENTINEL;
+	conf->seed = (unsigned int)time(NULL);
+
+	pthread_mutex_init(&conf->mutex, NULL);
+	pthread_cond_init(&conf->cond, NULL);
+	pthread_cond_init(&conf->topo_cond, NULL);
+
+	if (conf->mode == REDIS_CLUSTER) {
+		conf->slots = (struct redis_node **)calloc(CLUSTER_SLOTS, sizeof(struct redis_node *));
+		ok = topo_cluster(conf);
+	} else if (conf->mode == REDIS_SENTINEL) {
+		ok = topo_sentinel(conf) && conf->primary != NULL && sv_healthy(conf->primary->sv);
+	} else {
+		snprintf(ents[0].host, sizeof(ents[0].host), "%s", conf->host);
+		ents[0].port = conf->port;
+		ents[0].master = -1;
+		n = 1;
+		if (conf->read_replicas && conf->replicas != NULL)
+			n = topo_parse(conf->replicas, 6379, ents, n, 0);
+		topo_apply(conf, ents, n, NULL, 0);
+		ok = conf->primary != NULL && sv_healthy(conf->primary->sv);
+	}
+
+	if (ok && conf->mode != REDIS_STANDALONE) {
+		conf->running = 1;
+		if (pthread_create(&conf->topo_thread, NULL, be_redis_topology, conf) != 0) {
+			_log(LOG_NOTICE, "[redis] cannot start topology thread: %s", strerror(errno));
+			conf->running = 0;
+			ok = 0;
+		}
+	}
+
+	if (!ok) {
+		be_redis_destroy(conf);
 		return (NULL);
 	}
 	return (conf);
@@ -128,10 +1718,39 @@ void *be_redis_init()
 void be_redis_destroy(void *handle)
 {
 	struct redis_backend *conf = (struct redis_backend *)handle;
+	struct redis_node *node;
 
 	if (conf != NULL) {
-		redisFree(conf->redis);
-		conf->redis = NULL;
+		if (conf->running) {
+			pthread_mutex_lock(&conf->mutex);
+			conf->running = 0;
+			pthread_cond_broadcast(&conf->topo_cond);
+			pthread_mutex_unlock(&conf->mutex);
+			pthread_join(conf->topo_thread, NULL);
+		}
+		while ((node = conf->nodes) != NULL) {
+			conf->nodes = node->next;
+			node_free(node);
+		}
+		while ((node = conf->dead) != NULL) {
+			conf->dead = node->next;
+			node_free(node);
+		}
+		rc_invalidate(conf, NULL);
+		pthread_cond_destroy(&conf->topo_cond);
+		pthread_cond_destroy(&conf->cond);
+		pthread_mutex_destroy(&conf->mutex);
+		free(conf->slots);
+		free(conf->host);
+		free(conf->userquery);
+		free(conf->dbpass);
+		free(conf->aclquery);
+		free(conf->user_prefix);
+		free(conf->acl_prefix);
+		free(conf->sentinels);
+		free(conf->sentinel_master);
+		free(conf->sentinel_pass);
+		free(conf->replicas);
 		free(conf);
 	}
 }
@@ -139,70 +1758,63 @@ void be_redis_destroy(void *handle)
 int be_redis_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct redis_backend *conf = (struct redis_backend *)handle;
+	char *argv[MAXARGS];
+	int argc, rc;
 
-	redisReply *r;
-	char *pwhash = NULL;
-
-	if (conf == NULL || conf->redis == NULL || username == NULL)
+	if (conf == NULL || username == NULL)
 		return BACKEND_DEFER;
 
-	if (strlen(conf->userquery) == 0) {
-		conf->userquery = "GET %s";
-	}
-	char *query = malloc(strlen(conf->userquery) + strlen(username) + 128);
-	sprintf(query, conf->userquery, username);
-
-	r = redisCommand(conf->redis, query);
-	if (r == NULL || conf->redis->err != REDIS_OK) {
-		be_redis_reconnect(conf);
-		return BACKEND_ERROR;
-	}
-	free(query);
+	if (conf->schema)
+		return rs_getuser(conf, username, phash);
 
-	if (r->type == REDIS_REPLY_STRING) {
-		pwhash = strdup(r->str);
-	}
-	freeReplyObject(r);
+	argc = be_redis_argv(conf->userquery, username, NULL, argv);
+	rc = be_redis_get(conf, argc, argv, phash);
+	while (argc > 0)
+		free(argv[--argc]);
 
-	*phash = pwhash;
-	return BACKEND_DEFER;
+	return (rc);
 }
 
-int be_redis_superuser(void *conf, const char *username)
+int be_redis_superuser(void *handle, const char *username)
 {
-	return BACKEND_DEFER;
+	struct redis_backend *conf = (struct redis_backend *)handle;
+
+	if (conf == NULL || username == NULL || !conf->schema)
+		return BACKEND_DEFER;
+
+	return rs_superuser(conf, username);
 }
 
 int be_redis_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct redis_backend *conf = (struct redis_backend *)handle;
+	char *argv[MAXARGS], *value = NULL;
+	int argc, rc;
 
-	redisReply *r;
-
-	if (conf == NULL || conf->redis == NULL || username == NULL)
+	if (conf == NULL || username == NULL)
 		return BACKEND_DEFER;
 
+	if (conf->schema)
+		return rs_aclcheck(conf, clientid, username, topic, acc);
+
 	if (strlen(conf->aclquery) == 0) {
 		return BACKEND_ALLOW;
 	}
-	char *query = malloc(strlen(conf->aclquery) + strlen(username) + strlen(topic) + 128);
-	sprintf(query, conf->aclquery, username, topic);
-
 
-	r = redisCommand(conf->redis, query, username, acc);
-	if (r == NULL || conf->redis->err != REDIS_OK) {
-		be_redis_reconnect(conf);
-		return BACKEND_ERROR;
-	}
-	free(query);
+	argc = be_redis_argv(conf->aclquery, username, topic, argv);
+	rc = be_redis_get(conf, argc, argv, &value);
+	while (argc > 0)
+		free(argv[--argc]);
+	if (rc != BACKEND_DEFER)
+		return (rc);
 
 	int answer = 0;
-	if (r->type == REDIS_REPLY_STRING) {
-		int x = atoi(r->str);
+	if (value != NULL) {
+		int x = atoi(value);
 		if (x >= acc)
 			answer = 1;
+		free(value);
 	}
-	freeReplyObject(r);
 	return (answer) ? BACKEND_ALLOW : BACKEND_DEFER;
 }
 #endif /* BE_REDIS */
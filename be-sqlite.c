@@ -37,23 +37,185 @@
 #include "be-sqlite.h"
 #include "hash.h"
 #include "log.h"
+#include "watch.h"
 #include <mosquitto.h>
 
-static bool prepareStatement(struct sqlite_backend *conf)
+/*
+ * An open database with its statements. Lookups hold a reference while
+ * they use it, so that a reload can swap in a new one and the old one is
+ * closed when the last lookup is done with it.
+ */
+
+struct sqlite_db {
+	pthread_mutex_t lock;		/* Serializes use of sq and the statements */
+	int refs;			/* Protected by the back-end's lock */
+	sqlite3 *sq;
+	sqlite3_stmt *stmt;		/* sqliteuserquery */
+	sqlite3_stmt *superstmt;	/* sqlitesuperquery, or NULL */
+	sqlite3_stmt *aclstmt;		/* sqliteaclquery, or NULL */
+};
+
+/*
+ * Statements are prepared once and kept for the life of the back-end;
+ * SQLITE_PREPARE_PERSISTENT tells SQLite to allocate them accordingly.
+ */
+
+static sqlite3_stmt *prepareStatement(struct sqlite_db *db, const char *query)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc;
+
+#if SQLITE_VERSION_NUMBER >= 3020000
+	rc = sqlite3_prepare_v3(db->sq, query, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+#else
+	rc = sqlite3_prepare_v2(db->sq, query, -1, &stmt, NULL);
+#endif
+	if (rc != SQLITE_OK) {
+		_log(MOSQ_LOG_WARNING, "Can't prepare `%s': %s\n", query, sqlite3_errmsg(db->sq));
+		return (NULL);
+	}
+	return (stmt);
+}
+
+static void pragma(struct sqlite_db *db, const char *fmt, long value)
+{
+	char sql[128];
+	char *err = NULL;
+
+	snprintf(sql, sizeof(sql), fmt, value);
+	if (sqlite3_exec(db->sq, sql, NULL, NULL, &err) != SQLITE_OK) {
+		_log(MOSQ_LOG_WARNING, "sqlite: %s: %s", sql, err);
+		sqlite3_free(err);
+	}
+}
+
+/*
+ * Bind the username to ?1 and, if the statement has a second parameter,
+ * the requested access to ?2, then step to the first row. The caller
+ * holds db->lock and resets the statement when done with the row.
+ */
+
+static int run(struct sqlite_db *db, sqlite3_stmt *stmt, const char *username, int acc)
+{
+	int res;
+
+	sqlite3_reset(stmt);
+	if ((res = sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC)) == SQLITE_OK &&
+	    sqlite3_bind_parameter_count(stmt) >= 2)
+		res = sqlite3_bind_int(stmt, 2, acc);
+	if (res != SQLITE_OK) {
+		_log(MOSQ_LOG_ERR, "Can't bind: %s", sqlite3_errmsg(db->sq));
+		return (SQLITE_ERROR);
+	}
+	res = sqlite3_step(stmt);
+	if (res != SQLITE_ROW && res != SQLITE_DONE)
+		_log(MOSQ_LOG_ERR, "step: %s", sqlite3_errmsg(db->sq));
+	return (res);
+}
+
+static void db_close(struct sqlite_db *db)
 {
-	bool ret;
-	const char *userquery = p_stab("sqliteuserquery");
-	ret = sqlite3_prepare(conf->sq, userquery, strlen(userquery), &conf->stmt, NULL) == SQLITE_OK;
-	if (!ret)
-		_log(MOSQ_LOG_WARNING, "Can't prepare: %s\n", sqlite3_errmsg(conf->sq));
-	return ret;
+	sqlite3_finalize(db->stmt);
+	sqlite3_finalize(db->superstmt);
+	sqlite3_finalize(db->aclstmt);
+	sqlite3_close(db->sq);
+	pthread_mutex_destroy(&db->lock);
+	free(db);
+}
+
+/*
+ * Open dbpath and prepare the queries. The returned database holds one
+ * reference, which belongs to the back-end once it is swapped in.
+ */
+
+static struct sqlite_db *db_open(struct sqlite_backend *conf)
+{
+	struct sqlite_db *db;
+	int flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_PRIVATECACHE;
+
+	if ((db = calloc(1, sizeof(struct sqlite_db))) == NULL)
+		return (NULL);
+	pthread_mutex_init(&db->lock, NULL);
+	db->refs = 1;
+
+	if (sqlite3_open_v2(conf->dbpath, &db->sq, flags, NULL) != SQLITE_OK) {
+		_log(MOSQ_LOG_ERR, "failed to open: %s", conf->dbpath);
+		db_close(db);
+		return (NULL);
+	}
+
+	/*
+	 * The plugin never writes. Reading through a memory map avoids a
+	 * read(2) and a copy per page, and a large page cache keeps the
+	 * b-tree interior pages hot.
+	 */
+
+	pragma(db, "PRAGMA query_only = %ld", 1);
+	pragma(db, "PRAGMA mmap_size = %ld", conf->mmap_size);
+	pragma(db, "PRAGMA cache_size = -%ld", conf->cache_kb);
+	pragma(db, "PRAGMA temp_store = %ld", 2);
+
+	if ((db->stmt = prepareStatement(db, conf->userquery)) == NULL ||
+	    (conf->superquery && (db->superstmt = prepareStatement(db, conf->superquery)) == NULL) ||
+	    (conf->aclquery && (db->aclstmt = prepareStatement(db, conf->aclquery)) == NULL)) {
+		db_close(db);
+		return (NULL);
+	}
+	return (db);
+}
+
+static struct sqlite_db *db_get(struct sqlite_backend *conf)
+{
+	struct sqlite_db *db;
+
+	pthread_mutex_lock(&conf->lock);
+	if ((db = conf->db) != NULL)
+		db->refs++;
+	pthread_mutex_unlock(&conf->lock);
+	return (db);
+}
+
+static void db_put(struct sqlite_backend *conf, struct sqlite_db *db)
+{
+	int refs;
+
+	pthread_mutex_lock(&conf->lock);
+	refs = --db->refs;
+	pthread_mutex_unlock(&conf->lock);
+	if (refs == 0)
+		db_close(db);
+}
+
+/*
+ * Called on the watch thread when dbpath has been replaced. The new file
+ * is opened and prepared before it is swapped in, so lookups never wait
+ * for it; if it can't be used, the old database stays in service.
+ */
+
+static int be_sqlite_changed(void *handle)
+{
+	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
+	struct sqlite_db *db, *old;
+
+	if ((db = db_open(conf)) == NULL) {
+		_log(MOSQ_LOG_WARNING, "sqlite: keeping the previous %s", conf->dbpath);
+		return (0);
+	}
+
+	pthread_mutex_lock(&conf->lock);
+	old = conf->db;
+	conf->db = db;
+	pthread_mutex_unlock(&conf->lock);
+
+	if (old)
+		db_put(conf, old);
+	return (1);
 }
 
 void *be_sqlite_init()
 {
 	struct sqlite_backend *conf;
-	int flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_SHAREDCACHE;
-	char *dbpath, *userquery;
+	char *dbpath, *userquery, *p;
 
 	if ((dbpath = p_stab("dbpath")) == NULL) {
 		_fatal("Mandatory parameter `dbpath' missing");
@@ -63,15 +225,26 @@ void *be_sqlite_init()
 		_fatal("Mandatory parameter `sqliteuserquery' missing");
 		return (NULL);
 	}
-	conf = (struct sqlite_backend *)malloc(sizeof(struct sqlite_backend));
-	conf->stmt = NULL;
 
-	if (sqlite3_open_v2(dbpath, &conf->sq, flags, NULL) != SQLITE_OK) {
-		_log(MOSQ_LOG_ERR, "failed to open: %s", dbpath);
-		free(conf);
+	conf = (struct sqlite_backend *)calloc(1, sizeof(struct sqlite_backend));
+	if (conf == NULL)
+		_fatal("Out of memory");
+	pthread_mutex_init(&conf->lock, NULL);
+
+	conf->dbpath = strdup(dbpath);
+	conf->userquery = strdup(userquery);
+	if ((p = p_stab("sqlitesuperquery")) != NULL)
+		conf->superquery = strdup(p);
+	if ((p = p_stab("sqliteaclquery")) != NULL)
+		conf->aclquery = strdup(p);
+	conf->mmap_size = ((p = p_stab("sqlite_mmap_size")) != NULL) ? atol(p) : 256L * 1024 * 1024;
+	conf->cache_kb = ((p = p_stab("sqlite_cache_kb")) != NULL) ? atol(p) : 8192;
+
+	if ((conf->db = db_open(conf)) == NULL) {
+		be_sqlite_destroy(conf);
 		return (NULL);
 	}
-	prepareStatement(conf);
+	conf->watch = watch_new("sqlite", conf->dbpath, be_sqlite_changed, conf);
 
 	return (conf);
 }
@@ -81,78 +254,138 @@ void be_sqlite_destroy(void *handle)
 	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
 
 	if (conf) {
-		sqlite3_finalize(conf->stmt);
-		sqlite3_close(conf->sq);
+		watch_destroy(conf->watch);
+		if (conf->db)
+			db_put(conf, conf->db);
+		pthread_mutex_destroy(&conf->lock);
+		free(conf->dbpath);
+		free(conf->userquery);
+		free(conf->superquery);
+		free(conf->aclquery);
 		free(conf);
 	}
 }
 
+/* Reopen dbpath on the watch thread, e.g. when mosquitto is sent a SIGHUP */
+void be_sqlite_reload(void *handle)
+{
+	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
+
+	if (conf)
+		watch_poke(conf->watch);
+}
+
 int be_sqlite_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
-	int res, retries;
+	struct sqlite_db *db;
 	char *value = NULL, *v;
 	int result = BACKEND_DEFER;
 
-	if (!conf)
+	if (!conf || (db = db_get(conf)) == NULL)
 		return BACKEND_DEFER;
 
-	for (retries = 5; --retries > 0 && value == NULL;) {
-		if (conf->stmt == NULL)
-			if (!prepareStatement(conf))
-				return BACKEND_ERROR;
-
-		res = sqlite3_reset(conf->stmt);
-		if (res != SQLITE_OK) {
-			_log(MOSQ_LOG_ERR, "statement reset: %s", sqlite3_errmsg(conf->sq));
-			result = BACKEND_ERROR;
-			goto out;
-		}
-		res = sqlite3_clear_bindings(conf->stmt);
-		if (res != SQLITE_OK) {
-			_log(MOSQ_LOG_ERR, "bindings clear: %s", sqlite3_errmsg(conf->sq));
-			result = BACKEND_ERROR;
-			goto out;
-		}
-		res = sqlite3_bind_text(conf->stmt, 1, username, -1, SQLITE_STATIC);
-		if (res != SQLITE_OK) {
-			_log(MOSQ_LOG_ERR, "Can't bind: %s", sqlite3_errmsg(conf->sq));
-			result = BACKEND_ERROR;
-			goto out;
-		}
-		res = sqlite3_step(conf->stmt);
-
-		switch (res) {
-		case SQLITE_ROW:
-			v = (char *)sqlite3_column_text(conf->stmt, 0);
-			if (v)
-				value = strdup(v);
-			break;
-		case SQLITE_ERROR:
-			sqlite3_finalize(conf->stmt);
-			conf->stmt = NULL;
-			result = BACKEND_ERROR;
-			break;
-		default:
-			_log(MOSQ_LOG_ERR, "step: %s", sqlite3_errmsg(conf->sq));
-			break;
-		}
+	pthread_mutex_lock(&db->lock);
+	switch (run(db, db->stmt, username, 0)) {
+	case SQLITE_ROW:
+		v = (char *)sqlite3_column_text(db->stmt, 0);
+		if (v)
+			value = strdup(v);
+		break;
+	case SQLITE_DONE:
+		break;
+	default:
+		result = BACKEND_ERROR;
+		break;
 	}
-
-out:
-	sqlite3_reset(conf->stmt);
+	sqlite3_reset(db->stmt);
+	pthread_mutex_unlock(&db->lock);
+	db_put(conf, db);
 
 	*phash = value;
 	return result;
 }
 
+/*
+ * sqlitesuperquery returns one row whose first column is non-zero for
+ * a superuser, e.g. SELECT COUNT(*) FROM users WHERE username = ? AND super = 1
+ */
+
 int be_sqlite_superuser(void *handle, const char *username)
 {
-	return BACKEND_DEFER;
+	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
+	struct sqlite_db *db;
+	int issuper = BACKEND_DEFER;
+
+	if (!conf || !conf->superquery || (db = db_get(conf)) == NULL)
+		return BACKEND_DEFER;
+
+	pthread_mutex_lock(&db->lock);
+	switch (run(db, db->superstmt, username, 0)) {
+	case SQLITE_ROW:
+		if (sqlite3_column_int(db->superstmt, 0))
+			issuper = BACKEND_ALLOW;
+		break;
+	case SQLITE_DONE:
+		break;
+	default:
+		issuper = BACKEND_ERROR;
+		break;
+	}
+	sqlite3_reset(db->superstmt);
+	pthread_mutex_unlock(&db->lock);
+	db_put(conf, db);
+
+	return (issuper);
 }
 
+/*
+ * sqliteaclquery returns the topic patterns the user may access, with
+ * the username bound to ?1 and the requested access to ?2, e.g.
+ * SELECT topic FROM acls WHERE username = ? AND (rw & ?) > 0
+ * Without it, every topic is allowed.
+ */
+
 int be_sqlite_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
-	return BACKEND_ALLOW;
+	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
+	struct sqlite_db *db;
+	int match = BACKEND_DEFER, res;
+	const char *v;
+	char *expanded;
+	bool bf;
+
+	if (!conf)
+		return BACKEND_DEFER;
+	if (!conf->aclquery)
+		return BACKEND_ALLOW;
+	if ((db = db_get(conf)) == NULL)
+		return BACKEND_DEFER;
+
+	pthread_mutex_lock(&db->lock);
+	for (res = run(db, db->aclstmt, username, acc); res == SQLITE_ROW; res = sqlite3_step(db->aclstmt)) {
+		if ((v = (const char *)sqlite3_column_text(db->aclstmt, 0)) == NULL)
+			continue;
+
+		t_expand(clientid, username, v, &expanded);
+		if (expanded && *expanded) {
+			bf = false;
+			mosquitto_topic_matches_sub(expanded, topic, &bf);
+			_log(LOG_DEBUG, "  sqlite: topic_matches(%s, %s) == %d",
+			     expanded, topic, bf);
+			if (bf)
+				match = BACKEND_ALLOW;
+		}
+		free(expanded);
+		if (match == BACKEND_ALLOW)
+			break;
+	}
+	if (res != SQLITE_ROW && res != SQLITE_DONE)
+		match = BACKEND_ERROR;
+	sqlite3_reset(db->aclstmt);
+	pthread_mutex_unlock(&db->lock);
+	db_put(conf, db);
+
+	return (match);
 }
 #endif /* BE_SQLITE */
@@ -29,15 +29,27 @@
 
 #ifdef BE_SQLITE
 
+#include <pthread.h>
 #include <sqlite3.h>
 
+struct sqlite_db;
+struct watch;
+
 struct sqlite_backend {
-	sqlite3 *sq;
-	sqlite3_stmt *stmt;
+	pthread_mutex_t lock;		/* Protects db */
+	struct sqlite_db *db;		/* The database currently in use */
+	char *dbpath;
+	char *userquery;
+	char *superquery;		/* or NULL */
+	char *aclquery;			/* or NULL */
+	long mmap_size;
+	long cache_kb;
+	struct watch *watch;		/* Reloads dbpath when it is replaced */
 };
 
 void *be_sqlite_init();
 void be_sqlite_destroy(void *handle);
+void be_sqlite_reload(void *handle);
 int be_sqlite_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid);
 int be_sqlite_access(void *handle, const char *username, char *topic);
 int be_sqlite_superuser(void *handle, const char *username);
@@ -31,9 +31,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include <mosquitto.h>
 #include "userdata.h"
 #include "cache.h"
+#include "backends.h"
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include "uthash.h"
@@ -80,48 +82,70 @@ static void hexify(const char *data, char *hex)
 	// printf("%s\n", hex);
 }
 
-/* access is desired read/write access
- * granted is what Mosquitto auth-plug actually granted
- */
-
-void acl_cache(const char *clientid, const char *username, const char *topic, int access, int granted, void *userdata)
+void cache_init(struct cache *c)
 {
-	char *data;
-	char hex[SHA_DIGEST_LENGTH * 2 + 1];
-	struct cacheentry *a, *tmp;
-	struct userdata *ud = (struct userdata *)userdata;
-	time_t cacheseconds = ud->acl_cacheseconds;
-	time_t now;
+	int n;
 
-	if (ud->acl_cacheseconds <= 0) {
-		return;
+	for (n = 0; n < CACHE_SHARDS; n++) {
+		pthread_mutex_init(&c->shard[n].mutex, NULL);
+		c->shard[n].entries = NULL;
 	}
+}
 
-	if (ud->acl_cachejitter > 0) {
-		cacheseconds += rand() * (ud->acl_cachejitter * 2) / RAND_MAX - ud->acl_cachejitter;
-		if (cacheseconds <= 0) {
-			return;
+void cache_free(struct cache *c)
+{
+	struct cacheentry *a, *tmp;
+	int n;
+
+	for (n = 0; n < CACHE_SHARDS; n++) {
+		HASH_ITER(hh, c->shard[n].entries, a, tmp) {
+			HASH_DEL(c->shard[n].entries, a);
+			free(a);
 		}
+		pthread_mutex_destroy(&c->shard[n].mutex);
 	}
+}
 
-	if (!clientid || !username || !topic) {
-		return;
-	}
+static struct cacheshard *cache_shard(struct cache *c, const char *hex)
+{
+	int n = *hex;
 
-	now = time(NULL);
+	n = (n >= 'A') ? n - 'A' + 10 : n - '0';
+	return (&c->shard[n & (CACHE_SHARDS - 1)]);
+}
 
-	data = malloc(strlen(clientid) + strlen(username) + strlen(topic) + 20);
-	sprintf(data, "%s:%s:%s:%d", clientid, username, topic, access);
-	hexify(data, hex);
-	free(data);
+/*
+ * Return `ttl' with up to +/- `jitter' seconds added. Each thread has
+ * its own random state.
+ */
+
+static time_t jittered(time_t ttl, time_t jitter)
+{
+	static __thread unsigned int seed = 0;
+
+	if (jitter <= 0)
+		return (ttl);
+	if (seed == 0)
+		seed = (unsigned int)time(NULL) ^ (unsigned int)(size_t)&seed;
 
-	HASH_FIND_STR(ud->aclcache, hex, a);
+	return (ttl + (time_t)rand_r(&seed) * (jitter * 2) / RAND_MAX - jitter);
+}
+
+static void cache_put(struct cache *c, const char *hex, int granted, time_t cacheseconds, const char *what)
+{
+	struct cacheshard *sh = cache_shard(c, hex);
+	struct cacheentry *a, *tmp;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&sh->mutex);
+
+	HASH_FIND_STR(sh->entries, hex, a);
 	if (a) {
 		a->granted = granted;
 
-		if (time(NULL) > a->expire_time) {
-			_log(LOG_DEBUG, " Expired [%s] for (%s,%s,%d)", hex, clientid, username, access);
-			HASH_DEL(ud->aclcache, a);
+		if (now > a->expire_time) {
+			_log(LOG_DEBUG, " Expired [%s] for %s", hex, what);
+			HASH_DEL(sh->entries, a);
 			free(a);
 		}
 	} else {
@@ -129,58 +153,107 @@ void acl_cache(const char *clientid, const char *username, const char *topic, in
 		strcpy(a->hex, hex);
 		a->granted = granted;
 		a->expire_time = now + cacheseconds;
-		HASH_ADD_STR(ud->aclcache, hex, a);
-		_log(LOG_DEBUG, " Cached  [%s] for (%s,%s,%d)", hex, clientid, username, access);
+		HASH_ADD_STR(sh->entries, hex, a);
+		_log(LOG_DEBUG, " Cached  [%s] for %s", hex, what);
 	}
 
 	/*
-	 * Check whole cache for items which need deleting. Important with
+	 * Check the shard for items which need deleting. Important with
 	 * clients who show up once only (mosquitto_[sp]ub with variable clientIDs
 	 */
 
-	HASH_ITER(hh, ud->aclcache, a, tmp) {
+	HASH_ITER(hh, sh->entries, a, tmp) {
 		if (now > a->expire_time) {
 			_log(LOG_DEBUG, " Cleanup [%s]", a->hex);
-			HASH_DEL(ud->aclcache, a);
+			HASH_DEL(sh->entries, a);
 			free(a);
 		}
 	}
+
+	pthread_mutex_unlock(&sh->mutex);
 }
 
-int acl_cache_q(const char *clientid, const char *username, const char *topic, int access, void *userdata)
+static int cache_get(struct cache *c, const char *hex, const char *what)
+{
+	struct cacheshard *sh = cache_shard(c, hex);
+	struct cacheentry *a;
+	int granted = MOSQ_ERR_UNKNOWN;
+
+	pthread_mutex_lock(&sh->mutex);
+
+	HASH_FIND_STR(sh->entries, hex, a);
+	if (a) {
+		if (time(NULL) > a->expire_time) {
+			_log(LOG_DEBUG, " Expired [%s] for %s", hex, what);
+			HASH_DEL(sh->entries, a);
+			free(a);
+		} else {
+			granted = a->granted;
+		}
+	}
+
+	pthread_mutex_unlock(&sh->mutex);
+
+	return (granted);
+}
+
+/* access is desired read/write access
+ * granted is what Mosquitto auth-plug actually granted
+ */
+
+void acl_cache(const char *clientid, const char *username, const char *topic, int access, int granted, void *userdata)
 {
 	char *data;
 	char hex[SHA_DIGEST_LENGTH * 2 + 1];
-	struct cacheentry *a;
 	struct userdata *ud = (struct userdata *)userdata;
-	int granted = MOSQ_ERR_UNKNOWN;
+	time_t cacheseconds;
 
 	if (ud->acl_cacheseconds <= 0) {
-		return (MOSQ_ERR_UNKNOWN);
+		return;
+	}
+
+	if ((cacheseconds = backend_ttl_get()) < 0)
+		cacheseconds = jittered(ud->acl_cacheseconds, ud->acl_cachejitter);
+	if (cacheseconds <= 0) {
+		return;
 	}
 
 	if (!clientid || !username || !topic) {
-		return (MOSQ_ERR_UNKNOWN);
+		return;
 	}
 
 	data = malloc(strlen(clientid) + strlen(username) + strlen(topic) + 20);
 	sprintf(data, "%s:%s:%s:%d", clientid, username, topic, access);
 	hexify(data, hex);
+
+	sprintf(data, "(%s,%s,%d)", clientid, username, access);
+	cache_put(&ud->aclcache, hex, granted, cacheseconds, data);
 	free(data);
+}
 
-	HASH_FIND_STR(ud->aclcache, hex, a);
-	if (a) {
-		// printf("---> CACHED! %d\n", a->granted);
+int acl_cache_q(const char *clientid, const char *username, const char *topic, int access, void *userdata)
+{
+	char *data;
+	char hex[SHA_DIGEST_LENGTH * 2 + 1];
+	struct userdata *ud = (struct userdata *)userdata;
+	int granted;
 
-		if (time(NULL) > a->expire_time) {
-			_log(LOG_DEBUG, " Expired [%s] for (%s,%s,%d)", hex, clientid, username, access);
-			HASH_DEL(ud->aclcache, a);
-			free(a);
-		} else {
-			granted = a->granted;
-		}
+	if (ud->acl_cacheseconds <= 0) {
+		return (MOSQ_ERR_UNKNOWN);
+	}
+
+	if (!clientid || !username || !topic) {
+		return (MOSQ_ERR_UNKNOWN);
 	}
 
+	data = malloc(strlen(clientid) + strlen(username) + strlen(topic) + 20);
+	sprintf(data, "%s:%s:%s:%d", clientid, username, topic, access);
+	hexify(data, hex);
+
+	sprintf(data, "(%s,%s,%d)", clientid, username, access);
+	granted = cache_get(&ud->aclcache, hex, data);
+	free(data);
+
 	return (granted);
 }
 
@@ -191,64 +264,30 @@ void auth_cache(const char *username, const char *password, int granted, void *u
 {
 	char *data;
 	char hex[SHA_DIGEST_LENGTH * 2 + 1];
-	struct cacheentry *a, *tmp;
 	struct userdata *ud = (struct userdata *)userdata;
-	time_t cacheseconds = ud->auth_cacheseconds;
-	time_t now;
+	time_t cacheseconds;
 
 	if (ud->auth_cacheseconds <= 0) {
 		return;
 	}
 
-	if (ud->auth_cachejitter > 0) {
-		cacheseconds += rand() * (ud->auth_cachejitter * 2) / RAND_MAX - ud->auth_cachejitter;
-		if (cacheseconds <= 0) {
-			return;
-		}
+	if ((cacheseconds = backend_ttl_get()) < 0)
+		cacheseconds = jittered(ud->auth_cacheseconds, ud->auth_cachejitter);
+	if (cacheseconds <= 0) {
+		return;
 	}
 
 	if (!username || !password) {
 		return;
 	}
 
-	now = time(NULL);
-
-	data = malloc(strlen(username) + strlen(password) + 2);
+	data = malloc(strlen(username) + strlen(password) + 3);
 	sprintf(data, "%s:%s", username, password);
 	hexify(data, hex);
-	free(data);
-
-	HASH_FIND_STR(ud->authcache, hex, a);
-	if (a) {
-		a->granted = granted;
-
-		if (time(NULL) > a->expire_time) {
-			_log(LOG_DEBUG, " Expired [%s] for (%s)", hex, username);
-			HASH_DEL(ud->authcache, a);
-			free(a);
-		}
-	} else {
-		a = (struct cacheentry *)malloc(sizeof(struct cacheentry));
-		strcpy(a->hex, hex);
-		a->granted = granted;
-		a->expire_time = now + cacheseconds;
-
-		HASH_ADD_STR(ud->authcache, hex, a);
-		_log(LOG_DEBUG, " Cached  [%s] for (%s)", hex, username);
-	}
 
-	/*
-	 * Check whole cache for items which need deleting. Important with
-	 * clients who show up once only (mosquitto_[sp]ub with variable clientIDs
-	 */
-
-	HASH_ITER(hh, ud->authcache, a, tmp) {
-		if (now > a->expire_time) {
-			_log(LOG_DEBUG, " Cleanup [%s]", a->hex);
-			HASH_DEL(ud->authcache, a);
-			free(a);
-		}
-	}
+	sprintf(data, "(%s)", username);
+	cache_put(&ud->authcache, hex, granted, cacheseconds, data);
+	free(data);
 }
 
 
@@ -256,9 +295,8 @@ int auth_cache_q(const char *username, const char *password, void *userdata)
 {
 	char *data;
 	char hex[SHA_DIGEST_LENGTH * 2 + 1];
-	struct cacheentry *a;
 	struct userdata *ud = (struct userdata *)userdata;
-	int granted = MOSQ_ERR_UNKNOWN;
+	int granted;
 
 	if (ud->auth_cacheseconds <= 0) {
 		return (MOSQ_ERR_UNKNOWN);
@@ -268,21 +306,73 @@ int auth_cache_q(const char *username, const char *password, void *userdata)
 		return (MOSQ_ERR_UNKNOWN);
 	}
 
-	data = malloc(strlen(username) + strlen(password) + 2);
+	data = malloc(strlen(username) + strlen(password) + 3);
 	sprintf(data, "%s:%s", username, password);
 	hexify(data, hex);
+
+	sprintf(data, "(%s)", username);
+	granted = cache_get(&ud->authcache, hex, data);
 	free(data);
 
-	HASH_FIND_STR(ud->authcache, hex, a);
-	if (a) {
-		if (time(NULL) > a->expire_time) {
-			_log(LOG_DEBUG, " Expired [%s] for (%s)", hex, username);
-			HASH_DEL(ud->authcache, a);
-			free(a);
-		} else {
-			granted = a->granted;
-		}
+	return granted;
+}
+
+/*
+ * The client table maps the broker's client handle to the names it
+ * logged in with, for ACL checks which only get the handle. Logins
+ * replace entries while ACL checks read them, so readers get copies.
+ */
+
+void client_put(const void *key, const char *username, const char *clientid, void *userdata)
+{
+	struct userdata *ud = (struct userdata *)userdata;
+	struct cliententry *e;
+
+	pthread_rwlock_wrlock(&ud->clients_lock);
+	HASH_FIND(hh, ud->clients, &key, sizeof(void *), e);
+	if (e) {
+		free(e->username);
+		free(e->clientid);
+	} else {
+		e = (struct cliententry *)malloc(sizeof(struct cliententry));
+		e->key = (void *)key;
+		HASH_ADD(hh, ud->clients, key, sizeof(void *), e);
 	}
+	e->username = strdup(username);
+	e->clientid = strdup(clientid);
+	pthread_rwlock_unlock(&ud->clients_lock);
+}
 
-	return granted;
+/*
+ * Return TRUE and copies of the names logged in with `key', which the
+ * caller frees, or FALSE if the client is unknown.
+ */
+
+int client_get(const void *key, char **username, char **clientid, void *userdata)
+{
+	struct userdata *ud = (struct userdata *)userdata;
+	struct cliententry *e;
+
+	pthread_rwlock_rdlock(&ud->clients_lock);
+	HASH_FIND(hh, ud->clients, &key, sizeof(void *), e);
+	if (e) {
+		*username = strdup(e->username);
+		*clientid = strdup(e->clientid);
+	}
+	pthread_rwlock_unlock(&ud->clients_lock);
+
+	return (e != NULL);
+}
+
+void client_free(void *userdata)
+{
+	struct userdata *ud = (struct userdata *)userdata;
+	struct cliententry *e, *tmp;
+
+	HASH_ITER(hh, ud->clients, e, tmp) {
+		HASH_DEL(ud->clients, e);
+		free(e->username);
+		free(e->clientid);
+		free(e);
+	}
 }
@@ -28,6 +28,7 @@
  */
 
 #include <time.h>
+#include <pthread.h>
 #include "uthash.h"
 #include <openssl/sha.h>
 
@@ -41,10 +42,34 @@ struct cacheentry {
         UT_hash_handle hh;
 };
 
+/*
+ * Caches are split into shards by the first hex digit of the key, each
+ * with its own lock, so that concurrent lookups rarely contend and the
+ * expiry sweep on insert only walks one shard.
+ */
+
+#define CACHE_SHARDS	16
+
+struct cacheshard {
+	pthread_mutex_t mutex;
+	struct cacheentry *entries;
+};
+
+struct cache {
+	struct cacheshard shard[CACHE_SHARDS];
+};
+
+void cache_init(struct cache *c);
+void cache_free(struct cache *c);
+
 void acl_cache(const char *clientid, const char *username, const char *topic, int access, int granted, void *userdata);
 int acl_cache_q(const char *clientid, const char *username, const char *topic, int access, void *userdata);
 
 void auth_cache(const char *username, const char *password, int granted, void *userdata);
 int auth_cache_q(const char *username, const char *password, void *userdata);
 
+void client_put(const void *key, const char *username, const char *clientid, void *userdata);
+int client_get(const void *key, char **username, char **clientid, void *userdata);
+void client_free(void *userdata);
+
 #endif
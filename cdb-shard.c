@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2019 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * cdb-shard: build the files of a sharded CDB (auth_opt_cdb_shards).
+ *
+ *	cdb-shard [-m] input shard0.cdb [shard1.cdb ...]
+ *
+ * `input' is in the format read by `cdb -c' ("+klen,dlen:key->data"
+ * lines, ended by an empty line), or with -m in that of `cdb -cm' ("key
+ * value" lines). The output files must be listed in the same order as in
+ * cdb_shards. Each shard is built by its own thread into a temporary
+ * file. Once all of them are complete they are renamed over the shards,
+ * which a running broker then picks up; if any fails, none is replaced.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cdb.h>
+#include "cdb-shard.h"
+
+#define USAGE() fprintf(stderr, "Usage: %s [-m] input shard0.cdb [shard1.cdb ...]\n", progname)
+
+struct shard {
+	int n;
+	const char *path;
+	char *tmp;
+	int ok;
+	pthread_t thread;
+};
+
+static const char *progname;
+static const char *input;
+static const char *in, *inend;		/* The mapped input */
+static int nshards;
+static int simple;			/* -m */
+
+/*
+ * Parse the record at `*pp' and advance past it. Returns 1 for a record,
+ * 0 at the end of the input and -1 on a syntax error.
+ */
+
+static int next_record(const char **pp, const char **key, unsigned *klen, const char **val, unsigned *vlen)
+{
+	const char *p = *pp, *e;
+	unsigned long kl = 0, vl = 0;
+
+	if (simple) {
+		/* "key value", blank lines and #comments skipped */
+		while (p < inend && (*p == '\n' || *p == '#')) {
+			if (*p == '#' && (p = memchr(p, '\n', inend - p)) == NULL)
+				p = inend;
+			else
+				p++;
+		}
+		if (p >= inend)
+			return (0);
+		if ((e = memchr(p, '\n', inend - p)) == NULL)
+			e = inend;
+		*key = p;
+		for (*klen = 0; p < e && *p != ' ' && *p != '\t'; p++)
+			(*klen)++;
+		while (p < e && (*p == ' ' || *p == '\t'))
+			p++;
+		*val = p;
+		*vlen = e - p;
+		*pp = (e < inend) ? e + 1 : e;
+		return (*klen > 0) ? 1 : -1;
+	}
+
+	if (p >= inend || *p == '\n')
+		return (0);
+	if (*p++ != '+')
+		return (-1);
+	while (p < inend && *p >= '0' && *p <= '9')
+		kl = kl * 10 + (*p++ - '0');
+	if (p >= inend || *p++ != ',')
+		return (-1);
+	while (p < inend && *p >= '0' && *p <= '9')
+		vl = vl * 10 + (*p++ - '0');
+	if (p >= inend || *p++ != ':')
+		return (-1);
+	if ((unsigned long)(inend - p) < kl + 2 + vl + 1)
+		return (-1);
+	*key = p;
+	*klen = kl;
+	p += kl;
+	if (p[0] != '-' || p[1] != '>')
+		return (-1);
+	p += 2;
+	*val = p;
+	*vlen = vl;
+	p += vl;
+	if (*p++ != '\n')
+		return (-1);
+	*pp = p;
+	return (1);
+}
+
+static void *build(void *arg)
+{
+	struct shard *sh = (struct shard *)arg;
+	struct cdb_make cdbm;
+	const char *p = in, *key, *val, *tmp = sh->tmp;
+	unsigned klen, vlen;
+	int fd, rc, s;
+
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		perror(tmp);
+		return (NULL);
+	}
+	cdb_make_start(&cdbm, fd);
+
+	while ((rc = next_record(&p, &key, &klen, &val, &vlen)) > 0) {
+		s = cdb_shard_of(key, klen, nshards);
+		if (s != sh->n && s != CDB_SHARD_ALL)
+			continue;
+		if (cdb_make_add(&cdbm, key, klen, val, vlen) != 0) {
+			fprintf(stderr, "%s: %s: %s\n", progname, tmp, strerror(errno));
+			goto fail;
+		}
+	}
+	if (rc < 0) {
+		fprintf(stderr, "%s: %s: bad record at offset %ld\n", progname, input, (long)(p - in));
+		goto fail;
+	}
+	if (cdb_make_finish(&cdbm) != 0 || fsync(fd) != 0) {
+		fprintf(stderr, "%s: %s: %s\n", progname, tmp, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+	sh->ok = 1;
+	return (NULL);
+
+   fail:
+	close(fd);
+	return (NULL);
+}
+
+int main(int argc, char **argv)
+{
+	struct shard *shards;
+	struct stat st;
+	int c, fd, n, rc = 0;
+	void *m;
+
+	progname = argv[0];
+
+	while ((c = getopt(argc, argv, "m")) != EOF) {
+		switch (c) {
+			case 'm':
+				simple = 1;
+				break;
+			default:
+				USAGE();
+				return (2);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2) {
+		USAGE();
+		return (2);
+	}
+	input = argv[0];
+	nshards = argc - 1;
+
+	if ((fd = open(input, O_RDONLY)) == -1 || fstat(fd, &st) != 0) {
+		perror(input);
+		return (1);
+	}
+	if (st.st_size > 0) {
+		if ((m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+			perror(input);
+			return (1);
+		}
+		in = m;
+		inend = in + st.st_size;
+	}
+	close(fd);
+
+	/* Every thread reads the whole input and keeps the records of its shard */
+	shards = calloc(nshards, sizeof(struct shard));
+	for (n = 0; n < nshards; n++) {
+		shards[n].n = n;
+		shards[n].path = argv[n + 1];
+		shards[n].tmp = malloc(strlen(argv[n + 1]) + 5);
+		sprintf(shards[n].tmp, "%s.tmp", argv[n + 1]);
+		if (pthread_create(&shards[n].thread, NULL, build, &shards[n]) != 0) {
+			fprintf(stderr, "%s: cannot start thread\n", progname);
+			return (1);
+		}
+	}
+	for (n = 0; n < nshards; n++) {
+		pthread_join(shards[n].thread, NULL);
+		if (!shards[n].ok)
+			rc = 1;
+	}
+
+	for (n = 0; n < nshards; n++) {
+		if (rc == 0 && rename(shards[n].tmp, shards[n].path) != 0) {
+			fprintf(stderr, "%s: rename %s: %s\n", progname, shards[n].tmp, strerror(errno));
+			rc = 1;
+		}
+		if (rc != 0)
+			unlink(shards[n].tmp);
+		free(shards[n].tmp);
+	}
+	free(shards);
+	return (rc);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2019 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CDB_SHARD_H
+# define __CDB_SHARD_H
+
+#include <string.h>
+
+/*
+ * Routing of records to the files of a sharded CDB (`cdb_shards'). The
+ * back-end and the cdb-shard tool must agree on it: changing the hash
+ * means rebuilding every shard.
+ *
+ * A record lives in the shard of the username it belongs to, so that
+ * "jane", "super:jane" and "acl:jane" are found with one probe of one
+ * file. The "acl:*" records apply to every user and are copied into
+ * every shard.
+ */
+
+#define CDB_SHARD_ALL	(-1)
+
+/* 32-bit FNV-1a */
+static inline unsigned cdb_shard_hash(const char *s, unsigned len)
+{
+	unsigned h = 2166136261U;
+
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/* The shard of the record with key `key', or CDB_SHARD_ALL */
+static inline int cdb_shard_of(const char *key, unsigned klen, int nshards)
+{
+	if (klen == 5 && memcmp(key, "acl:*", 5) == 0)
+		return (CDB_SHARD_ALL);
+	if (klen >= 4 && memcmp(key, "acl:", 4) == 0) {
+		key += 4;
+		klen -= 4;
+	} else if (klen >= 6 && memcmp(key, "super:", 6) == 0) {
+		key += 6;
+		klen -= 6;
+	}
+	return (cdb_shard_hash(key, klen) % nshards);
+}
+
+#endif
@@ -38,14 +38,21 @@ static struct my_opts {
 	UT_hash_handle hh;
 } *globalopts = NULL;
 
+static int frozen = 0;
+
 /*
- * Add a key/value pair to the hash.
+ * Add a key/value pair to the hash. Ignored once the options have been
+ * frozen.
  */
 
 void p_add(char *name, char *value)
 {
 	struct my_opts *mo;
 
+	if (frozen) {
+		return;
+	}
+
 	mo = (struct my_opts *)malloc(sizeof(struct my_opts));
 	if (mo == NULL) {
 		return;
@@ -70,7 +77,19 @@ void p_freeall()
 		if (mo->name)
 			free(mo->name);
 		HASH_DEL(globalopts, mo);
+		free(mo);
 	}
+	frozen = 0;
+}
+
+/*
+ * Make the options read-only. From here on p_stab() may be called from
+ * any thread without locking, as the hash never changes underneath it.
+ */
+
+void p_freeze()
+{
+	frozen = 1;
 }
 
 /*
@@ -29,5 +29,6 @@
 
 void p_add(char *name, char *value);
 void p_freeall();
+void p_freeze();
 char *p_stab(const char *key);
 void p_dump();
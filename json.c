@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2019 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json.h"
+
+#define JSON_DEPTH_MAX	(32)
+
+struct json_reader {
+	const char *p;
+	const char *end;
+};
+
+static struct json *json_value(struct json_reader *r, int depth);
+
+static void json_space(struct json_reader *r)
+{
+	while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r'))
+		r->p++;
+}
+
+static int json_literal(struct json_reader *r, const char *word)
+{
+	size_t len = strlen(word);
+
+	if ((size_t)(r->end - r->p) < len || memcmp(r->p, word, len) != 0)
+		return (0);
+	r->p += len;
+	return (1);
+}
+
+static int json_hex4(const char *p)
+{
+	int n, v = 0;
+
+	for (n = 0; n < 4; n++) {
+		v <<= 4;
+		if (p[n] >= '0' && p[n] <= '9')
+			v |= p[n] - '0';
+		else if (p[n] >= 'a' && p[n] <= 'f')
+			v |= p[n] - 'a' + 10;
+		else if (p[n] >= 'A' && p[n] <= 'F')
+			v |= p[n] - 'A' + 10;
+		else
+			return (-1);
+	}
+	return (v);
+}
+
+/* Append code point `c' to `out' as UTF-8 */
+static char *json_utf8(char *out, unsigned long c)
+{
+	if (c < 0x80) {
+		*out++ = c;
+	} else if (c < 0x800) {
+		*out++ = 0xc0 | (c >> 6);
+		*out++ = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		*out++ = 0xe0 | (c >> 12);
+		*out++ = 0x80 | ((c >> 6) & 0x3f);
+		*out++ = 0x80 | (c & 0x3f);
+	} else {
+		*out++ = 0xf0 | (c >> 18);
+		*out++ = 0x80 | ((c >> 12) & 0x3f);
+		*out++ = 0x80 | ((c >> 6) & 0x3f);
+		*out++ = 0x80 | (c & 0x3f);
+	}
+	return (out);
+}
+
+/* Read a string at r->p, which is past the opening quote */
+static char *json_chars(struct json_reader *r, size_t *plen)
+{
+	const char *p;
+	char *s, *out;
+	long c, lo;
+
+	/* The unescaped string is never longer than the escaped one */
+	for (p = r->p; p < r->end && *p != '"'; p++) {
+		if (*p == '\\')
+			p++;
+	}
+	if (p >= r->end || (s = malloc(p - r->p + 1)) == NULL)
+		return (NULL);
+
+	for (out = s; *r->p != '"'; ) {
+		if ((unsigned char)*r->p < 0x20)
+			goto bad;
+		if (*r->p != '\\') {
+			*out++ = *r->p++;
+			continue;
+		}
+		r->p++;
+		switch (*r->p++) {
+			case '"':  *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '/':  *out++ = '/'; break;
+			case 'b':  *out++ = '\b'; break;
+			case 'f':  *out++ = '\f'; break;
+			case 'n':  *out++ = '\n'; break;
+			case 'r':  *out++ = '\r'; break;
+			case 't':  *out++ = '\t'; break;
+			case 'u':
+				if (r->end - r->p < 4 || (c = json_hex4(r->p)) < 0)
+					goto bad;
+				r->p += 4;
+				/* A surrogate pair is one code point */
+				if (c >= 0xd800 && c < 0xdc00 && r->end - r->p >= 6 &&
+				    r->p[0] == '\\' && r->p[1] == 'u' &&
+				    (lo = json_hex4(r->p + 2)) >= 0xdc00 && lo < 0xe000) {
+					c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+					r->p += 6;
+				}
+				out = json_utf8(out, c);
+				break;
+			default:
+				goto bad;
+		}
+	}
+	r->p++;
+	*out = 0;
+	*plen = out - s;
+	return (s);
+
+    bad:
+	free(s);
+	return (NULL);
+}
+
+static struct json *json_new(enum json_type type)
+{
+	struct json *j;
+
+	if ((j = calloc(1, sizeof(struct json))) != NULL)
+		j->type = type;
+	return (j);
+}
+
+/* Read the items of an array or the members of an object */
+static struct json *json_list(struct json_reader *r, enum json_type type, int depth)
+{
+	struct json *j, *item, **items;
+	char *key = NULL;
+	size_t len;
+	char close = (type == JSON_ARRAY) ? ']' : '}';
+
+	if ((j = json_new(type)) == NULL)
+		return (NULL);
+
+	json_space(r);
+	if (r->p < r->end && *r->p == close) {
+		r->p++;
+		return (j);
+	}
+
+	for (;;) {
+		json_space(r);
+		if (type == JSON_OBJECT) {
+			if (r->p >= r->end || *r->p++ != '"' || (key = json_chars(r, &len)) == NULL)
+				goto bad;
+			json_space(r);
+			if (r->p >= r->end || *r->p++ != ':')
+				goto bad;
+		}
+		if ((item = json_value(r, depth + 1)) == NULL)
+			goto bad;
+		item->key = key;
+		key = NULL;
+		if ((items = realloc(j->items, (j->count + 1) * sizeof(struct json *))) == NULL) {
+			json_free(item);
+			goto bad;
+		}
+		j->items = items;
+		j->items[j->count++] = item;
+
+		json_space(r);
+		if (r->p >= r->end)
+			goto bad;
+		if (*r->p == close) {
+			r->p++;
+			return (j);
+		}
+		if (*r->p++ != ',')
+			goto bad;
+	}
+
+    bad:
+	free(key);
+	json_free(j);
+	return (NULL);
+}
+
+static struct json *json_value(struct json_reader *r, int depth)
+{
+	struct json *j;
+	char num[64], *end;
+	size_t len;
+
+	json_space(r);
+	if (r->p >= r->end || depth > JSON_DEPTH_MAX)
+		return (NULL);
+
+	switch (*r->p) {
+		case '[':
+			r->p++;
+			return (json_list(r, JSON_ARRAY, depth));
+		case '{':
+			r->p++;
+			return (json_list(r, JSON_OBJECT, depth));
+		case '"':
+			r->p++;
+			if ((j = json_new(JSON_STRING)) == NULL)
+				return (NULL);
+			if ((j->string = json_chars(r, &j->length)) == NULL) {
+				free(j);
+				return (NULL);
+			}
+			return (j);
+	}
+
+	if ((j = json_new(JSON_NULL)) == NULL)
+		return (NULL);
+	if (json_literal(r, "null")) {
+		j->type = JSON_NULL;
+	} else if (json_literal(r, "true")) {
+		j->type = JSON_TRUE;
+	} else if (json_literal(r, "false")) {
+		j->type = JSON_FALSE;
+	} else {
+		for (len = 0; r->p + len < r->end && len < sizeof(num) - 1 &&
+		    strchr("+-0123456789.eE", r->p[len]) != NULL; len++)
+			num[len] = r->p[len];
+		num[len] = 0;
+		j->type = JSON_NUMBER;
+		j->number = strtod(num, &end);
+		if (len == 0 || *end != 0) {
+			free(j);
+			return (NULL);
+		}
+		r->p += len;
+	}
+	return (j);
+}
+
+/* Parse `len' bytes of `text'; NULL if they aren't exactly one JSON value */
+struct json *json_parse(const char *text, size_t len)
+{
+	struct json_reader r;
+	struct json *j;
+
+	r.p = text;
+	r.end = text + len;
+	if ((j = json_value(&r, 0)) == NULL)
+		return (NULL);
+	json_space(&r);
+	if (r.p != r.end) {
+		json_free(j);
+		return (NULL);
+	}
+	return (j);
+}
+
+void json_free(struct json *j)
+{
+	int n;
+
+	if (j == NULL)
+		return;
+	for (n = 0; n < j->count; n++)
+		json_free(j->items[n]);
+	free(j->items);
+	free(j->string);
+	free(j->key);
+	free(j);
+}
+
+/* The member `key' of `object', or NULL */
+struct json *json_get(struct json *object, const char *key)
+{
+	int n;
+
+	if (object == NULL || object->type != JSON_OBJECT)
+		return (NULL);
+	for (n = 0; n < object->count; n++) {
+		if (strcmp(object->items[n]->key, key) == 0)
+			return (object->items[n]);
+	}
+	return (NULL);
+}
+
+/* The string member `key' of `object', or NULL if missing or not a string */
+const char *json_string(struct json *object, const char *key)
+{
+	struct json *j = json_get(object, key);
+
+	return (j && j->type == JSON_STRING) ? j->string : NULL;
+}
+
+/* `s' as a JSON string, quotes included; to be freed by the caller */
+char *json_quote(const char *s)
+{
+	const unsigned char *p;
+	char *q, *out;
+
+	if ((q = malloc(strlen(s) * 6 + 3)) == NULL)
+		return (NULL);
+
+	out = q;
+	*out++ = '"';
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p == '"' || *p == '\\') {
+			*out++ = '\\';
+			*out++ = *p;
+		} else if (*p < 0x20) {
+			out += sprintf(out, "\\u%04x", *p);
+		} else {
+			*out++ = *p;
+		}
+	}
+	*out++ = '"';
+	*out = 0;
+	return (q);
+}
@@ -36,7 +36,7 @@
 #include <mosquitto_plugin.h>
 #include "log.h"
 
-int log_quiet=0;
+static int log_quiet=0;
 
 void (*_log)(int priority, const char *fmt, ...);
 
@@ -51,6 +51,16 @@ void log_init(void)
 #endif
 }
 
+/*
+ * Suppress debug messages. Only called while the plugin initializes,
+ * before any other thread logs.
+ */
+
+void log_set_quiet(int quiet)
+{
+	log_quiet = quiet;
+}
+
 void __log(int priority, const char *fmt, ...)
 {
 	va_list va;
@@ -61,12 +71,15 @@ void __log(int priority, const char *fmt, ...)
 
 	time(&now);
 
+	/* Keep lines from different threads from being interleaved */
+	flockfile(stderr);
 	va_start(va, fmt);
 	fprintf(stderr, "%ld: |-- ", now);
 	vfprintf(stderr, fmt, va);
 	fprintf(stderr, "\n");
 	fflush(stderr);
 	va_end(va);
+	funlockfile(stderr);
 }
 
 void _fatal(const char *fmt, ...)
@@ -41,5 +41,4 @@ extern void (*_log)(int priority, const char *fmt, ...);
 void log_init(void);
 void __log(int priority, const char *fmt, ...);
 void _fatal(const char *fmt, ...);
-
-extern int log_quiet;
+void log_set_quiet(int quiet);
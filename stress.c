@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Stress the state the plugin shares between broker threads: the ACL and
+ * auth caches, the client table and the frozen option store. Each thread
+ * checks that what it reads back is what was stored; build with
+ * `make stress', which uses -fsanitize=thread, to also have data races
+ * reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <mosquitto.h>
+#include <openssl/evp.h>
+#include "userdata.h"
+#include "cache.h"
+#include "hash.h"
+#include "log.h"
+
+#define NUSERS		64
+#define NTOPICS		16
+#define NCLIENTS	32
+#define NOPTS		64
+
+#define USAGE() fprintf(stderr, "Usage: %s [-t threads] [-n iterations]\n", progname)
+
+static struct userdata *ud;
+static int iterations = 20000;
+static long errors;
+static pthread_mutex_t errors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void fail(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	fprintf(stderr, "stress: ");
+	vfprintf(stderr, fmt, va);
+	fprintf(stderr, "\n");
+	va_end(va);
+
+	pthread_mutex_lock(&errors_mutex);
+	errors++;
+	pthread_mutex_unlock(&errors_mutex);
+}
+
+/* The verdict a back-end would give, so every thread caches the same one */
+
+static int acl_verdict(int user, int topic, int access)
+{
+	return (((user + topic * 3 + access) % 4) ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED);
+}
+
+static int auth_verdict(int user)
+{
+	return ((user % 3) ? MOSQ_ERR_SUCCESS : MOSQ_ERR_AUTH);
+}
+
+static void *worker(void *arg)
+{
+	unsigned int seed = (unsigned int)(uintptr_t)arg;
+	char username[32], password[32], clientid[32], topic[64], key[32], *u, *c;
+	const char *v;
+	int n, user, t, access, granted, slot;
+
+	for (n = 0; n < iterations; n++) {
+		user = rand_r(&seed) % NUSERS;
+		t = rand_r(&seed) % NTOPICS;
+		access = 1 << (rand_r(&seed) % 3);
+
+		snprintf(username, sizeof(username), "user%d", user);
+		snprintf(password, sizeof(password), "secret%d", user);
+		snprintf(clientid, sizeof(clientid), "client%d", user);
+		snprintf(topic, sizeof(topic), "stress/%d/%s", t, username);
+
+		granted = acl_cache_q(clientid, username, topic, access, ud);
+		if (granted == MOSQ_ERR_UNKNOWN)
+			acl_cache(clientid, username, topic, access, acl_verdict(user, t, access), ud);
+		else if (granted != acl_verdict(user, t, access))
+			fail("acl (%s,%s,%d) cached %d, expected %d", username, topic, access, granted, acl_verdict(user, t, access));
+
+		granted = auth_cache_q(username, password, ud);
+		if (granted == MOSQ_ERR_UNKNOWN)
+			auth_cache(username, password, auth_verdict(user), ud);
+		else if (granted != auth_verdict(user))
+			fail("auth (%s) cached %d, expected %d", username, granted, auth_verdict(user));
+
+		/*
+		 * Clients log in again under a new name while others look
+		 * them up; the names read back must be from one login.
+		 */
+
+		slot = rand_r(&seed) % NCLIENTS;
+		if (rand_r(&seed) % 4 == 0) {
+			client_put((void *)(uintptr_t)(slot + 1), username, clientid, ud);
+		} else if (client_get((void *)(uintptr_t)(slot + 1), &u, &c, ud)) {
+			if (strncmp(u, "user", 4) || strncmp(c, "client", 6) || strcmp(u + 4, c + 6))
+				fail("client %d is (%s,%s)", slot, u, c);
+			free(u);
+			free(c);
+		}
+
+		snprintf(key, sizeof(key), "stress_opt%d", n % NOPTS);
+		snprintf(password, sizeof(password), "value%d", n % NOPTS);
+		if ((v = p_stab(key)) == NULL || strcmp(v, password))
+			fail("option %s is %s", key, v ? v : "<nil>");
+	}
+
+	return (NULL);
+}
+
+int main(int argc, char **argv)
+{
+	char *progname = argv[0], key[32], value[32];
+	int nthreads = 8, c, n;
+	pthread_t *threads;
+
+	while ((c = getopt(argc, argv, "t:n:")) != EOF) {
+		switch (c) {
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			default:
+				exit(USAGE());
+		}
+	}
+	if (nthreads < 1 || iterations < 1)
+		exit(USAGE());
+
+	_log = __log;
+	log_set_quiet(1);
+	OpenSSL_add_all_algorithms();
+
+	for (n = 0; n < NOPTS; n++) {
+		snprintf(key, sizeof(key), "stress_opt%d", n);
+		snprintf(value, sizeof(value), "value%d", n);
+		p_add(key, value);
+	}
+	p_freeze();
+	p_add("stress_opt0", "changed");
+
+	ud = (struct userdata *)calloc(1, sizeof(struct userdata));
+	ud->acl_cacheseconds = 300;
+	ud->auth_cacheseconds = 300;
+	cache_init(&ud->aclcache);
+	cache_init(&ud->authcache);
+	pthread_rwlock_init(&ud->clients_lock, NULL);
+
+	threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	for (n = 0; n < nthreads; n++)
+		pthread_create(&threads[n], NULL, worker, (void *)(uintptr_t)(n + 1));
+	for (n = 0; n < nthreads; n++)
+		pthread_join(threads[n], NULL);
+	free(threads);
+
+	cache_free(&ud->aclcache);
+	cache_free(&ud->authcache);
+	client_free(ud);
+	pthread_rwlock_destroy(&ud->clients_lock);
+	free(ud);
+	p_freeall();
+
+	printf("%d threads x %d iterations: %ld errors\n", nthreads, iterations, errors);
+	return (errors ? 1 : 0);
+}
@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2019 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "supervisor.h"
+#include "backends.h"
+#include "hash.h"
+#include "log.h"
+
+struct sv_slot {
+	void *conn;			/* NULL while the slot is empty */
+	int busy;			/* conn is checked out or being probed */
+	long last_ok;			/* ms timestamp of last successful use */
+	long last_used;			/* ms timestamp of last checkin */
+	pthread_t owner;		/* thread which last checked it out */
+	int owned;			/* owner is valid */
+};
+
+struct supervisor {
+	char *name;
+	void *conf;			/* Back-end handle passed to callbacks */
+	f_sv_connect *connect;
+	f_sv_probe *probe;
+	f_sv_close *close;
+	struct sv_slot *slots;		/* pool_max slots */
+	int nconn;			/* slots holding a connection */
+	int want;			/* connections the pool should hold */
+	int running;
+	int pool_min;
+	int pool_max;
+	long idle_ms;
+	long wait_ms;
+	long probe_ms;
+	long backoff_min_ms;
+	long backoff_max_ms;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000L + ts.tv_nsec / 1000000L);
+}
+
+/*
+ * Wait on the supervisor's condition for at most `ms' milliseconds, or
+ * until signalled if `ms' is not positive. Must be called with the mutex
+ * held.
+ */
+
+static void sv_wait(struct supervisor *sv, long ms)
+{
+	struct timespec ts;
+
+	if (ms <= 0) {
+		pthread_cond_wait(&sv->cond, &sv->mutex);
+		return;
+	}
+
+	deadline_after(ms, &ts);
+	pthread_cond_timedwait(&sv->cond, &sv->mutex, &ts);
+}
+
+static struct sv_slot *sv_empty_slot(struct supervisor *sv)
+{
+	int n;
+
+	for (n = 0; n < sv->pool_max; n++) {
+		if (sv->slots[n].conn == NULL)
+			return (&sv->slots[n]);
+	}
+	return (NULL);
+}
+
+/*
+ * Detach and close the connection in `slot'. Called with the mutex held;
+ * the mutex is dropped around the close callback.
+ */
+
+static void sv_drop(struct supervisor *sv, struct sv_slot *slot)
+{
+	void *conn = slot->conn;
+
+	slot->conn = NULL;
+	slot->busy = 0;
+	slot->owned = 0;
+	sv->nconn--;
+
+	pthread_mutex_unlock(&sv->mutex);
+	sv->close(sv->conf, conn);
+	pthread_mutex_lock(&sv->mutex);
+}
+
+/*
+ * Probe idle connections which haven't proven themselves within the last
+ * probe interval, and close connections above pool_min which have been
+ * idle for longer than pool_idle_seconds. Called with the mutex held.
+ */
+
+static void sv_maintain(struct supervisor *sv)
+{
+	struct sv_slot *slot;
+	void *conn;
+	long now;
+	int n, alive;
+
+	for (n = 0; n < sv->pool_max && sv->running; n++) {
+		slot = &sv->slots[n];
+		if (slot->conn == NULL || slot->busy)
+			continue;
+
+		now = now_ms();
+		if (sv->nconn > sv->pool_min && sv->idle_ms > 0 && now - slot->last_used >= sv->idle_ms) {
+			_log(LOG_DEBUG, "[%s] closing idle connection", sv->name);
+			if (sv->want > sv->pool_min)
+				sv->want--;
+			sv_drop(sv, slot);
+			continue;
+		}
+
+		if (sv->probe == NULL || sv->probe_ms <= 0 || now - slot->last_ok < sv->probe_ms)
+			continue;
+
+		conn = slot->conn;
+		slot->busy = 1;
+		pthread_mutex_unlock(&sv->mutex);
+		alive = (sv->probe(sv->conf, conn) == 0);
+		pthread_mutex_lock(&sv->mutex);
+
+		if (alive) {
+			slot->busy = 0;
+			slot->last_ok = now_ms();
+		} else {
+			_log(LOG_NOTICE, "[%s] liveness probe failed; reconnecting", sv->name);
+			sv_drop(sv, slot);
+		}
+		pthread_cond_broadcast(&sv->cond);
+	}
+}
+
+static void *sv_thread(void *arg)
+{
+	struct supervisor *sv = (struct supervisor *)arg;
+	long backoff = sv->backoff_min_ms;
+	struct sv_slot *slot;
+	void *conn;
+
+	pthread_mutex_lock(&sv->mutex);
+	while (sv->running) {
+		if (sv->nconn < sv->want) {
+			pthread_mutex_unlock(&sv->mutex);
+			conn = sv->connect(sv->conf);
+			pthread_mutex_lock(&sv->mutex);
+
+			if (conn != NULL && (slot = sv_empty_slot(sv)) != NULL) {
+				_log(LOG_NOTICE, "[%s] connection established (%d of %d)",
+					sv->name, sv->nconn + 1, sv->want);
+				slot->conn = conn;
+				slot->busy = 0;
+				slot->owned = 0;
+				slot->last_ok = slot->last_used = now_ms();
+				sv->nconn++;
+				backoff = sv->backoff_min_ms;
+				pthread_cond_broadcast(&sv->cond);
+				continue;
+			}
+			if (conn != NULL) {
+				pthread_mutex_unlock(&sv->mutex);
+				sv->close(sv->conf, conn);
+				pthread_mutex_lock(&sv->mutex);
+				continue;
+			}
+
+			_log(LOG_NOTICE, "[%s] connect failed; retrying in %ld ms", sv->name, backoff);
+			sv_wait(sv, backoff);
+			backoff *= 2;
+			if (backoff > sv->backoff_max_ms)
+				backoff = sv->backoff_max_ms;
+			continue;
+		}
+
+		sv_wait(sv, sv->probe_ms > 0 ? sv->probe_ms : sv->idle_ms);
+		if (sv->running && sv->nconn >= sv->want)
+			sv_maintain(sv);
+	}
+	pthread_mutex_unlock(&sv->mutex);
+
+	return (NULL);
+}
+
+/*
+ * Return the numeric option `<name>_<option>', falling back to the
+ * global `<option>' and then to `defval'.
+ */
+
+long sv_opt(const char *name, const char *option, long defval)
+{
+	char key[128];
+	char *val;
+
+	snprintf(key, sizeof(key), "%s_%s", name, option);
+	if ((val = p_stab(key)) == NULL && (val = p_stab(option)) == NULL)
+		return (defval);
+	return (atol(val));
+}
+
+/*
+ * Create a supervisor for `conf'. One connection attempt is made
+ * synchronously so that the plugin starts with a usable connection if
+ * the database is reachable; the caller can check sv_healthy() to find
+ * out whether it succeeded. The rest of pool_min is filled in by the
+ * supervisor thread. Returns NULL if the thread cannot be started.
+ */
+
+struct supervisor *sv_new(const char *name, void *conf, f_sv_connect *connect, f_sv_probe *probe, f_sv_close *close)
+{
+	struct supervisor *sv;
+	void *conn;
+
+	if ((sv = (struct supervisor *)malloc(sizeof(struct supervisor))) == NULL)
+		return (NULL);
+	memset(sv, 0, sizeof(struct supervisor));
+
+	sv->name = strdup(name);
+	sv->conf = conf;
+	sv->connect = connect;
+	sv->probe = probe;
+	sv->close = close;
+	sv->running = 1;
+	sv->probe_ms = sv_opt(name, "probe_seconds", 30) * 1000L;
+	sv->backoff_min_ms = sv_opt(name, "reconnect_min_ms", 250);
+	sv->backoff_max_ms = sv_opt(name, "reconnect_max_ms", 30000);
+	if (sv->backoff_min_ms <= 0)
+		sv->backoff_min_ms = 1;
+	if (sv->backoff_max_ms < sv->backoff_min_ms)
+		sv->backoff_max_ms = sv->backoff_min_ms;
+
+	sv->pool_min = sv_opt(name, "pool_min", 1);
+	sv->pool_max = sv_opt(name, "pool_max", 4);
+	sv->idle_ms = sv_opt(name, "pool_idle_seconds", 300) * 1000L;
+	sv->wait_ms = sv_opt(name, "pool_wait_ms", 1000);
+	if (sv->pool_min < 1)
+		sv->pool_min = 1;
+	if (sv->pool_max < sv->pool_min)
+		sv->pool_max = sv->pool_min;
+	sv->want = sv->pool_min;
+
+	if ((sv->slots = (struct sv_slot *)calloc(sv->pool_max, sizeof(struct sv_slot))) == NULL) {
+		free(sv->name);
+		free(sv);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&sv->mutex, NULL);
+	pthread_cond_init(&sv->cond, NULL);
+
+	if ((conn = sv->connect(sv->conf)) != NULL) {
+		sv->slots[0].conn = conn;
+		sv->slots[0].last_ok = sv->slots[0].last_used = now_ms();
+		sv->nconn = 1;
+	}
+
+	if (pthread_create(&sv->thread, NULL, sv_thread, sv) != 0) {
+		_log(LOG_NOTICE, "[%s] cannot start supervisor: %s", name, strerror(errno));
+		if (conn)
+			sv->close(sv->conf, conn);
+		pthread_cond_destroy(&sv->cond);
+		pthread_mutex_destroy(&sv->mutex);
+		free(sv->slots);
+		free(sv->name);
+		free(sv);
+		return (NULL);
+	}
+
+	return (sv);
+}
+
+/*
+ * Stop the supervisor thread and close the pool. All connections must
+ * have been checked in.
+ */
+
+void sv_destroy(struct supervisor *sv)
+{
+	int n;
+
+	if (sv == NULL)
+		return;
+
+	pthread_mutex_lock(&sv->mutex);
+	sv->running = 0;
+	pthread_cond_broadcast(&sv->cond);
+	pthread_mutex_unlock(&sv->mutex);
+	pthread_join(sv->thread, NULL);
+
+	for (n = 0; n < sv->pool_max; n++) {
+		if (sv->slots[n].conn)
+			sv->close(sv->conf, sv->slots[n].conn);
+	}
+	pthread_cond_destroy(&sv->cond);
+	pthread_mutex_destroy(&sv->mutex);
+	free(sv->slots);
+	free(sv->name);
+	free(sv);
+}
+
+int sv_healthy(struct supervisor *sv)
+{
+	int healthy;
+
+	pthread_mutex_lock(&sv->mutex);
+	healthy = (sv->nconn > 0);
+	pthread_mutex_unlock(&sv->mutex);
+
+	return (healthy);
+}
+
+/*
+ * Find an idle connection, preferring the one the calling thread used
+ * last so that a thread keeps hitting the same server-side session.
+ * Called with the mutex held.
+ */
+
+static struct sv_slot *sv_idle_slot(struct supervisor *sv, pthread_t self)
+{
+	struct sv_slot *slot, *found = NULL;
+	int n;
+
+	for (n = 0; n < sv->pool_max; n++) {
+		slot = &sv->slots[n];
+		if (slot->conn == NULL || slot->busy)
+			continue;
+		if (slot->owned && pthread_equal(slot->owner, self))
+			return (slot);
+		if (found == NULL)
+			found = slot;
+	}
+	return (found);
+}
+
+/*
+ * Check out a connection for exclusive use. Never connects: if the
+ * supervisor has no healthy connection this returns NULL at once. If
+ * every connection is busy, the pool is asked to grow and the caller
+ * waits up to pool_wait_ms, or what is left of check_deadline_ms, for a
+ * connection to become available.
+ */
+
+void *sv_checkout(struct supervisor *sv)
+{
+	struct sv_slot *slot;
+	pthread_t self = pthread_self();
+	void *conn = NULL;
+	long wait = backend_timeout(sv->wait_ms), deadline;
+
+	if (wait < 0)
+		return (NULL);
+	deadline = now_ms() + (sv->wait_ms > 0 ? wait : 0);
+
+	pthread_mutex_lock(&sv->mutex);
+	while (sv->running && sv->nconn > 0) {
+		if ((slot = sv_idle_slot(sv, self)) != NULL) {
+			slot->busy = 1;
+			slot->owner = self;
+			slot->owned = 1;
+			conn = slot->conn;
+			break;
+		}
+
+		if (sv->want < sv->pool_max) {
+			sv->want++;
+			pthread_cond_broadcast(&sv->cond);
+		}
+		if (now_ms() >= deadline) {
+			_log(LOG_NOTICE, "[%s] no connection available after %ld ms", sv->name, wait);
+			break;
+		}
+		sv_wait(sv, deadline - now_ms());
+	}
+	pthread_mutex_unlock(&sv->mutex);
+
+	return (conn);
+}
+
+/*
+ * Return a connection obtained from sv_checkout(). If the caller saw a
+ * connection-level failure it passes `broken'; the connection is then
+ * closed and the supervisor thread is woken up to re-establish it. As
+ * the other connections in the pool have most likely gone the same way,
+ * they are marked for probing on the supervisor's next pass.
+ */
+
+void sv_checkin(struct supervisor *sv, void *conn, int broken)
+{
+	struct sv_slot *slot = NULL;
+	int n;
+
+	if (conn == NULL)
+		return;
+
+	pthread_mutex_lock(&sv->mutex);
+	for (n = 0; n < sv->pool_max; n++) {
+		if (sv->slots[n].conn == conn) {
+			slot = &sv->slots[n];
+			break;
+		}
+	}
+	if (slot == NULL) {
+		pthread_mutex_unlock(&sv->mutex);
+		return;
+	}
+
+	if (broken) {
+		_log(LOG_NOTICE, "[%s] connection lost; reconnecting in background", sv->name);
+		for (n = 0; n < sv->pool_max; n++) {
+			if (sv->slots[n].conn && !sv->slots[n].busy)
+				sv->slots[n].last_ok = 0;
+		}
+		sv_drop(sv, slot);
+	} else {
+		slot->busy = 0;
+		slot->last_ok = slot->last_used = now_ms();
+	}
+	pthread_cond_broadcast(&sv->cond);
+	pthread_mutex_unlock(&sv->mutex);
+}
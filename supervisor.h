@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2019 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SUPERVISOR_H
+# define __SUPERVISOR_H
+
+/*
+ * A supervisor owns the connection pool of a stateful back-end (MySQL,
+ * PostgreSQL, Redis, ...). A background thread establishes the
+ * connections, reconnects with exponential backoff when they are lost,
+ * probes them periodically while they are idle and closes surplus ones
+ * which have been idle for too long. A caller only ever checks out a
+ * connection which is believed to be healthy, and has it to itself until
+ * it is checked in again; if the back-end is down, sv_checkout() returns
+ * NULL immediately and the back-end answers BACKEND_ERROR instead of
+ * stalling on a reconnect.
+ *
+ * The pool starts with `pool_min' connections and grows on demand, up to
+ * `pool_max', when a checkout finds every connection busy.
+ *
+ * Tunables are read from the plugin options, first as
+ * `<name>_<option>' and then as plain `<option>':
+ *
+ *	probe_seconds		liveness probe interval (30, 0 disables)
+ *	reconnect_min_ms	initial reconnect backoff (250)
+ *	reconnect_max_ms	maximum reconnect backoff (30000)
+ *	pool_min		connections kept open (1)
+ *	pool_max		upper bound on connections (4)
+ *	pool_idle_seconds	close surplus connections idle this long (300)
+ *	pool_wait_ms		wait for a busy pool before failing (1000)
+ */
+
+typedef void *(f_sv_connect)(void *conf);
+typedef int (f_sv_probe)(void *conf, void *conn);
+typedef void (f_sv_close)(void *conf, void *conn);
+
+struct supervisor;
+
+struct supervisor *sv_new(const char *name, void *conf, f_sv_connect *connect, f_sv_probe *probe, f_sv_close *close);
+void sv_destroy(struct supervisor *sv);
+int sv_healthy(struct supervisor *sv);
+void *sv_checkout(struct supervisor *sv);
+void sv_checkin(struct supervisor *sv, void *conn, int broken);
+long sv_opt(const char *name, const char *option, long defval);
+
+#endif
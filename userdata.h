@@ -28,6 +28,7 @@
  */
 
 #include <time.h>
+#include <pthread.h>
 #include "backends.h"
 #include "cache.h"
 
@@ -48,11 +49,12 @@ struct userdata {
 	char *anonusername;		/* Configured name of anonymous MQTT user */
 	time_t acl_cacheseconds;		/* number of seconds to cache ACL lookups */
 	time_t acl_cachejitter;		/* number of seconds to add/remove to cache ACL lookups TTL */
-	struct cacheentry *aclcache;
+	struct cache aclcache;
 	time_t auth_cacheseconds;		/* number of seconds to cache AUTH lookups */
 	time_t auth_cachejitter;		/* number of seconds to add/remove to cache AUTH lookups TTL */
-	struct cacheentry *authcache;
+	struct cache authcache;
 	struct cliententry *clients;
+	pthread_rwlock_t clients_lock;	/* protects clients */
 };
 
 #endif
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2019 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "watch.h"
+#include "supervisor.h"
+#include "backends.h"
+#include "log.h"
+
+struct watch_sig {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	int exists;
+};
+
+struct watch {
+	char *name;
+	char *path;
+	f_watch_changed *changed;
+	void *arg;
+	long interval_ms;
+	struct watch_sig loaded;	/* What the back-end has loaded */
+	struct watch_sig pending;	/* Seen on the previous poll */
+	int poked;			/* Reload even if unchanged */
+	int running;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void watch_stat(struct watch *w, struct watch_sig *sig)
+{
+	struct stat st;
+
+	memset(sig, 0, sizeof(*sig));
+	if (stat(w->path, &st) != 0)
+		return;
+	sig->exists = 1;
+	sig->dev = st.st_dev;
+	sig->ino = st.st_ino;
+	sig->size = st.st_size;
+	sig->mtime = st.st_mtime;
+}
+
+static int watch_same(struct watch_sig *a, struct watch_sig *b)
+{
+	return a->exists == b->exists && a->dev == b->dev && a->ino == b->ino &&
+	    a->size == b->size && a->mtime == b->mtime;
+}
+
+/* Wait for `ms' milliseconds, or until signalled if not positive */
+static void watch_wait(struct watch *w, long ms)
+{
+	struct timespec ts;
+
+	if (ms <= 0) {
+		pthread_cond_wait(&w->cond, &w->mutex);
+		return;
+	}
+
+	deadline_after(ms, &ts);
+	pthread_cond_timedwait(&w->cond, &w->mutex, &ts);
+}
+
+static void *watch_thread(void *arg)
+{
+	struct watch *w = (struct watch *)arg;
+	struct watch_sig now;
+	int poked;
+
+	pthread_mutex_lock(&w->mutex);
+	while (w->running) {
+		/* A poke may have come while the lock was released for changed() */
+		if (!w->poked)
+			watch_wait(w, w->interval_ms);
+		if (!w->running)
+			break;
+
+		poked = w->poked;
+		w->poked = 0;
+		pthread_mutex_unlock(&w->mutex);
+
+		watch_stat(w, &now);
+		if (!poked && (!now.exists || watch_same(&now, &w->loaded) || !watch_same(&now, &w->pending))) {
+			/* Unchanged, gone, or still changing: look again next time */
+			w->pending = now;
+		} else {
+			_log(LOG_NOTICE, "%s: reloading %s", w->name, w->path);
+			/* If that failed, the next poll sees it pending and retries */
+			if (w->changed(w->arg))
+				w->loaded = now;
+			w->pending = now;
+		}
+
+		pthread_mutex_lock(&w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return (NULL);
+}
+
+/*
+ * Start watching `path', which the caller has just loaded. Returns NULL
+ * if the thread cannot be started.
+ */
+
+struct watch *watch_new(const char *name, const char *path, f_watch_changed *changed, void *arg)
+{
+	struct watch *w;
+
+	if ((w = calloc(1, sizeof(struct watch))) == NULL)
+		return (NULL);
+
+	w->name = strdup(name);
+	w->path = strdup(path);
+	w->changed = changed;
+	w->arg = arg;
+	w->interval_ms = sv_opt(name, "watch_seconds", 5) * 1000L;
+	w->running = 1;
+	watch_stat(w, &w->loaded);
+	w->pending = w->loaded;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	if (pthread_create(&w->thread, NULL, watch_thread, w) != 0) {
+		_log(LOG_NOTICE, "%s: cannot start watch thread", name);
+		pthread_mutex_destroy(&w->mutex);
+		pthread_cond_destroy(&w->cond);
+		free(w->name);
+		free(w->path);
+		free(w);
+		return (NULL);
+	}
+	return (w);
+}
+
+/* Have the watch thread reload the file now, whether it changed or not */
+void watch_poke(struct watch *w)
+{
+	if (w == NULL)
+		return;
+	pthread_mutex_lock(&w->mutex);
+	w->poked = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+void watch_destroy(struct watch *w)
+{
+	if (w == NULL)
+		return;
+
+	pthread_mutex_lock(&w->mutex);
+	w->running = 0;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	pthread_join(w->thread, NULL);
+
+	pthread_mutex_destroy(&w->mutex);
+	pthread_cond_destroy(&w->cond);
+	free(w->name);
+	free(w->path);
+	free(w);
+}
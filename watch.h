@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2019 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __WATCH_H
+# define __WATCH_H
+
+/*
+ * A watch polls a file for replacement on a background thread and calls
+ * back once it has changed and then held still for one poll interval,
+ * so that a file still being written is not picked up half-way. The
+ * callback runs on the watch thread; it loads the new file and swaps it
+ * in while lookups continue against the old one. It returns 1 once the
+ * file is in service, or 0 to keep the old one and have the same file
+ * tried again on the next poll.
+ *
+ * The file is compared by device, inode, size and modification time, so
+ * both an atomic rename(2) over it and an in-place rewrite are noticed.
+ *
+ * The poll interval is read from the plugin options as
+ * `<name>_watch_seconds', then `watch_seconds' (5, 0 disables polling).
+ */
+
+typedef int (f_watch_changed)(void *arg);
+
+struct watch;
+
+struct watch *watch_new(const char *name, const char *path, f_watch_changed *changed, void *arg);
+void watch_poke(struct watch *w);
+void watch_destroy(struct watch *w);
+
+#endif